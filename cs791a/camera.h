@@ -21,6 +21,7 @@ public:
     void update();
 
     glm::mat4 getView() const;
+    glm::vec3 getPosition() const {return pos;}
 
 private:
     Engine *engine;
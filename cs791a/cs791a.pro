@@ -20,7 +20,26 @@ SOURCES += main.cpp\
     graphics.cpp \
     camera.cpp \
     terrain.cpp \
-    shape.cpp
+    shape.cpp \
+    rasterreader.cpp \
+    parallel.cpp \
+    samplekernel.cpp \
+    meshcache.cpp \
+    terrainlod.cpp \
+    vertexpack.cpp \
+    tilestreamer.cpp \
+    datasetregistry.cpp \
+    trianglemask.cpp \
+    timeseries.cpp \
+    dataprefetcher.cpp \
+    seriesstats.cpp \
+    seriescontainer.cpp \
+    seriesreduce.cpp \
+    seriesprobe.cpp \
+    elevationgrid.cpp \
+    polylinebatch.cpp \
+    taskpool.cpp \
+    featureindex.cpp
 
 HEADERS  += mainwindow.h \
     engine.h \
@@ -29,7 +48,26 @@ HEADERS  += mainwindow.h \
     camera.h \
     terrain.h \
     vertex.h \
-    shape.h
+    shape.h \
+    rasterreader.h \
+    parallel.h \
+    samplekernel.h \
+    meshcache.h \
+    terrainlod.h \
+    vertexpack.h \
+    tilestreamer.h \
+    datasetregistry.h \
+    trianglemask.h \
+    timeseries.h \
+    dataprefetcher.h \
+    seriesstats.h \
+    seriescontainer.h \
+    seriesreduce.h \
+    seriesprobe.h \
+    elevationgrid.h \
+    polylinebatch.h \
+    taskpool.h \
+    featureindex.h
 
 CONFIG += c++11
 QMAKE_CXX = clang++
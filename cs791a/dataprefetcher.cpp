@@ -0,0 +1,193 @@
+#include "dataprefetcher.h"
+#include "timeseries.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <chrono>
+
+// weight of the newest sample in the latency average
+static const float LATENCY_SMOOTHING = 0.1f;
+
+DataPrefetcher::DataPrefetcher(const Terrain *terrain, const TimeSeries *series, int depth, int loader_threads)
+    : terrain(terrain), series(series), steps(series->size()), position(0), generation(0), latency_ms(0.0f), quit(false)
+{
+    // more slots than steps would only hold duplicates
+    depth = std::max(1, std::min(depth, steps));
+    ring.resize(depth);
+
+    for(Slot& slot : ring) {
+        slot.step = -1;
+        slot.ready = false;
+    }
+
+    for(int i = 0; i < loader_threads; i++)
+        loaders.emplace_back(&DataPrefetcher::loaderMain, this);
+}
+
+DataPrefetcher::~DataPrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+
+    wake.notify_all();
+
+    for(std::thread& t : loaders)
+        t.join();
+}
+
+void DataPrefetcher::setPosition(int step)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if(step == position)
+            return;
+
+        position = step;
+    }
+
+    wake.notify_all();
+}
+
+void DataPrefetcher::flush()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        generation++;
+
+        for(Slot& slot : ring) {
+            if(slot.ready) {
+                slot.step = -1;
+                slot.ready = false;
+            }
+        }
+    }
+
+    wake.notify_all();
+}
+
+bool DataPrefetcher::take(int step, DataValues& data)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = std::find_if(ring.begin(), ring.end(), [step](const Slot& slot) {
+            return slot.ready && slot.step == step;
+        });
+
+        if(it == ring.end())
+            return false;
+
+        std::swap(it->data, data);
+        it->step = -1;
+        it->ready = false;
+    }
+
+    wake.notify_all();
+
+    return true;
+}
+
+int DataPrefetcher::queueDepth() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return std::count_if(ring.begin(), ring.end(), [](const Slot& slot) {return slot.ready;});
+}
+
+float DataPrefetcher::decodeLatency() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return latency_ms;
+}
+
+// The rest is called locked.
+bool DataPrefetcher::inWindow(int step) const
+{
+    int ahead = (step - position + steps) % steps;
+
+    return ahead < (int) ring.size();
+}
+
+// First step of the window no slot holds or is loading, -1 when all are.
+int DataPrefetcher::nextStep() const
+{
+    for(int i = 0; i < (int) ring.size(); i++) {
+        int step = (position + i) % steps;
+
+        bool held = std::any_of(ring.begin(), ring.end(), [step](const Slot& slot) {
+            return slot.step == step;
+        });
+
+        if(!held)
+            return step;
+    }
+
+    return -1;
+}
+
+// A slot that is empty or holds a decoded step playback has moved past.
+// Slots still loading are left alone even when stale.
+DataPrefetcher::Slot* DataPrefetcher::freeSlot()
+{
+    for(Slot& slot : ring) {
+        if(slot.step < 0 || (slot.ready && !inWindow(slot.step)))
+            return &slot;
+    }
+
+    return nullptr;
+}
+
+void DataPrefetcher::loaderMain()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while(true) {
+        int step = -1;
+        Slot *slot = nullptr;
+
+        wake.wait(lock, [&] {
+            if(quit)
+                return true;
+
+            step = nextStep();
+            slot = step >= 0 ? freeSlot() : nullptr;
+
+            return slot != nullptr;
+        });
+
+        if(quit)
+            break;
+
+        slot->step = step;
+        slot->ready = false;
+
+        DataValues data;
+        std::swap(data, slot->data);
+        int started = generation;
+
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+
+        if(!terrain->decodeStep(*series, step, data))
+            qDebug() << "Unable to read time step: " << series->stepName(step);
+
+        float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+
+        std::swap(slot->data, data);
+        slot->ready = (started == generation);
+
+        if(!slot->ready)
+            slot->step = -1;
+
+        latency_ms = (latency_ms > 0.0f) ? latency_ms + LATENCY_SMOOTHING * (ms - latency_ms) : ms;
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef DATAPREFETCHER_H
+#define DATAPREFETCHER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "terrain.h"
+
+class TimeSeries;
+
+// Decodes the time steps of a data series ahead of playback so the GL thread
+// never reads from disk. Loader threads fill a ring of depth slots with the
+// steps following the current position (wrapping around like playback does),
+// each decoded, normalized and packed for terrain by Terrain::decodeStep. The
+// GL thread only takes slots that are ready, which frees them for the next
+// steps.
+class DataPrefetcher {
+public:
+    DataPrefetcher(const Terrain *terrain, const TimeSeries *series, int depth, int loader_threads);
+    ~DataPrefetcher();
+
+    // Moves the window of steps kept decoded to start at step.
+    void setPosition(int step);
+
+    // Drops every decoded step, for when the terrain's data layout changed
+    // (e.g. a new mask). Steps being decoded are dropped as they finish.
+    void flush();
+
+    // If step is decoded, swaps its values into data (empty when the file
+    // could not be read) and returns true. data's old storage is reused for
+    // a later step. Never blocks on loading.
+    bool take(int step, DataValues& data);
+
+    // Decoded steps waiting to be taken.
+    int queueDepth() const;
+
+    // Running average of the time to decode one step, in milliseconds.
+    float decodeLatency() const;
+
+private:
+    struct Slot {
+        int step;                   // -1 when free
+        bool ready;
+        DataValues data;
+    };
+
+    bool inWindow(int step) const;
+    int nextStep() const;
+    Slot* freeSlot();
+    void loaderMain();
+
+    const Terrain *terrain;
+    const TimeSeries *series;
+    int steps;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<Slot> ring;
+    int position;
+    int generation;                 // bumped by flush
+    float latency_ms;
+    bool quit;
+
+    std::vector<std::thread> loaders;
+};
+
+#endif // DATAPREFETCHER_H
@@ -0,0 +1,295 @@
+#include "datasetregistry.h"
+#include "rasterreader.h"
+#include "parallel.h"
+
+#include <gdal_priv.h>
+
+#include <QDebug>
+#include <QFileInfo>
+#include <QHash>
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+
+// A pooled handle nobody holds, in the process wide LRU list.
+struct IdleHandle {
+    QString key;
+    GDALDataset *dataset;
+};
+
+typedef std::list<IdleHandle>::iterator IdleSlot;
+
+struct RegistryEntry {
+    GDALDataset *shared = nullptr;
+    int shared_refs = 0;
+
+    QVector<IdleSlot> idle;         // least recently given back first
+    int handles_out = 0;
+
+    bool range_known = false;
+    SampleRange range;
+
+    QWeakPointer<const BandBuffer> band;
+};
+
+static std::mutex registry_mutex;
+static QHash<QString, RegistryEntry> registry;
+
+// Idle read handles stay open for the next DatasetHandle on their file, up
+// to one per worker thread for a file and MAX_IDLE_HANDLES in all; past
+// that the least recently used one is closed. Most recently used first.
+static const int MAX_IDLE_HANDLES = 64;
+static std::list<IdleHandle> idle_handles;
+
+static QString keyOf(const QString& file)
+{
+    return QFileInfo(file).absoluteFilePath();
+}
+
+static GDALDataset* openFile(const QString& file)
+{
+    auto t = file.toLatin1();
+    return (GDALDataset*) GDALOpen(t.constData(), GA_ReadOnly);
+}
+
+// Closes the least recently used idle handle of entry. Called locked.
+static void evictIdle(RegistryEntry& entry)
+{
+    IdleSlot slot = entry.idle.first();
+    entry.idle.removeFirst();
+
+    GDALClose((GDALDatasetH) slot->dataset);
+    idle_handles.erase(slot);
+}
+
+// Closes the shared handle once nobody uses it. Idle read handles stay in
+// the pool and the statistics stay too, the file tends to come back.
+// Called locked.
+static void closeUnused(RegistryEntry& entry)
+{
+    if(entry.shared_refs > 0 || !entry.shared)
+        return;
+
+    GDALClose((GDALDatasetH) entry.shared);
+    entry.shared = nullptr;
+}
+
+GDALDataset* DatasetRegistry::open(const QString& file)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    RegistryEntry& entry = registry[keyOf(file)];
+
+    if(!entry.shared)
+        entry.shared = openFile(file);
+
+    if(entry.shared)
+        entry.shared_refs++;
+
+    return entry.shared;
+}
+
+void DatasetRegistry::release(const QString& file)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    RegistryEntry& entry = registry[keyOf(file)];
+
+    if(entry.shared_refs > 0)
+        entry.shared_refs--;
+
+    closeUnused(entry);
+}
+
+GDALDataset* DatasetRegistry::acquire(const QString& file)
+{
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        RegistryEntry& entry = registry[keyOf(file)];
+
+        entry.handles_out++;
+
+        if(!entry.idle.isEmpty()) {
+            IdleSlot slot = entry.idle.last();
+            entry.idle.removeLast();
+
+            GDALDataset *ds = slot->dataset;
+            idle_handles.erase(slot);
+            return ds;
+        }
+    }
+
+    // opening can take a while, so not under the lock
+    GDALDataset *ds = openFile(file);
+
+    if(ds == nullptr) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry[keyOf(file)].handles_out--;
+    }
+
+    return ds;
+}
+
+void DatasetRegistry::giveBack(const QString& file, GDALDataset *dataset)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    QString key = keyOf(file);
+    RegistryEntry& entry = registry[key];
+
+    IdleHandle handle = {key, dataset};
+    idle_handles.push_front(handle);
+    entry.idle.push_back(idle_handles.begin());
+    entry.handles_out--;
+
+    if(entry.idle.size() > workerCount())
+        evictIdle(entry);
+
+    if((int) idle_handles.size() > MAX_IDLE_HANDLES)
+        evictIdle(registry[idle_handles.back().key]);
+}
+
+void DatasetRegistry::closeIdle()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    for(const IdleHandle& handle : idle_handles)
+        GDALClose((GDALDatasetH) handle.dataset);
+
+    idle_handles.clear();
+
+    for(RegistryEntry& entry : registry)
+        entry.idle.clear();
+}
+
+bool DatasetRegistry::knownRange(const QString& file, SampleRange& range)
+{
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        const RegistryEntry& entry = registry[keyOf(file)];
+
+        if(entry.range_known) {
+            range = entry.range;
+            return true;
+        }
+    }
+
+    DatasetHandle ds(file);
+
+    if(!ds)
+        return false;
+
+    int gotMin, gotMax;
+
+    GDALRasterBand *raster = ds->GetRasterBand(1);
+    double min = raster->GetMinimum(&gotMin);
+    double max = raster->GetMaximum(&gotMax);
+
+    if(!(gotMin && gotMax))
+        return false;
+
+    range.min = min;
+    range.max = max;
+
+    storeRange(file, range);
+
+    return true;
+}
+
+void DatasetRegistry::storeRange(const QString& file, const SampleRange& range)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    RegistryEntry& entry = registry[keyOf(file)];
+
+    entry.range = range;
+    entry.range_known = true;
+}
+
+QSharedPointer<const BandBuffer> DatasetRegistry::band(const QString& file)
+{
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        QSharedPointer<const BandBuffer> cached = registry[keyOf(file)].band.toStrongRef();
+
+        if(cached)
+            return cached;
+    }
+
+    QSharedPointer<BandBuffer> buffer(new BandBuffer);
+
+    {
+        DatasetHandle ds(file);
+
+        if(!ds) {
+            qDebug() << "Unable to get GDAL Dataset for file: " << file;
+            return QSharedPointer<const BandBuffer>();
+        }
+
+        buffer->width = ds->GetRasterXSize();
+        buffer->height = ds->GetRasterYSize();
+    }
+
+    int width = buffer->width;
+    buffer->samples.resize(width * buffer->height);
+    float *samples = buffer->samples.data();
+
+    int bands = workerCount();
+    QVector<SampleRange> ranges(bands);
+    QVector<char> unread(bands, 0);
+    SampleRange *band_range = ranges.data();
+    char *skipped = unread.data();
+
+    parallelBands(buffer->height, bands, [&](int b, int begin, int end) {
+        DatasetHandle ds(file);
+
+        if(!ds) {
+            skipped[b] = 1;
+            return;
+        }
+
+        RasterReader reader(ds->GetRasterBand(1), begin, end);
+
+        for(int z = begin; z < end; z++) {
+            const float *row = reader.row(z);
+            std::copy(row, row + width, samples + z * width);
+        }
+
+        band_range[b] = reader.range();
+
+        if(reader.failed())
+            skipped[b] = 1;
+    });
+
+    // a half read band would be shared as if it were whole
+    if(unread.contains(1)) {
+        qDebug() << "Unable to read every row of file: " << file;
+        return QSharedPointer<const BandBuffer>();
+    }
+
+    for(const SampleRange& r : ranges)
+        buffer->range.merge(r);
+
+    storeRange(file, buffer->range);
+
+    // two threads may have decoded the same file at once, the first one to
+    // get here wins and the other copy is dropped
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    RegistryEntry& entry = registry[keyOf(file)];
+    QSharedPointer<const BandBuffer> cached = entry.band.toStrongRef();
+
+    if(cached)
+        return cached;
+
+    entry.band = buffer;
+
+    return buffer;
+}
+
+DatasetHandle::DatasetHandle(const QString& file)
+    : file(file), dataset(DatasetRegistry::acquire(file))
+{
+}
+
+DatasetHandle::~DatasetHandle()
+{
+    if(dataset)
+        DatasetRegistry::giveBack(file, dataset);
+}
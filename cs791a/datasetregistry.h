@@ -0,0 +1,76 @@
+#ifndef DATASETREGISTRY_H
+#define DATASETREGISTRY_H
+
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+#include "samplekernel.h"
+
+class GDALDataset;
+
+// Band 1 of a raster decoded to float at full resolution, raw values with
+// nodata as NaN.
+struct BandBuffer {
+    int width, height;
+    QVector<float> samples;
+    SampleRange range;
+};
+
+// Process wide registry of the rasters the scene reads. Each file gets one
+// shared handle plus a pool of read handles for worker threads, and its
+// band statistics and decoded samples are cached so loaders asking for the
+// same DEM do not scan it again. Files are keyed by absolute path. All
+// functions are thread safe.
+class DatasetRegistry {
+public:
+    // Shared handle for file, opened on first use. Meant for the thread
+    // building the scene (metadata, georeferencing); every open needs a
+    // matching release. Returns nullptr when GDAL cannot open the file.
+    static GDALDataset* open(const QString& file);
+    static void release(const QString& file);
+
+    // Raw min/max of band 1, from an earlier sweep or the band's metadata.
+    // Returns false when neither has it yet.
+    static bool knownRange(const QString& file, SampleRange& range);
+
+    // Records the min/max a full sweep of band 1 found.
+    static void storeRange(const QString& file, const SampleRange& range);
+
+    // Band 1 of file decoded whole. It is read on first request and shared
+    // for as long as any caller holds on to it. Returns null on failure.
+    static QSharedPointer<const BandBuffer> band(const QString& file);
+
+    // Closes the read handles kept in the pool. At shutdown, once no
+    // DatasetHandle is left.
+    static void closeIdle();
+
+private:
+    friend class DatasetHandle;
+
+    static GDALDataset* acquire(const QString& file);
+    static void giveBack(const QString& file, GDALDataset *dataset);
+};
+
+// A read handle from the registry's pool for the lifetime of this object.
+// GDAL handles are not thread safe, so a thread holds its own while reading;
+// handles go back to the pool afterwards and stay open for the next reader
+// of the file, a bounded number of them.
+class DatasetHandle {
+public:
+    explicit DatasetHandle(const QString& file);
+    ~DatasetHandle();
+
+    GDALDataset* get() const {return dataset;}
+    GDALDataset* operator->() const {return dataset;}
+    explicit operator bool() const {return dataset != nullptr;}
+
+private:
+    DatasetHandle(const DatasetHandle&);
+    DatasetHandle& operator=(const DatasetHandle&);
+
+    QString file;
+    GDALDataset *dataset;
+};
+
+#endif // DATASETREGISTRY_H
@@ -0,0 +1,90 @@
+#include "elevationgrid.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+ElevationGrid::ElevationGrid(int width, int height, const QVector<float>& heights, int first_row)
+    : grid_width(width), grid_height(height), first_row(first_row),
+      row_count(width > 0 ? heights.size() / width : 0), heights(heights)
+{
+}
+
+void ElevationGrid::toPixels(const double geot[6], const double *geo_x, const double *geo_y, size_t count,
+                             float *col, float *row)
+{
+    // invert the affine part; x = g0 + col g1 + row g2, y = g3 + col g4 + row g5
+    double g[6];
+    std::copy(geot, geot + 6, g);
+    double det = g[1] * g[5] - g[2] * g[4];
+
+    if(det == 0.0) {
+        qDebug() << "Degenerate geotransform, draping over a 1 unit grid";
+        det = 1.0;
+        g[1] = g[5] = 1.0;
+        g[2] = g[4] = 0.0;
+    }
+
+    double inverse[6];
+    inverse[1] = g[5] / det;
+    inverse[2] = -g[2] / det;
+    inverse[4] = -g[4] / det;
+    inverse[5] = g[1] / det;
+    inverse[0] = -(inverse[1] * g[0] + inverse[2] * g[3]);
+    inverse[3] = -(inverse[4] * g[0] + inverse[5] * g[3]);
+
+    // the geotransform addresses pixel corners, vertices sit on centers.
+    // Georeferenced coordinates need double precision until the origin is
+    // subtracted; pixel coordinates are fine as float.
+    double c0 = inverse[0] - 0.5, r0 = inverse[3] - 0.5;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // two points per step
+    __m128d vc0 = _mm_set1_pd(c0), vc1 = _mm_set1_pd(inverse[1]), vc2 = _mm_set1_pd(inverse[2]);
+    __m128d vr0 = _mm_set1_pd(r0), vr1 = _mm_set1_pd(inverse[4]), vr2 = _mm_set1_pd(inverse[5]);
+
+    for(; i + 2 <= count; i += 2) {
+        __m128d x = _mm_loadu_pd(geo_x + i);
+        __m128d y = _mm_loadu_pd(geo_y + i);
+
+        __m128d c = _mm_add_pd(vc0, _mm_add_pd(_mm_mul_pd(x, vc1), _mm_mul_pd(y, vc2)));
+        __m128d r = _mm_add_pd(vr0, _mm_add_pd(_mm_mul_pd(x, vr1), _mm_mul_pd(y, vr2)));
+
+        _mm_storel_pi((__m64*) (col + i), _mm_cvtpd_ps(c));
+        _mm_storel_pi((__m64*) (row + i), _mm_cvtpd_ps(r));
+    }
+#endif
+
+    for(; i < count; i++) {
+        col[i] = c0 + geo_x[i] * inverse[1] + geo_y[i] * inverse[2];
+        row[i] = r0 + geo_x[i] * inverse[4] + geo_y[i] * inverse[5];
+    }
+}
+
+float ElevationGrid::sample(double col, double row) const
+{
+    if(row_count == 0)
+        return 0.0f;
+
+    col = std::max(0.0, std::min(col, double(grid_width - 1)));
+    row = std::max(0.0, std::min(row - first_row, double(row_count - 1)));
+
+    int x0 = std::min(int(col), std::max(grid_width - 2, 0));
+    int z0 = std::min(int(row), std::max(row_count - 2, 0));
+    int x1 = std::min(x0 + 1, grid_width - 1);
+    int z1 = std::min(z0 + 1, row_count - 1);
+
+    float fx = col - x0, fz = row - z0;
+
+    const float *h = heights.constData();
+    float top = h[z0 * grid_width + x0] + (h[z0 * grid_width + x1] - h[z0 * grid_width + x0]) * fx;
+    float bottom = h[z1 * grid_width + x0] + (h[z1 * grid_width + x1] - h[z1 * grid_width + x0]) * fx;
+
+    return top + (bottom - top) * fz;
+}
@@ -0,0 +1,37 @@
+#ifndef ELEVATIONGRID_H
+#define ELEVATIONGRID_H
+
+#include <QVector>
+
+#include <cstddef>
+
+// Normalized DEM heights in one contiguous row major block, for draping
+// vector data over a terrain. May hold only a window of rows (of a streamed
+// DEM); samples outside it clamp to its edge.
+class ElevationGrid {
+public:
+    // heights holds rows [first_row, first_row + heights.size() / width) of
+    // a width x height DEM, normalized with nodata at 0.
+    ElevationGrid(int width, int height, const QVector<float>& heights, int first_row = 0);
+
+    int width() const {return grid_width;}
+    int height() const {return grid_height;}
+
+    // Georeferenced coordinates of count points to pixel coordinates of the
+    // DEM with GDAL geotransform geot, with the center of pixel (0, 0) at
+    // (0, 0) like the terrain's first vertex. Points off the DEM are not
+    // clamped.
+    static void toPixels(const double geot[6], const double *geo_x, const double *geo_y, size_t count,
+                         float *col, float *row);
+
+    // Bilinear height at pixel coordinates, clamped to the grid (and to the
+    // rows held).
+    float sample(double col, double row) const;
+
+private:
+    int grid_width, grid_height;
+    int first_row, row_count;
+    QVector<float> heights;
+};
+
+#endif // ELEVATIONGRID_H
@@ -1,11 +1,16 @@
 #include "engine.h"
 #include "mainwindow.h"
 #include "graphics.h"
+#include "timeseries.h"
+#include "seriesstats.h"
+#include "seriescontainer.h"
+#include "datasetregistry.h"
 
 #include <QDebug>
 #include <QGLFormat>
 #include <QApplication>
 #include <QTimer>
+#include <QDir>
 
 #include <gdal_priv.h>
 #include <ogrsf_frmts.h>
@@ -18,12 +23,21 @@ Engine::Engine(int argc, char **argv)
     : _argc(argc), _argv(argv)
 {
     parseArgs();
+
+    // import mode converts the series and quits without opening a window
+    if(options.import_series) {
+        GDALAllRegister();
+        exit(importSeries() ? 0 : 1);
+    }
+
     init();
 }
 
 Engine::~Engine()
 {
     delete window;
+
+    DatasetRegistry::closeIdle();
 }
 
 void Engine::init()
@@ -83,6 +97,29 @@ void Engine::parseArgs()
             ("sensitivity", program_options::value<float>(&options.camera_sensitivity)->default_value(0.1f), "Mouse Sensitivity")
             ("speed", program_options::value<float>(&options.camera_speed)->default_value(5.0f), "Camera Speed")
             ("data,d", program_options::value<std::string>(&options.data_directory)->default_value("../DryCreek/isnobaloutput/"), "Data Directory")
+            ("data-var", program_options::value<std::string>(&options.data_variable)->default_value("em"), "Isnobal Output Variable to Play Back (em, snow)")
+            ("data-rate", program_options::value<float>(&options.data_rate)->default_value(2.0f), "Time Steps per Second During Playback")
+            ("prefetch", program_options::value<int>(&options.prefetch)->default_value(8), "Time Steps Decoded Ahead of Playback (0 Loads Them on the Render Thread)")
+            ("resident-series", "Keep the Whole Time Series on the GPU and Interpolate Between Steps")
+            ("series-budget", program_options::value<int>(&options.series_budget)->default_value(256), "GPU Memory for a Resident Time Series in MB")
+            ("probe-budget", program_options::value<int>(&options.probe_budget)->default_value(1024), "Memory for the Probe's Copies of the Data Series in MB")
+            ("import-series", "Import the Data Variable's Time Steps Into <data>/<var>.tsc and Exit")
+            ("series-encoding", program_options::value<std::string>(&options.series_encoding)->default_value("float32"), "Imported Sample Encoding (float32, float16, quantized)")
+            ("reduce", program_options::value<std::string>(&options.reduce)->default_value(""), "Show a Reduction of the Series Instead of Playing It (sum, mean, min, max, argmax, crossing:<threshold>, diff:<step>:<step>)")
+            ("reduce-output", program_options::value<std::string>(&options.reduce_output)->default_value(""), "Also Write the Reduction to This GeoTIFF")
+            ("mask-threshold", program_options::value<float>(&options.mask_threshold)->default_value(0.1f), "Normalized Mask Value a Cell Needs to Be Masked")
+            ("cache-dir", program_options::value<std::string>(&options.cache_directory)->default_value(""), "Mesh Cache Directory (Defaults to Next to the DEM)")
+            ("no-cache", "Do Not Read or Write the Mesh and Statistics Caches")
+            ("lod", "Render Single DEMs With Chunked Level of Detail")
+            ("lod-error", program_options::value<float>(&options.lod_error)->default_value(2.0f), "Level of Detail Screen Space Error in Pixels")
+            ("lod-budget", program_options::value<int>(&options.lod_budget)->default_value(2000000), "Level of Detail Triangle Budget per Frame")
+            ("heightmap", "Displace a Shared Grid Mesh by DEM Textures Instead of Building Terrain Geometry")
+            ("compact-vertices", "Upload Terrains and Shapes as 8 Byte Quantized Vertices")
+            ("stream", "Stream Single DEMs From Disk in Tiles Instead of Loading Them Whole")
+            ("tile-size", program_options::value<int>(&options.tile_size)->default_value(256), "Cells per Side of a Streamed Tile")
+            ("tile-budget", program_options::value<int>(&options.tile_budget)->default_value(512), "GPU Memory for Streamed Tiles in MB")
+            ("tile-detail", program_options::value<float>(&options.tile_detail)->default_value(4.0f), "Largest On Screen Size of a Streamed Cell in Pixels")
+            ("shape-error", program_options::value<float>(&options.shape_error)->default_value(1.0f), "Shape Level of Detail Screen Space Error in Pixels")
             ("shape,a", program_options::value<std::vector<std::string>>(&options.shapes), "Shape Files");
 
         program_options::positional_options_description pos;
@@ -113,4 +150,45 @@ void Engine::parseArgs()
 
         options.verbose = vm.count("verbose");
         options.wireframe = vm.count("wireframe");
+        options.mesh_cache = !vm.count("no-cache");
+        options.lod = vm.count("lod");
+        options.heightmap = vm.count("heightmap");
+        options.compact_vertices = vm.count("compact-vertices");
+        options.stream = vm.count("stream");
+        options.resident_series = vm.count("resident-series");
+        options.import_series = vm.count("import-series");
+}
+
+bool Engine::importSeries()
+{
+    QString directory = QString::fromStdString(options.data_directory);
+    QString variable = QString::fromStdString(options.data_variable);
+
+    SeriesContainer::Encoding encoding;
+
+    if(options.series_encoding == "float32")
+        encoding = SeriesContainer::Float32;
+    else if(options.series_encoding == "float16")
+        encoding = SeriesContainer::Float16;
+    else if(options.series_encoding == "quantized")
+        encoding = SeriesContainer::Quantized16;
+    else {
+        std::cerr << "Unknown series encoding: " << options.series_encoding << std::endl;
+        return false;
+    }
+
+    QStringList files;
+    QVector<int> step_numbers;
+    TimeSeries::findSteps(directory, variable, files, step_numbers);
+
+    // the range is stored for normalizing and needed up front to quantize
+    SeriesStats stats;
+
+    if(!seriesStatistics(options, variable, files, stats)) {
+        qDebug() << "No" << variable << "time steps to import in" << directory;
+        return false;
+    }
+
+    return SeriesContainer::write(QDir(directory).filePath(variable + ".tsc"), files, step_numbers,
+                                  stats.range, encoding);
 }
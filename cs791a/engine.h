@@ -14,12 +14,35 @@ struct Options {
     std::string color_map;
     std::vector<std::string> terrain;
     std::vector<std::string> shapes;
+    float shape_error;
     float height_scalar;
     float map_scalar;
     bool wireframe;
     float camera_sensitivity;
     float camera_speed;
     std::string data_directory;
+    std::string data_variable;
+    float data_rate;
+    int prefetch;
+    bool resident_series;
+    int series_budget;
+    int probe_budget;
+    bool import_series;
+    std::string series_encoding;
+    std::string reduce;
+    std::string reduce_output;
+    float mask_threshold;
+    bool mesh_cache;
+    std::string cache_directory;
+    bool lod;
+    float lod_error;
+    int lod_budget;
+    bool heightmap;
+    bool compact_vertices;
+    bool stream;
+    int tile_size;
+    int tile_budget;
+    float tile_detail;
 };
 
 class Engine
@@ -36,6 +59,7 @@ public:
     Graphics *graphics;
 private:
     void parseArgs();
+    bool importSeries();
 
     MainWindow *window;
 
@@ -0,0 +1,160 @@
+#include "featureindex.h"
+
+#include <numeric>
+
+FeatureIndex::FeatureIndex()
+{
+}
+
+// Puts order in STR order: sorted into vertical slices by box center x, of
+// enough boxes for sqrt(nodes) nodes each, and each slice sorted by z.
+// Consecutive runs of capacity boxes then make compact nodes.
+static void sortTiles(const QVector<FeatureIndex::Box>& boxes, QVector<int>& order, int capacity)
+{
+    const FeatureIndex::Box *box = boxes.constData();
+    int count = order.size();
+
+    // sums, not centers, the halves cancel in the comparisons
+    std::sort(order.begin(), order.end(), [box](int a, int b) {
+        return box[a].lower.x + box[a].upper.x < box[b].lower.x + box[b].upper.x;
+    });
+
+    int node_count = (count + capacity - 1) / capacity;
+    int slices = (int) std::ceil(std::sqrt((double) node_count));
+    int slice_size = slices * capacity;
+
+    for(int first = 0; first < count; first += slice_size) {
+        int last = std::min(count, first + slice_size);
+
+        std::sort(order.begin() + first, order.begin() + last, [box](int a, int b) {
+            return box[a].lower.z + box[a].upper.z < box[b].lower.z + box[b].upper.z;
+        });
+    }
+}
+
+static void grow(FeatureIndex::Box& box, const FeatureIndex::Box& other)
+{
+    box.lower = glm::min(box.lower, other.lower);
+    box.upper = glm::max(box.upper, other.upper);
+}
+
+void FeatureIndex::build(const QVector<Box>& item_boxes)
+{
+    boxes = item_boxes;
+    nodes.clear();
+    items.clear();
+
+    int count = boxes.size();
+
+    if(count == 0)
+        return;
+
+    items.resize(count);
+    std::iota(items.begin(), items.end(), 0);
+    sortTiles(boxes, items, NODE_CAPACITY);
+
+    QVector<Node> level;
+
+    for(int first = 0; first < count; first += NODE_CAPACITY) {
+        Node node;
+        node.first = first;
+        node.count = std::min(NODE_CAPACITY, count - first);
+        node.leaf = true;
+        node.box = boxes[items[first]];
+
+        for(int i = first + 1; i < first + node.count; i++)
+            grow(node.box, boxes[items[i]]);
+
+        level.push_back(node);
+    }
+
+    // each level is packed the same way over the one below, until a single
+    // root is left
+    for(;;) {
+        QVector<Box> level_boxes(level.size());
+        QVector<int> order(level.size());
+
+        for(int i = 0; i < level.size(); i++)
+            level_boxes[i] = level[i].box;
+
+        std::iota(order.begin(), order.end(), 0);
+
+        if(level.size() > 1)
+            sortTiles(level_boxes, order, NODE_CAPACITY);
+
+        int base = nodes.size();
+
+        for(int i : order)
+            nodes.push_back(level[i]);
+
+        if(level.size() == 1)
+            break;
+
+        QVector<Node> parents;
+
+        for(int first = 0; first < level.size(); first += NODE_CAPACITY) {
+            Node node;
+            node.first = base + first;
+            node.count = std::min(NODE_CAPACITY, level.size() - first);
+            node.leaf = false;
+            node.box = nodes[node.first].box;
+
+            for(int i = node.first + 1; i < node.first + node.count; i++)
+                grow(node.box, nodes[i].box);
+
+            parents.push_back(node);
+        }
+
+        level = parents;
+    }
+}
+
+// False when the box is entirely outside one of the planes, tested at its
+// corner furthest along the plane's normal.
+static bool intersects(const FeatureIndex::Box& box, const glm::vec4 planes[6])
+{
+    for(int p = 0; p < 6; p++) {
+        const glm::vec4& plane = planes[p];
+
+        float x = plane.x >= 0.0f ? box.upper.x : box.lower.x;
+        float y = plane.y >= 0.0f ? box.upper.y : box.lower.y;
+        float z = plane.z >= 0.0f ? box.upper.z : box.lower.z;
+
+        if(plane.x * x + plane.y * y + plane.z * z + plane.w < 0.0f)
+            return false;
+    }
+
+    return true;
+}
+
+void FeatureIndex::queryFrustum(const glm::vec4 planes[6], QVector<int>& out) const
+{
+    if(nodes.isEmpty())
+        return;
+
+    std::vector<int> stack;
+    stack.push_back(nodes.size() - 1);
+
+    while(!stack.empty()) {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+
+        if(!intersects(node.box, planes))
+            continue;
+
+        for(int i = node.first; i < node.first + node.count; i++) {
+            if(!node.leaf)
+                stack.push_back(i);
+            else if(intersects(boxes[items[i]], planes))
+                out.push_back(items[i]);
+        }
+    }
+}
+
+float FeatureIndex::groundDistance2(const Box& box, float x, float z)
+{
+    float dx = std::max(std::max(box.lower.x - x, x - box.upper.x), 0.0f);
+    float dz = std::max(std::max(box.lower.z - z, z - box.upper.z), 0.0f);
+
+    return dx * dx + dz * dz;
+}
@@ -0,0 +1,117 @@
+#ifndef FEATUREINDEX_H
+#define FEATUREINDEX_H
+
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Static R-tree over item bounding boxes, bulk loaded with Sort-Tile-
+// Recursive packing: every level is cut into vertical slices by x, each
+// slice sorted by z and packed into full nodes. Nodes are stored level by
+// level with the children of a node next to each other, so queries walk
+// flat arrays. Items are numbered by their position in the boxes given to
+// build.
+class FeatureIndex {
+public:
+    struct Box {
+        glm::vec3 lower, upper;
+    };
+
+    FeatureIndex();
+
+    void build(const QVector<Box>& boxes);
+
+    bool isEmpty() const {return nodes.isEmpty();}
+
+    // Appends the items whose boxes are at least partly inside the six
+    // planes (a, b, c, d), inside meaning a x + b y + c z + d >= 0.
+    void queryFrustum(const glm::vec4 planes[6], QVector<int>& out) const;
+
+    // The item closest to (x, z) across the ground, no further than
+    // max_distance, or -1. distance(item) gives an item's exact distance,
+    // which must not be less than the distance to its box; boxes are
+    // visited nearest first, so only items that could win are measured.
+    template<typename Distance>
+    int nearest(float x, float z, float max_distance, Distance distance, float *found = nullptr) const;
+
+private:
+    static const int NODE_CAPACITY = 16;
+
+    struct Node {
+        Box box;
+        int first, count;           // into items for leaves, else into nodes
+        bool leaf;
+    };
+
+    static float groundDistance2(const Box& box, float x, float z);
+
+    QVector<Box> boxes;             // by item
+    QVector<Node> nodes;            // root last
+    QVector<int> items;             // in leaf order
+};
+
+template<typename Distance>
+int FeatureIndex::nearest(float x, float z, float max_distance, Distance distance, float *found) const
+{
+    if(nodes.isEmpty())
+        return -1;
+
+    // kind 0 a node, 1 an item by its box, 2 an item by its exact distance
+    struct Entry {
+        float d2;
+        int index;
+        int kind;
+        bool operator<(const Entry& other) const {return d2 > other.d2;}
+    };
+
+    float limit = max_distance * max_distance;
+
+    std::priority_queue<Entry> queue;
+    Entry root = {groundDistance2(nodes.last().box, x, z), nodes.size() - 1, 0};
+    queue.push(root);
+
+    while(!queue.empty()) {
+        Entry entry = queue.top();
+        queue.pop();
+
+        if(entry.d2 > limit)
+            break;
+
+        if(entry.kind == 2) {
+            if(found)
+                *found = std::sqrt(entry.d2);
+
+            return entry.index;
+        }
+
+        if(entry.kind == 1) {
+            float d = distance(entry.index);
+            Entry exact = {d * d, entry.index, 2};
+            queue.push(exact);
+            continue;
+        }
+
+        const Node& node = nodes[entry.index];
+
+        for(int i = node.first; i < node.first + node.count; i++) {
+            if(node.leaf) {
+                Entry child = {groundDistance2(boxes[items[i]], x, z), items[i], 1};
+                queue.push(child);
+            }
+
+            else {
+                Entry child = {groundDistance2(nodes[i].box, x, z), i, 0};
+                queue.push(child);
+            }
+        }
+    }
+
+    return -1;
+}
+
+#endif // FEATUREINDEX_H
@@ -3,6 +3,14 @@
 #include "camera.h"
 #include "terrain.h"
 #include "shape.h"
+#include "polylinebatch.h"
+#include "timeseries.h"
+#include "dataprefetcher.h"
+#include "parallel.h"
+#include "seriesstats.h"
+#include "seriesreduce.h"
+#include "seriesprobe.h"
+#include "taskpool.h"
 
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -11,9 +19,16 @@
 #include <QFile>
 #include <QTextStream>
 #include <QImage>
+#include <QSharedPointer>
+
+#include <algorithm>
+#include <cmath>
+
+static const float FIELD_OF_VIEW = 45.0f;
 
 Graphics::Graphics(Engine *eng)
-    : QGLWidget(), engine(eng)
+    : QGLWidget(), engine(eng), pixel_scale(1.0f), loader(nullptr), terrains_pending(0), terrains_ready(false), shapes_pending(0), polylines(nullptr), series(nullptr), prefetcher(nullptr), series_resident(false), data_terrain(nullptr), shown_step(-1),
+      probe(nullptr), probing(false), hovered_feature(-1)
 
 {
     camera = new Camera(engine);
@@ -21,14 +36,23 @@ Graphics::Graphics(Engine *eng)
 
 Graphics::~Graphics()
 {
+    // the terrains, tile streamers and line batch free their GL objects
+    makeCurrent();
+
+    // jobs still loading hold on to the engine and the large terrain; the
+    // pool waits for them and frees what their stages never took over
+    delete loader;
+
+    // the loaders decode through the terrain
+    delete prefetcher;
+
     for(Terrain *t : terrain_vec) {
         delete t;
     }
 
-    for(Shape *s : shape_vec) {
-        delete s;
-    }
-
+    delete polylines;
+    delete probe;
+    delete series;
     delete camera;
 }
 
@@ -91,24 +115,46 @@ void Graphics::initializeGL()
 
     QVector<GLuint> shader_data(2);
 
-    shader_data[0] = loadShader("../shaders/colorvert.vs", GL_VERTEX_SHADER);
-    shader_data[1] = loadShader("../shaders/colorfrag.fs", GL_FRAGMENT_SHADER);
+    // the terrain shaders share their heightmap and compact vertex code
+    const QString terrain_vert = "../shaders/terrainvert.glsl";
+    const QString terrain_frag = "../shaders/terrainfrag.glsl";
+
+    shader_data[0] = loadShader("../shaders/colorvert.vs", GL_VERTEX_SHADER, terrain_vert);
+    shader_data[1] = loadShader("../shaders/colorfrag.fs", GL_FRAGMENT_SHADER, terrain_frag);
     createShaderProgram("color", shader_data);
 
-    shader_data[0] = loadShader("../shaders/grayvert.vs", GL_VERTEX_SHADER);
-    shader_data[1] = loadShader("../shaders/grayfrag.fs", GL_FRAGMENT_SHADER);
+    shader_data[0] = loadShader("../shaders/grayvert.vs", GL_VERTEX_SHADER, terrain_vert);
+    shader_data[1] = loadShader("../shaders/grayfrag.fs", GL_FRAGMENT_SHADER, terrain_frag);
     createShaderProgram("gray", shader_data);
 
-    shader_data[0] = loadShader("../shaders/datavert.vs", GL_VERTEX_SHADER);
-    shader_data[1] = loadShader("../shaders/datafrag.fs", GL_FRAGMENT_SHADER);
+    shader_data[0] = loadShader("../shaders/datavert.vs", GL_VERTEX_SHADER, terrain_vert);
+    shader_data[1] = loadShader("../shaders/datafrag.fs", GL_FRAGMENT_SHADER, terrain_frag);
     createShaderProgram("data", shader_data);
 
+    shader_data[0] = loadShader("../shaders/seriesvert.vs", GL_VERTEX_SHADER);
+    shader_data[1] = loadShader("../shaders/datafrag.fs", GL_FRAGMENT_SHADER, terrain_frag);
+    createShaderProgram("series", shader_data);
+
     shader_data[0] = loadShader("../shaders/shapevert.vs", GL_VERTEX_SHADER);
     shader_data[1] = loadShader("../shaders/shapefrag.fs", GL_FRAGMENT_SHADER);
     createShaderProgram("shape", shader_data);
 
+    // the heightmap samplers of the terrain programs, and the resident
+    // series, get units of their own so they never share one with the color
+    // map, heightmap mode or not
+    for(const char *name : {"color", "gray", "data", "series"}) {
+        GLuint program = programs[name];
+
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "heightMap"), 1);
+        glUniform1i(glGetUniformLocation(program, "maskMap"), 2);
+        glUniform1i(glGetUniformLocation(program, "dataMap"), 3);
+        glUniform1i(glGetUniformLocation(program, "series"), 4);
+    }
+
+    glUseProgram(0);
+
     initTerrain();
-    initShapes();
 
 }
 
@@ -116,10 +162,17 @@ void Graphics::resizeGL(int width, int height)
 {
     qDebug() << "Resized:" << width << height;
     glViewport(0, 0, width, height);
-    projection = glm::perspective(45.0f, float(width) / float(height),
+    projection = glm::perspective(FIELD_OF_VIEW, float(width) / float(height),
                                   0.01f, 5000.0f);
+
+    pixel_scale = height / (2.0f * std::tan(FIELD_OF_VIEW * 3.14159265f / 360.0f));
 }
 
+// Loads the terrains and shapes as jobs on the task pool; paintGL runs each
+// one's GL upload as it finishes, so the window is up from the start and
+// layers appear as they arrive. The masked DEM and the shapes need the
+// large DEM, so its job queues theirs once it is loaded. A job that cannot
+// read its files hands a failure to its GL stage, which stops the program.
 void Graphics::initTerrain()
 {
     const auto& terrain_files = engine->getOptions().terrain;
@@ -127,49 +180,654 @@ void Graphics::initTerrain()
     for(auto& s : terrain_files)
         qDebug() << s.c_str();
 
+    load_clock.start();
+    loader = new TaskPool(std::max(2, workerCount() / 2));
+
+    // the jobs never look up GL state themselves
+    GLuint gray = programs["gray"];
+    GLuint color = programs["color"];
+
     if(terrain_files.size() == 1) {
-        terrain_vec.push_back(new Terrain(engine, QString::fromStdString(terrain_files[0]), programs["color"]));
-        terrain_vec[0]->init();
+        QString file = QString::fromStdString(terrain_files[0]);
+
+        terrain_vec.fill(nullptr, 1);
+        terrains_pending = 1;
+
+        loader->submit([=] {
+            Terrain *terrain = new Terrain(engine, file, color);
+            bool loaded = terrain->load();
+
+            loader->finish([=] {
+                if(!loaded) {
+                    delete terrain;
+                    loadFailed();
+                    return;
+                }
+
+                terrain->upload();
+                terrainLoaded(0, terrain);
+            }, [=] {
+                delete terrain;
+            });
+        });
     }
 
     else if(terrain_files.size() == 2) {
-        terrain_vec = Terrain::createTerrainFromDEMandMask(engine, QString::fromStdString(terrain_files[0]), QString::fromStdString(terrain_files[1]));
+        QString dem = QString::fromStdString(terrain_files[0]);
+        QString mask = QString::fromStdString(terrain_files[1]);
+
+        terrain_vec.fill(nullptr, 2);
+        terrains_pending = 2;
+
+        loader->submit([=] {
+            QVector<Terrain*> pair = Terrain::loadTerrainFromDEMandMask(engine, dem, mask, gray, color);
+
+            loader->finish([=] {
+                if(pair.isEmpty()) {
+                    loadFailed();
+                    return;
+                }
+
+                Terrain::uploadMaskedTerrain(engine, pair);
+                terrainLoaded(0, pair[0]);
+                terrainLoaded(1, pair[1]);
+            }, [=] {
+                for(Terrain *t : pair)
+                    delete t;
+            });
+        });
     }
 
     else {
-        Terrain *large = new Terrain(engine, QString::fromStdString(terrain_files[2]), programs["gray"]);
-        large->init();
+        QString dem = QString::fromStdString(terrain_files[0]);
+        QString mask = QString::fromStdString(terrain_files[1]);
+        QString large_file = QString::fromStdString(terrain_files[2]);
+
+        terrain_vec.fill(nullptr, 3);
+        terrains_pending = 3;
+
+        loader->submit([=] {
+            Terrain *large = new Terrain(engine, large_file, gray);
+
+            if(!large->load()) {
+                loader->finish([=] {
+                    delete large;
+                    loadFailed();
+                }, [=] {
+                    delete large;
+                });
+
+                return;
+            }
+
+            loader->submit([=] {
+                QVector<Terrain*> pair = Terrain::loadTerrainFromDEMandMask(engine, dem, mask, gray, color, large);
+
+                if(!pair.isEmpty())
+                    placeOnLarge(large, pair[0], pair[1]);
+
+                loader->finish([=] {
+                    if(pair.isEmpty()) {
+                        loadFailed();
+                        return;
+                    }
+
+                    Terrain::uploadMaskedTerrain(engine, pair);
+                    terrainLoaded(0, pair[0]);
+                    terrainLoaded(1, pair[1]);
+                }, [=] {
+                    for(Terrain *t : pair)
+                        delete t;
+                });
+            });
+
+            initShapes(large);
+
+            loader->finish([=] {
+                large->upload();
+                terrainLoaded(2, large);
+            }, [=] {
+                delete large;
+            });
+        });
+    }
+}
+
+// Moves the masked DEM pair over the part of the large DEM it covers.
+void Graphics::placeOnLarge(Terrain *large, Terrain *small, Terrain *mask)
+{
+    auto offsets = Terrain::getGeoTransformFromDEMs(large, small);
+    auto geot = large->getGeot();
+
+    double xoffset = offsets.first - geot[0];
+    double zoffset = offsets.second - geot[3];
+
+    double xOrrigOffset = large->getOrigin()[0] - small->getOrigin()[0];
+    double zOrrigOffset = large->getOrigin()[2] - small->getOrigin()[2];
 
-        terrain_vec = Terrain::createTerrainFromDEMandMask(engine, QString::fromStdString(terrain_files[0]), QString::fromStdString(terrain_files[1]), large);
-        terrain_vec.push_back(large);
+    float scale = engine->getOptions().map_scalar;
+    float resolution = geot[1];
 
-        Terrain *small = terrain_vec[0], *mask = terrain_vec[1];
-        auto offsets = Terrain::getGeoTransformFromDEMs(large, small);
-        auto geot = large->getGeot();
+    small->translate(glm::vec3(xOrrigOffset, 0, zOrrigOffset));
+    small->translate(glm::vec3((xoffset * scale / resolution), 0.01f * engine->getOptions().height_scalar, (-zoffset * scale / resolution)));
 
-        double xoffset = offsets.first - geot[0];
-        double zoffset = offsets.second - geot[3];
+    mask->translate(glm::vec3(xOrrigOffset, 0, zOrrigOffset));
+    mask->translate(glm::vec3((xoffset * scale / resolution), 0.01f * engine->getOptions().height_scalar, (-zoffset * scale / resolution)));
+}
+
+// Queues a job per shape file, each draping over the loaded large DEM. Runs
+// on the large DEM's job, shapes_pending is set before any of them can
+// finish.
+void Graphics::initShapes(Terrain *large)
+{
+    const auto& shape_files = engine->getOptions().shapes;
 
-        double xOrrigOffset = large->getGeometryRef()[0].position[0] - small->getGeometryRef()[0].position[0];
-        double zOrrigOffset = large->getGeometryRef()[0].position[2] - small->getGeometryRef()[0].position[2];
+    shapes.fill(QSharedPointer<Shape>(), shape_files.size());
+    shapes_pending = shape_files.size();
 
-        float scale = engine->getOptions().map_scalar;
-        float resolution = geot[1];
+    for(int i = 0; i < shapes.size(); i++) {
+        QString file = QString::fromStdString(shape_files[i]);
 
-        small->translate(glm::vec3(xOrrigOffset, 0, zOrrigOffset));
-        small->translate(glm::vec3((xoffset * scale / resolution), 0.01f * engine->getOptions().height_scalar, (-zoffset * scale / resolution)));
+        loader->submit([=] {
+            QSharedPointer<Shape> shape(new Shape(engine, file, large));
 
-        mask->translate(glm::vec3(xOrrigOffset, 0, zOrrigOffset));
-        mask->translate(glm::vec3((xoffset * scale / resolution), 0.01f * engine->getOptions().height_scalar, (-zoffset * scale / resolution)));
+            loader->finish([=] {
+                shapeLoaded(i, shape);
+            });
+        });
     }
 }
 
-void Graphics::initShapes()
+// GL thread. Keeps a loaded shape until the last one is in, then batches
+// them all in a job of their own and uploads the batch once.
+void Graphics::shapeLoaded(int slot, QSharedPointer<Shape> shape)
 {
-    if(terrain_vec.size() > 2)
-       for(const std::string& shape_file : engine->getOptions().shapes) {
-           shape_vec.push_back(new Shape(engine, QString::fromStdString(shape_file), terrain_vec[2]));
-       }
+    if(!shape->isLoaded()) {
+        loadFailed();
+        return;
+    }
+
+    shapes[slot] = shape;
+
+    if(--shapes_pending > 0)
+        return;
+
+    QVector<QSharedPointer<Shape>> loaded;
+    loaded.swap(shapes);
+
+    loader->submit([=] {
+        PolylineBatch *batch = new PolylineBatch(engine);
+
+        for(const QSharedPointer<Shape>& s : loaded)
+            batch->add(*s);
+
+        batch->buildIndex();
+
+        loader->finish([=] {
+            batch->upload();
+            polylines = batch;
+        }, [=] {
+            delete batch;
+        });
+    });
+}
+
+// GL thread. Puts an uploaded terrain in its slot; once all are there the
+// time series starts loading.
+void Graphics::terrainLoaded(int slot, Terrain *terrain)
+{
+    terrain_vec[slot] = terrain;
+
+    if(--terrains_pending > 0)
+        return;
+
+    terrains_ready = true;
+
+    if(engine->getOptions().verbose)
+        qDebug() << "terrains loaded in" << load_clock.elapsed() << "ms";
+
+    initTimeSeries();
+}
+
+// GL thread. A job could not read its files and has said which; nothing
+// can be shown without them.
+void Graphics::loadFailed()
+{
+    engine->stop(1);
+}
+
+void Graphics::toggleMask()
+{
+    if(!terrains_ready || terrain_vec.size() < 2 || !terrain_vec[0]->hasMask())
+        return;
+
+    makeCurrent();
+    terrain_vec[0]->setMaskEnabled(!terrain_vec[0]->isMaskEnabled());
+    reloadTimeStep();
+}
+
+void Graphics::changeMaskThreshold(float delta)
+{
+    if(!terrains_ready || terrain_vec.size() < 2 || !terrain_vec[0]->hasMask())
+        return;
+
+    float threshold = std::max(0.0f, std::min(1.0f, terrain_vec[0]->getMaskThreshold() + delta));
+
+    makeCurrent();
+    terrain_vec[0]->setMaskThreshold(threshold);
+    reloadTimeStep();
+
+    if(engine->getOptions().verbose)
+        qDebug() << "mask threshold:" << threshold;
+}
+
+// What the time series job hands its GL stage. Whatever the stage does not
+// take over is freed with it.
+struct Graphics::SeriesLoad {
+    SeriesLoad() : series(nullptr), reduced(false), width(0), height(0), resident(false) {}
+    ~SeriesLoad() {delete series;}
+
+    TimeSeries *series;
+
+    // the --reduce layer, shown instead of playback
+    bool reduced;
+    QVector<float> layer;
+    int width, height;
+
+    bool resident;
+    Terrain::SeriesLayers layers;
+};
+
+// Finds the steps, scans them for statistics and decodes a reduction or the
+// resident steps in a job, so frames keep coming meanwhile; the job's GL
+// stage uploads what it made and starts playback.
+void Graphics::initTimeSeries()
+{
+    // the data goes on the masked terrain when there is one
+    data_terrain = terrain_vec.size() > 1 ? terrain_vec[1] : terrain_vec[0];
+
+    if(data_terrain->isStreamed())
+        return;
+
+    GLint max_layers = 0;
+
+    if(engine->getOptions().resident_series)
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+
+    loader->submit([=] {
+        QSharedPointer<SeriesLoad> load(new SeriesLoad);
+        prepareTimeSeries(*load, max_layers);
+
+        loader->finish([=] {
+            startTimeSeries(*load);
+        });
+    });
+}
+
+// Worker. Everything of loading the series that needs no GL. Gives up early
+// when the loader is deleted, the long phases check its cancel flag.
+void Graphics::prepareTimeSeries(SeriesLoad& load, int max_layers)
+{
+    const Options& options = engine->getOptions();
+    const std::atomic<bool> *cancel = loader->cancelFlag();
+
+    load.series = new TimeSeries(QString::fromStdString(options.data_directory),
+                                 QString::fromStdString(options.data_variable), options.data_rate);
+
+    if(load.series->isEmpty())
+        return;
+
+    // a reduction replaces playback, unless it fails; the series is then
+    // played as usual
+    if(!options.reduce.empty()) {
+        load.reduced = reduceToLayer(load);
+
+        if(load.reduced || *cancel)
+            return;
+
+        qDebug() << "Unable to reduce the" << options.data_variable.c_str() << "series, playing it instead";
+    }
+
+    // one color scale for the whole series, which a container already has.
+    // Nothing decodes through the terrain until the series is started
+    SeriesStats stats;
+
+    if(!load.series->getContainer()
+            && seriesStatistics(options, QString::fromStdString(options.data_variable), load.series->getFiles(), stats,
+                                cancel)) {
+        data_terrain->setDataRange(stats.range);
+
+        if(options.verbose)
+            qDebug() << "series range: " << stats.range.min << "to" << stats.range.max
+                     << " 5%: " << stats.percentile(0.05f) << " median: " << stats.percentile(0.5f)
+                     << " 95%: " << stats.percentile(0.95f);
+    }
+
+    if(*cancel)
+        return;
+
+    if(options.resident_series) {
+        load.resident = data_terrain->decodeSeries(*load.series, (size_t) options.series_budget * 1024 * 1024,
+                                                   max_layers, load.layers, cancel);
+
+        if(!load.resident && !*cancel)
+            qDebug() << "Resident time series unavailable, streaming steps instead";
+    }
+}
+
+// GL thread. Shows what prepareTimeSeries made.
+void Graphics::startTimeSeries(SeriesLoad& load)
+{
+    if(load.series->isEmpty())
+        return;
+
+    if(load.reduced) {
+        data_terrain->applyLayer(load.layer, load.width, load.height);
+        return;
+    }
+
+    series = load.series;
+    load.series = nullptr;
+
+    if(load.resident) {
+        data_terrain->uploadSeries(load.layers);
+        series_resident = true;
+        frame_clock.start();
+        return;
+    }
+
+    const Options& options = engine->getOptions();
+
+    if(options.prefetch > 0)
+        prefetcher = new DataPrefetcher(data_terrain, series, options.prefetch,
+                                        std::max(1, workerCount() / 2));
+
+    updateTimeSeries();
+    frame_clock.start();
+}
+
+// Worker. Reduces the series to its --reduce layer, writing it out when
+// asked to.
+bool Graphics::reduceToLayer(SeriesLoad& load)
+{
+    const Options& options = engine->getOptions();
+
+    Reduction reduction;
+
+    if(!reduction.parse(QString::fromStdString(options.reduce))) {
+        qDebug() << "Unknown reduction: " << options.reduce.c_str();
+        return false;
+    }
+
+    if(!reduceSeries(*load.series, reduction, load.layer, load.width, load.height, loader->cancelFlag()))
+        return false;
+
+    if(!options.reduce_output.empty()) {
+        QString reference = load.series->getContainer() ? data_terrain->getMapFile() : load.series->file(0);
+        writeLayer(QString::fromStdString(options.reduce_output), load.layer, load.width, load.height, reference);
+    }
+
+    return true;
+}
+
+// Shows the current time step if it is not the one already shown. Only the
+// terrain's data values are uploaded, the geometry stays put. With the
+// prefetcher a step that is not decoded yet is simply shown a later frame.
+void Graphics::updateTimeSeries()
+{
+    if(!series)
+        return;
+
+    int step = series->current();
+
+    if(prefetcher)
+        prefetcher->setPosition(step);
+
+    if(step == shown_step)
+        return;
+
+    if(!prefetcher) {
+        if(data_terrain->decodeStep(*series, step, step_values))
+            data_terrain->uploadDataset(step_values);
+        else
+            qDebug() << "Unable to read time step: " << series->stepName(step);
+
+        shown_step = step;
+        return;
+    }
+
+    if(!prefetcher->take(step, step_values))
+        return;
+
+    // empty when the file could not be read, the last step stays up
+    if(!step_values.isEmpty())
+        data_terrain->uploadDataset(step_values);
+
+    shown_step = step;
+
+    if(engine->getOptions().verbose)
+        qDebug() << "time step:" << series->stepName(series->current()) << " queued:" << prefetcher->queueDepth()
+                 << " decode:" << prefetcher->decodeLatency() << "ms";
+}
+
+// The data of a masked terrain only covers the vertices inside the mask, so
+// steps decoded before the mask changed are decoded again.
+void Graphics::reloadTimeStep()
+{
+    // a resident series covers the whole grid
+    if(!series || series_resident)
+        return;
+
+    if(prefetcher)
+        prefetcher->flush();
+
+    shown_step = -1;
+}
+
+void Graphics::togglePlayback()
+{
+    if(!series)
+        return;
+
+    series->setPlaying(!series->isPlaying());
+}
+
+void Graphics::stepPlayback(int delta)
+{
+    if(!series)
+        return;
+
+    series->setPlaying(false);
+    series->step(delta);
+
+    if(engine->getOptions().verbose)
+        qDebug() << "time step:" << series->stepName(series->current());
+}
+
+void Graphics::scalePlaybackRate(float factor)
+{
+    if(!series)
+        return;
+
+    series->setRate(series->getRate() * factor);
+
+    if(engine->getOptions().verbose)
+        qDebug() << "playback rate:" << series->getRate() << "steps/s";
+}
+
+void Graphics::toggleProbe()
+{
+    if(!terrains_ready)
+        return;
+
+    probing = !probing;
+
+    if(probing && !probe) {
+        const Options& options = engine->getOptions();
+        QString mask = terrain_vec.size() > 1 ? terrain_vec[1]->getMapFile() : QString();
+
+        probe = new SeriesProbe(QString::fromStdString(options.data_directory),
+                                terrain_vec[0]->getMapFile(), mask, (size_t) options.probe_budget * 1024 * 1024);
+    }
+
+    qDebug() << (probing ? "probe mode on" : "probe mode off");
+}
+
+// Draws a history as one line of text in eight levels, each column showing
+// the largest of the steps it covers.
+static QString sparkline(const QVector<float>& values, int columns)
+{
+    static const char levels[] = " .:-=+*#";
+
+    float min = INFINITY, max = -INFINITY;
+
+    for(float v : values) {
+        if(v == v) {
+            min = std::min(min, v);
+            max = std::max(max, v);
+        }
+    }
+
+    QString line;
+    int count = values.size();
+    columns = std::min(columns, count);
+
+    for(int c = 0; c < columns; c++) {
+        // the largest value of the steps the column covers
+        int begin = (long long) count * c / columns;
+        int end = (long long) count * (c + 1) / columns;
+        float v = -INFINITY;
+
+        for(int i = begin; i < end; i++)
+            if(values[i] == values[i])
+                v = std::max(v, values[i]);
+
+        if(v == -INFINITY)
+            line += '?';
+        else
+            line += levels[max > min ? std::min(7, int((v - min) / (max - min) * 8.0f)) : 0];
+    }
+
+    return line;
+}
+
+// The DEM cell under pixel (x, y) and where the ray through it hits the
+// terrain.
+bool Graphics::pickTerrain(int x, int y, int& cell_x, int& cell_z, glm::vec3& hit) const
+{
+    // the ray through the pixel from the near to the far plane
+    glm::mat4 unproject = glm::inverse(projection * view);
+    float ndc_x = 2.0f * (x + 0.5f) / width() - 1.0f;
+    float ndc_y = 1.0f - 2.0f * (y + 0.5f) / height();
+
+    glm::vec4 near_point = unproject * glm::vec4(ndc_x, ndc_y, -1.0f, 1.0f);
+    glm::vec4 far_point = unproject * glm::vec4(ndc_x, ndc_y, 1.0f, 1.0f);
+
+    glm::vec3 origin = glm::vec3(near_point) / near_point.w;
+    glm::vec3 direction = glm::normalize(glm::vec3(far_point) / far_point.w - origin);
+
+    return terrain_vec[0]->pick(origin, direction, cell_x, cell_z, &hit);
+}
+
+// The shape feature nearest to a point on the terrain, within about 10
+// pixels of it on screen.
+bool Graphics::featureNear(const glm::vec3& hit, QString& file, int& feature, float& distance) const
+{
+    if(!polylines)
+        return false;
+
+    float radius = glm::length(hit - camera->getPosition()) * 10.0f / pixel_scale;
+
+    return polylines->nearestFeature(hit, radius, file, feature, distance);
+}
+
+void Graphics::hoverAt(int x, int y)
+{
+    if(!probing || !polylines)
+        return;
+
+    int cell_x, cell_z;
+    glm::vec3 hit;
+    QString file;
+    int feature = -1;
+    float distance;
+
+    if(!pickTerrain(x, y, cell_x, cell_z, hit) || !featureNear(hit, file, feature, distance)) {
+        file.clear();
+        feature = -1;
+    }
+
+    if(feature == hovered_feature && file == hovered_file)
+        return;
+
+    hovered_file = file;
+    hovered_feature = feature;
+
+    if(feature >= 0)
+        qDebug() << "hover: feature" << file << "#" << feature;
+}
+
+void Graphics::probeAt(int x, int y)
+{
+    if(!probe || !terrains_ready)
+        return;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    int cell_x, cell_z;
+    glm::vec3 hit;
+
+    if(!pickTerrain(x, y, cell_x, cell_z, hit)) {
+        qDebug() << "probe: no terrain under the cursor";
+        return;
+    }
+
+    QString file;
+    int feature;
+    float distance;
+
+    if(featureNear(hit, file, feature, distance))
+        qDebug() << "probe: nearest feature" << file << "#" << feature << "at" << distance;
+
+    QVector<SeriesProbe::History> histories;
+
+    if(!probe->histories(cell_x, cell_z, histories)) {
+        qDebug() << "probe: cell" << cell_x << cell_z << "(still loading the data series)";
+        return;
+    }
+
+    float elevation = probe->elevation(cell_x, cell_z);
+    float mask = probe->maskValue(cell_x, cell_z);
+    double latency = timer.nsecsElapsed() / 1.0e6;
+
+    qDebug() << "probe: cell" << cell_x << cell_z << " elevation:" << elevation << " mask:" << mask;
+
+    for(const SeriesProbe::History& history : histories) {
+        float min = INFINITY, max = -INFINITY;
+
+        for(float v : history.values) {
+            if(v == v) {
+                min = std::min(min, v);
+                max = std::max(max, v);
+            }
+        }
+
+        qDebug() << "  " << history.variable << "[" << sparkline(history.values, 64) << "]"
+                 << min << "to" << max;
+
+        if(engine->getOptions().verbose) {
+            QString steps;
+
+            for(int t = 0; t < history.values.size(); t++)
+                steps += QString(" %1=%2").arg(history.step_numbers[t]).arg(history.values[t]);
+
+            qDebug() << "   " << steps;
+        }
+    }
+
+    if(engine->getOptions().verbose)
+        qDebug() << "probe took" << latency << "ms," << probe->cacheBytes() / (1024 * 1024) << "MB cached";
 }
 
 void Graphics::paintGL()
@@ -177,15 +835,39 @@ void Graphics::paintGL()
     updateCamera();
     updateView();
 
+    if(series_resident) {
+        series->update(frame_clock.restart() / 1000.0f);
+        data_terrain->setSeriesTime(series->time());
+    }
+
+    else if(series) {
+        // playback waits for the shown step to catch up instead of skipping
+        float dt = frame_clock.restart() / 1000.0f;
+
+        if(series->current() == shown_step)
+            series->update(dt);
+
+        updateTimeSeries();
+    }
+
+    // uploads whatever finished loading since the last frame
+    if(loader && loader->runFinished()) {
+        delete loader;
+        loader = nullptr;
+
+        if(engine->getOptions().verbose)
+            qDebug() << "startup loading took" << load_clock.elapsed() << "ms";
+    }
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     for(Terrain *t : terrain_vec) {
-        t->render();
+        if(t)
+            t->render();
     }
 
-    for(Shape *s : shape_vec) {
-        s->render();
-    }
+    if(polylines)
+        polylines->render();
 
     swapBuffers();
 }
@@ -200,7 +882,7 @@ void Graphics::updateCamera()
     camera->update();
 }
 
-GLuint Graphics::loadShader(const QString &shaderFile, GLenum shaderType)
+QString Graphics::readShaderFile(const QString &shaderFile)
 {
     QFile file(shaderFile);
     if(!file.exists()) {
@@ -211,12 +893,23 @@ GLuint Graphics::loadShader(const QString &shaderFile, GLenum shaderType)
     file.open(QFile::ReadOnly);
 
     QTextStream fin(&file);
-    QString shader_contents = fin.readAll();
+    return fin.readAll();
+}
+
+// Compiles shaderFile with the code of prelude, when given, put in after its
+// #version line.
+GLuint Graphics::loadShader(const QString &shaderFile, GLenum shaderType, const QString &prelude)
+{
+    QString shader_contents = readShaderFile(shaderFile);
+
+    if(!prelude.isEmpty()) {
+        int version_end = shader_contents.indexOf('\n') + 1;
+        shader_contents.insert(version_end, readShaderFile(prelude));
+    }
+
     auto byteArr = shader_contents.toUtf8();
     const char *shaderStr = byteArr.constData();
 
-    file.close();
-
     GLuint shader = glCreateShader(shaderType);
     glShaderSource(shader, 1, &shaderStr, NULL);
     glCompileShader(shader);
@@ -227,7 +920,7 @@ GLuint Graphics::loadShader(const QString &shaderFile, GLenum shaderType)
         char buffer[512];
         glGetShaderInfoLog(shader, 512, NULL, buffer);
         QString shaderTypeStr = (shaderType == GL_VERTEX_SHADER) ? "Vertex Shader" : "Fragment Shader";
-        qDebug() << "Failed to compile" << shaderTypeStr << "loaded from" << shaderFile;
+        qDebug() << "Failed to compile" << shaderTypeStr << "loaded from" << shaderFile << prelude;
         qDebug() << "Compile error:" << buffer;
         engine->stop(1);
     }
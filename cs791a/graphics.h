@@ -2,18 +2,25 @@
 #define GRAPHICS_H
 
 #include "gl.h"
+#include "terrain.h"
 
+#include <QElapsedTimer>
 #include <QGLWidget>
 #include <QMap>
+#include <QSharedPointer>
 #include <QVector>
 #include <QString>
 
 #include <glm/glm.hpp>
 
 class Engine;
-class Terrain;
 class Shape;
+class PolylineBatch;
 class Camera;
+class TimeSeries;
+class DataPrefetcher;
+class SeriesProbe;
+class TaskPool;
 
 class Graphics : public QGLWidget
 {
@@ -25,6 +32,30 @@ public:
     GLuint getShaderProgram(const QString& name) const;
     GLuint createTextureFromFile(const QString& file, GLenum target = GL_TEXTURE_2D);
 
+    // Pixels covered by one world unit seen face on at distance 1, for
+    // turning world space errors into screen space ones.
+    float getPixelScale() const {return pixel_scale;}
+
+    // Mask controls for masked DEMs, no-ops otherwise.
+    void toggleMask();
+    void changeMaskThreshold(float delta);
+
+    // Time series playback controls, no-ops without data.
+    void togglePlayback();
+    void stepPlayback(int delta);
+    void scalePlaybackRate(float factor);
+
+    // Probe mode: clicking reports the elevation, mask value and data
+    // history of the DEM cell under the cursor instead of turning the
+    // camera.
+    void toggleProbe();
+    bool isProbing() const {return probing;}
+    void probeAt(int x, int y);
+
+    // Probe mode: reports the shape feature under the cursor as it moves,
+    // each time a different one (or none) is under it.
+    void hoverAt(int x, int y);
+
     glm::mat4 view, projection;
     Camera *camera;
 signals:
@@ -37,19 +68,61 @@ protected:
     void resizeGL(int width, int height);
 
 private:
+    struct SeriesLoad;
+
     void initTerrain();
-    void initShapes();
+    void initShapes(Terrain *large);
+    void shapeLoaded(int slot, QSharedPointer<Shape> shape);
+    void placeOnLarge(Terrain *large, Terrain *small, Terrain *mask);
+    void terrainLoaded(int slot, Terrain *terrain);
+    void loadFailed();
+    void initTimeSeries();
+    void prepareTimeSeries(SeriesLoad& load, int max_layers);
+    void startTimeSeries(SeriesLoad& load);
+    void updateTimeSeries();
+    void reloadTimeStep();
+    bool reduceToLayer(SeriesLoad& load);
+    bool pickTerrain(int x, int y, int& cell_x, int& cell_z, glm::vec3& hit) const;
+    bool featureNear(const glm::vec3& hit, QString& file, int& feature, float& distance) const;
     void updateView();
     void updateCamera();
-    GLuint loadShader(const QString& shaderFile, GLenum shaderType);
+    QString readShaderFile(const QString& shaderFile);
+    GLuint loadShader(const QString& shaderFile, GLenum shaderType, const QString& prelude = QString());
     GLuint createShaderProgram(const QString& name, const QVector<GLuint>& shader_data);
 
     Engine *engine;
 
+    float pixel_scale;
+
     QMap<QString, GLuint> programs;
     QMap<QString, QVector<GLuint>> shaders;
+    // startup loading; terrain_vec holds nullptr for a terrain until it
+    // is uploaded
+    TaskPool *loader;
+    QElapsedTimer load_clock;
+    int terrains_pending;
+    bool terrains_ready;
+    // loaded shapes in command line order until the last one is in
+    QVector<QSharedPointer<Shape>> shapes;
+    int shapes_pending;
+
     QVector<Terrain*> terrain_vec;
-    QVector<Shape*> shape_vec;
+    PolylineBatch *polylines;
+
+    // isnobal playback onto data_terrain; shown_step is the step on the GPU
+    TimeSeries *series;
+    DataPrefetcher *prefetcher;
+    bool series_resident;
+    DataValues step_values;
+    Terrain *data_terrain;
+    int shown_step;
+    QElapsedTimer frame_clock;
+
+    // created the first time probe mode is switched on
+    SeriesProbe *probe;
+    bool probing;
+    QString hovered_file;
+    int hovered_feature;            // -1 for none
 
 };
 
@@ -48,11 +48,54 @@ void MainWindow::keyPressEvent(QKeyEvent *event)
         case Qt::Key_F:
             engine->graphics->camera->moveDown();
         break;
+
+        case Qt::Key_M:
+            engine->graphics->toggleMask();
+        break;
+
+        case Qt::Key_BracketLeft:
+            engine->graphics->changeMaskThreshold(-0.05f);
+        break;
+
+        case Qt::Key_BracketRight:
+            engine->graphics->changeMaskThreshold(0.05f);
+        break;
+
+        case Qt::Key_Space:
+            engine->graphics->togglePlayback();
+        break;
+
+        case Qt::Key_Comma:
+            engine->graphics->stepPlayback(-1);
+        break;
+
+        case Qt::Key_Period:
+            engine->graphics->stepPlayback(1);
+        break;
+
+        case Qt::Key_Minus:
+            engine->graphics->scalePlaybackRate(0.5f);
+        break;
+
+        case Qt::Key_Plus:
+        case Qt::Key_Equal:
+            engine->graphics->scalePlaybackRate(2.0f);
+        break;
+
+        case Qt::Key_P:
+            engine->graphics->toggleProbe();
+        break;
     }
 }
 
 void MainWindow::mouseMoveEvent(QMouseEvent *event)
 {
+    if(engine->graphics->isProbing()) {
+        QPoint pos = engine->graphics->mapFrom(this, event->pos());
+        engine->graphics->hoverAt(pos.x(), pos.y());
+        return;
+    }
+
     engine->graphics->camera->rotate(event->x() - previousX, event->y() - previousY);
 
     previousX = event->x();
@@ -61,6 +104,15 @@ void MainWindow::mouseMoveEvent(QMouseEvent *event)
 
 void MainWindow::mousePressEvent(QMouseEvent *event)
 {
+    if(engine->graphics->isProbing()) {
+        if(event->button() == Qt::LeftButton) {
+            QPoint pos = engine->graphics->mapFrom(this, event->pos());
+            engine->graphics->probeAt(pos.x(), pos.y());
+        }
+
+        return;
+    }
+
     previousX = event->x();
     previousY = event->y();
     setCursor(Qt::BlankCursor);
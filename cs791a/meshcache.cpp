@@ -0,0 +1,204 @@
+#include "meshcache.h"
+#include "engine.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include <cstring>
+
+// Bump when the file layout or the way meshes are built changes.
+static const quint32 MESH_CACHE_VERSION = 1;
+static const char MESH_CACHE_MAGIC[8] = {'C','S','7','9','1','M','S','H'};
+static const int MAX_INDEX_LISTS = 2;
+
+// File layout: Header, vertex_count Vertex structs, then each index list.
+struct MeshCache::Header {
+    char magic[8];
+    quint32 version;
+    quint32 vertex_size;
+    char key[20];
+    qint32 grid_width, grid_height;
+    float range_min, range_max;
+    quint64 vertex_count;
+    quint32 index_lists;
+    quint32 padding;
+    quint64 index_count[MAX_INDEX_LISTS];
+};
+
+MeshCache::MeshCache(const Options& options, const QStringList& files, const QString& params)
+    : enabled(options.mesh_cache), map(nullptr), header(nullptr)
+{
+    if(!enabled || files.isEmpty())
+        return;
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(params.toUtf8());
+
+    QStringList names;
+
+    // only paths, sizes and mtimes like the series stats key; hashing the
+    // contents would cost the full read the cache is there to skip
+    for(const QString& name : files) {
+        QFileInfo info(name);
+
+        if(!info.exists()) {
+            enabled = false;
+            return;
+        }
+
+        hash.addData(QString("%1:%2:%3").arg(info.absoluteFilePath()).arg(info.size())
+                     .arg(info.lastModified().toMSecsSinceEpoch()).toUtf8());
+
+        names << info.fileName();
+    }
+
+    key = hash.result();
+
+    QString dir = QString::fromStdString(options.cache_directory);
+    if(dir.isEmpty())
+        dir = QFileInfo(files[0]).absolutePath();
+    else
+        QDir().mkpath(dir);
+
+    path = QDir(dir).filePath(names.join("+") + ".mesh");
+    file.setFileName(path);
+}
+
+MeshCache::~MeshCache()
+{
+    if(map)
+        file.unmap(map);
+}
+
+bool MeshCache::load()
+{
+    if(!enabled || !file.exists() || !file.open(QFile::ReadOnly))
+        return false;
+
+    qint64 size = file.size();
+
+    if(size < (qint64) sizeof(Header))
+        return false;
+
+    map = file.map(0, size);
+    file.close();
+
+    if(map == nullptr)
+        return false;
+
+    header = (const Header*) map;
+
+    bool valid = std::memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(header->magic)) == 0
+            && header->version == MESH_CACHE_VERSION
+            && header->vertex_size == sizeof(Vertex)
+            && key.size() == (int) sizeof(header->key)
+            && std::memcmp(header->key, key.constData(), sizeof(header->key)) == 0
+            && header->index_lists <= (quint32) MAX_INDEX_LISTS;
+
+    if(valid) {
+        quint64 expected = sizeof(Header) + header->vertex_count * sizeof(Vertex);
+        for(quint32 i = 0; i < header->index_lists; i++)
+            expected += header->index_count[i] * sizeof(GLuint);
+
+        valid = (expected == (quint64) size);
+    }
+
+    if(!valid) {
+        file.unmap(map);
+        map = nullptr;
+        header = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+int MeshCache::gridWidth() const
+{
+    return header->grid_width;
+}
+
+int MeshCache::gridHeight() const
+{
+    return header->grid_height;
+}
+
+SampleRange MeshCache::range() const
+{
+    SampleRange r;
+    r.min = header->range_min;
+    r.max = header->range_max;
+    return r;
+}
+
+int MeshCache::vertexCount() const
+{
+    return header->vertex_count;
+}
+
+const Vertex* MeshCache::vertices() const
+{
+    return (const Vertex*) (map + sizeof(Header));
+}
+
+void MeshCache::copyVertices(QVector<Vertex>& out) const
+{
+    out.resize(header->vertex_count);
+    std::memcpy(out.data(), vertices(), sizeof(Vertex) * header->vertex_count);
+}
+
+void MeshCache::copyIndices(int list, QVector<GLuint>& out) const
+{
+    const uchar *data = map + sizeof(Header) + sizeof(Vertex) * header->vertex_count;
+
+    for(int i = 0; i < list; i++)
+        data += sizeof(GLuint) * header->index_count[i];
+
+    out.resize(header->index_count[list]);
+    std::memcpy(out.data(), data, sizeof(GLuint) * header->index_count[list]);
+}
+
+void MeshCache::save(int grid_width, int grid_height, const SampleRange& range,
+                     const QVector<Vertex>& vertices, const QVector<const QVector<GLuint>*>& index_lists)
+{
+    if(!enabled || index_lists.size() > MAX_INDEX_LISTS)
+        return;
+
+    Header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, MESH_CACHE_MAGIC, sizeof(h.magic));
+    std::memcpy(h.key, key.constData(), sizeof(h.key));
+    h.version = MESH_CACHE_VERSION;
+    h.vertex_size = sizeof(Vertex);
+    h.grid_width = grid_width;
+    h.grid_height = grid_height;
+    h.range_min = range.min;
+    h.range_max = range.max;
+    h.vertex_count = vertices.size();
+    h.index_lists = index_lists.size();
+
+    for(int i = 0; i < index_lists.size(); i++)
+        h.index_count[i] = index_lists[i]->size();
+
+    // written next to the old file and renamed over it, so a crash never
+    // leaves a half written cache behind
+    QSaveFile out(path);
+
+    if(!out.open(QFile::WriteOnly)) {
+        qDebug() << "Unable to write mesh cache: " << path << out.errorString();
+        return;
+    }
+
+    out.write((const char*) &h, sizeof(h));
+    out.write((const char*) vertices.constData(), sizeof(Vertex) * vertices.size());
+
+    for(const QVector<GLuint> *list : index_lists)
+        out.write((const char*) list->constData(), sizeof(GLuint) * list->size());
+
+    if(!out.commit())
+        qDebug() << "Unable to write mesh cache: " << path << out.errorString();
+}
@@ -0,0 +1,59 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include "gl.h"
+#include "vertex.h"
+#include "samplekernel.h"
+
+struct Options;
+
+// On-disk copy of a built terrain mesh so unchanged DEMs skip meshing on the
+// next launch. The cache is keyed by the path, size and mtime of the source
+// files plus the option values the mesh depends on; a cache built from
+// anything else is ignored and rewritten. Loading maps the file; vertices
+// can be used straight from the mapping, index lists are copied out.
+class MeshCache {
+public:
+    // Cache for the mesh built from files, with params describing every
+    // other input the mesh depends on (scales, thresholds, ranges).
+    MeshCache(const Options& options, const QStringList& files, const QString& params);
+    ~MeshCache();
+
+    // Maps the cache file. Returns false when caching is off or the file is
+    // missing, stale or malformed.
+    bool load();
+
+    int gridWidth() const;
+    int gridHeight() const;
+    SampleRange range() const;
+
+    // Valid for as long as the cache object lives.
+    int vertexCount() const;
+    const Vertex* vertices() const;
+
+    void copyVertices(QVector<Vertex>& out) const;
+    void copyIndices(int list, QVector<GLuint>& out) const;
+
+    // Writes the mesh. Failures are reported but otherwise harmless.
+    void save(int grid_width, int grid_height, const SampleRange& range,
+              const QVector<Vertex>& vertices, const QVector<const QVector<GLuint>*>& index_lists);
+
+private:
+    struct Header;
+
+    bool enabled;
+    QString path;
+    QByteArray key;
+
+    QFile file;
+    uchar *map;
+    const Header *header;
+};
+
+#endif // MESHCACHE_H
@@ -0,0 +1,133 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// The tasks of one parallelFor call, handed out in order.
+struct Batch {
+    const std::function<void(int)> *task;
+    int count;
+    int next;
+    int done;
+    std::condition_variable finished;
+};
+
+// workerCount() - 1 threads taking tasks from the batches in the order the
+// calls came in; the caller of each batch makes up the last one.
+class SharedPool {
+public:
+    SharedPool();
+    ~SharedPool();
+
+    void run(int count, const std::function<void(int)>& task);
+
+private:
+    // Hands out the next task of batch. The lock is held.
+    int take(Batch *batch);
+    void workerMain();
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Batch*> batches;     // with tasks left to hand out
+    bool quit;
+
+    std::vector<std::thread> workers;
+};
+
+SharedPool::SharedPool()
+    : quit(false)
+{
+    for(int i = 1; i < workerCount(); i++)
+        workers.emplace_back(&SharedPool::workerMain, this);
+}
+
+SharedPool::~SharedPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+
+    wake.notify_all();
+
+    for(std::thread& t : workers)
+        t.join();
+}
+
+int SharedPool::take(Batch *batch)
+{
+    int i = batch->next++;
+
+    if(batch->next == batch->count)
+        batches.erase(std::find(batches.begin(), batches.end(), batch));
+
+    return i;
+}
+
+void SharedPool::run(int count, const std::function<void(int)>& task)
+{
+    // a single task is not worth waking anyone for
+    if(count == 1) {
+        task(0);
+        return;
+    }
+
+    Batch batch;
+    batch.task = &task;
+    batch.count = count;
+    batch.next = 0;
+    batch.done = 0;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    batches.push_back(&batch);
+    wake.notify_all();
+
+    while(batch.next < batch.count) {
+        int i = take(&batch);
+
+        lock.unlock();
+        task(i);
+        lock.lock();
+
+        batch.done++;
+    }
+
+    batch.finished.wait(lock, [&] {return batch.done == batch.count;});
+}
+
+void SharedPool::workerMain()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for(;;) {
+        wake.wait(lock, [this] {return quit || !batches.empty();});
+
+        if(quit)
+            return;
+
+        Batch *batch = batches.front();
+        int i = take(batch);
+
+        lock.unlock();
+        (*batch->task)(i);
+        lock.lock();
+
+        if(++batch->done == batch->count)
+            batch->finished.notify_all();
+    }
+}
+
+}
+
+void parallelFor(int count, const std::function<void(int)>& task)
+{
+    static SharedPool pool;
+
+    if(count > 0)
+        pool.run(count, task);
+}
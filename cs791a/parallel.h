@@ -0,0 +1,40 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+// Number of threads worth splitting CPU bound work across.
+inline int workerCount()
+{
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Calls task(0) to task(count - 1) on the shared worker threads, which live
+// for the whole run, and returns once all are done. The calling thread takes
+// tasks too, so a call from inside a task or a TaskPool job finishes even
+// when every worker is busy.
+void parallelFor(int count, const std::function<void(int)>& task);
+
+// Splits [0, count) into `bands` contiguous slices and calls
+// func(band, begin, end) for each one through parallelFor. The split only
+// depends on count and bands, so two calls with the same arguments hand
+// every band the same slice. Returns once all bands are done.
+template<typename F>
+void parallelBands(int count, int bands, F func)
+{
+    if(count <= 0)
+        return;
+
+    bands = std::max(1, std::min(bands, count));
+
+    parallelFor(bands, [&](int band) {
+        int begin = (long long) count * band / bands;
+        int end = (long long) count * (band + 1) / bands;
+        func(band, begin, end);
+    });
+}
+
+#endif // PARALLEL_H
@@ -0,0 +1,251 @@
+#include "polylinebatch.h"
+#include "engine.h"
+#include "graphics.h"
+#include "camera.h"
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+
+PolylineBatch::PolylineBatch(Engine *eng)
+    : engine(eng), program(0), vao(0), vbo(0), color_vbo(0),
+      compact(eng->getOptions().compact_vertices)
+{
+}
+
+PolylineBatch::~PolylineBatch()
+{
+    if(vao) {
+        glDeleteBuffers(1, &vbo);
+        glDeleteBuffers(1, &color_vbo);
+        glDeleteVertexArrays(1, &vao);
+    }
+}
+
+void PolylineBatch::add(const Shape& shape)
+{
+    int base = points.size();
+    const QVector<Vertex>& shape_points = shape.getPoints();
+
+    points += shape_points;
+
+    colors.resize(points.size() * 4);
+
+    for(const Shape::Line& line : shape.getLines()) {
+        BatchLine batched;
+
+        // every level of a line is colored by its feature
+        GLubyte rgba[4];
+        shape.featureColor(line.feature, rgba);
+
+        for(int level = 0; level < Shape::LOD_LEVELS; level++) {
+            GLubyte *color = colors.data() + (base + line.first[level]) * 4;
+
+            for(int i = 0; i < line.count[level]; i++, color += 4)
+                std::copy(rgba, rgba + 4, color);
+
+            batched.first[level] = base + line.first[level];
+            batched.count[level] = line.count[level];
+            batched.tolerance[level] = shape.levelTolerance(level);
+        }
+
+        batched.lower = line.lower;
+        batched.upper = line.upper;
+        batched.shape = shape_files.size();
+        batched.feature = line.feature;
+        lines.push_back(batched);
+    }
+
+    shape_files.push_back(shape.getFile());
+
+    line_first.resize(lines.size());
+    line_count.resize(lines.size());
+}
+
+void PolylineBatch::buildIndex()
+{
+    QVector<FeatureIndex::Box> boxes(lines.size());
+
+    for(int i = 0; i < lines.size(); i++) {
+        boxes[i].lower = lines[i].lower;
+        boxes[i].upper = lines[i].upper;
+    }
+
+    index.build(boxes);
+}
+
+// Finds the lines in view and picks a level for each.
+void PolylineBatch::selectLevels()
+{
+    const Options& options = engine->getOptions();
+
+    // frustum planes of the line space, where y is not yet scaled by the
+    // height scalar; scaling each plane's y takes care of that
+    glm::mat4 mvp = engine->graphics->projection * engine->graphics->view * model;
+    glm::vec4 planes[6];
+
+    for(int axis = 0; axis < 3; axis++) {
+        for(int side = 0; side < 2; side++) {
+            glm::vec4& plane = planes[axis * 2 + side];
+
+            for(int c = 0; c < 4; c++)
+                plane[c] = mvp[c][3] + (side ? -mvp[c][axis] : mvp[c][axis]);
+
+            plane.y *= options.height_scalar;
+        }
+    }
+
+    visible.clear();
+    index.queryFrustum(planes, visible);
+
+    // the model transform only ever translates
+    glm::vec3 camera = engine->graphics->camera->getPosition() - glm::vec3(model[3]);
+    glm::vec3 scale(1.0f, options.height_scalar, 1.0f);
+    float pixels = engine->graphics->getPixelScale() / std::max(options.shape_error, 0.01f);
+
+    GLint *first = line_first.data();
+    GLsizei *count = line_count.data();
+
+    for(int i = 0; i < visible.size(); i++) {
+        const BatchLine *line = lines.constData() + visible[i];
+
+        // distance to the line's bounding box, 0 inside it
+        glm::vec3 outside = glm::max(glm::max(line->lower * scale - camera, camera - line->upper * scale),
+                                     glm::vec3(0.0f));
+        float distance = glm::length(outside);
+
+        int level = 0;
+
+        while(level + 1 < Shape::LOD_LEVELS && line->tolerance[level + 1] * pixels <= distance)
+            level++;
+
+        first[i] = line->first[level];
+        count[i] = line->count[level];
+    }
+}
+
+// Ground distance from (x, z) to the full resolution line.
+float PolylineBatch::lineDistance(int line, float x, float z) const
+{
+    const BatchLine& batched = lines[line];
+    const Vertex *v = points.constData() + batched.first[0];
+
+    float best = INFINITY;
+
+    for(int i = 0; i + 1 < batched.count[0]; i++) {
+        float ax = v[i].position[0], az = v[i].position[2];
+        float dx = v[i + 1].position[0] - ax, dz = v[i + 1].position[2] - az;
+        float px = x - ax, pz = z - az;
+
+        float length2 = dx * dx + dz * dz;
+        float t = length2 > 0.0f ? std::max(0.0f, std::min(1.0f, (px * dx + pz * dz) / length2)) : 0.0f;
+        float ex = px - t * dx, ez = pz - t * dz;
+
+        best = std::min(best, ex * ex + ez * ez);
+    }
+
+    return std::sqrt(best);
+}
+
+bool PolylineBatch::nearestFeature(const glm::vec3& point, float max_distance, QString& file, int& feature,
+                                   float& distance) const
+{
+    glm::vec3 local = point - glm::vec3(model[3]);
+
+    int line = index.nearest(local.x, local.z, max_distance,
+                             [&](int i) {return lineDistance(i, local.x, local.z);}, &distance);
+
+    if(line < 0)
+        return false;
+
+    file = shape_files[lines[line].shape];
+    feature = lines[line].feature;
+
+    return true;
+}
+
+void PolylineBatch::upload()
+{
+    program = engine->graphics->getShaderProgram("shape");
+
+    loc_mvp = glGetUniformLocation(program, "mvpMatrix");
+    loc_position = glGetAttribLocation(program, "v_position");
+    loc_color = glGetAttribLocation(program, "v_color");
+    loc_heightScalar = glGetUniformLocation(program, "heightScalar");
+    loc_positionScale = glGetUniformLocation(program, "positionScale");
+    loc_positionOffset = glGetUniformLocation(program, "positionOffset");
+
+    if(!vao) {
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glGenBuffers(1, &color_vbo);
+    }
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+    QVector<CompactVertex> packed;
+
+    // shape points are not on a grid, every axis is fit to their extent
+    if(compact && !packVertices(points.constData(), points.size(), glm::vec3(0.0f), packed, packing)) {
+        qDebug() << "shape batch: extent too large for compact vertices, keeping floats";
+        compact = false;
+    }
+
+    if(compact) {
+        glBufferData(GL_ARRAY_BUFFER, sizeof(CompactVertex) * packed.size(), packed.constData(), GL_STATIC_DRAW);
+
+        glVertexAttribPointer(loc_position, 3, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(CompactVertex),
+                              (void*)offsetof(CompactVertex,position));
+    }
+
+    else {
+        packing = VertexPacking();
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * points.size(), points.constData(), GL_STATIC_DRAW);
+
+        glVertexAttribPointer(loc_position, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                              (void*)offsetof(Vertex,position));
+    }
+
+    glEnableVertexAttribArray(loc_position);
+
+    glBindBuffer(GL_ARRAY_BUFFER, color_vbo);
+    glBufferData(GL_ARRAY_BUFFER, colors.size(), colors.constData(), GL_STATIC_DRAW);
+    glVertexAttribPointer(loc_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, 0);
+    glEnableVertexAttribArray(loc_color);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+
+    if(engine->getOptions().verbose)
+        qDebug() << "polylines: " << lines.size() << "lines," << points.size() << "vertices over all levels";
+}
+
+void PolylineBatch::render()
+{
+    if(!vao || lines.isEmpty())
+        return;
+
+    selectLevels();
+
+    if(visible.isEmpty())
+        return;
+
+    glm::mat4 mvp = engine->graphics->projection * engine->graphics->view * model;
+
+    glUseProgram(program);
+    glBindVertexArray(vao);
+
+    glUniformMatrix4fv(loc_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+    glUniform1f(loc_heightScalar, engine->getOptions().height_scalar);
+    glUniform3fv(loc_positionScale, 1, glm::value_ptr(packing.scale));
+    glUniform3fv(loc_positionOffset, 1, glm::value_ptr(packing.offset));
+
+    glMultiDrawArrays(GL_LINE_STRIP, line_first.constData(), line_count.constData(), visible.size());
+
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
@@ -0,0 +1,91 @@
+#ifndef POLYLINEBATCH_H
+#define POLYLINEBATCH_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include "gl.h"
+#include "vertex.h"
+#include "vertexpack.h"
+#include "shape.h"
+#include "featureindex.h"
+
+#include <glm/glm.hpp>
+
+class Engine;
+
+// Every line of every shape in one vertex buffer, drawn as line strips
+// with a single glMultiDrawArrays however many files and features there
+// are. Colors ride along as a 4 byte attribute per vertex, so each feature
+// keeps its own color within the one draw. The buffer also holds each
+// line's simplified levels; every frame the lines in view, found through an
+// R-tree over their bounds, are drawn at the coarsest level whose error
+// stays under --shape-error pixels where they are seen.
+class PolylineBatch {
+public:
+    explicit PolylineBatch(Engine *eng);
+    ~PolylineBatch();
+
+    // Appends the lines of shape in its color. The shape can be deleted
+    // afterwards.
+    void add(const Shape& shape);
+
+    // Builds the R-tree over everything added, once the last shape is in.
+    // Touches no GL state, so it runs in the loading job with add. The
+    // index holds lines rather than whole features: a feature's lines can
+    // lie far apart (the parts of a multi line string), and each line
+    // carries its feature, so the queries still answer with features.
+    void buildIndex();
+
+    // GL thread. Uploads what has been added so far.
+    void upload();
+    void render();
+
+    int lineCount() const {return lines.size();}
+    int drawnLines() const {return visible.size();}
+
+    // The feature with a line closest to point (world space) across the
+    // ground, no further than max_distance. Returns false when there is
+    // none.
+    bool nearestFeature(const glm::vec3& point, float max_distance, QString& file, int& feature,
+                        float& distance) const;
+
+private:
+    struct BatchLine {
+        GLint first[Shape::LOD_LEVELS];
+        GLsizei count[Shape::LOD_LEVELS];
+        float tolerance[Shape::LOD_LEVELS];
+        glm::vec3 lower, upper;
+        int shape, feature;
+    };
+
+    void selectLevels();
+    float lineDistance(int line, float x, float z) const;
+
+    Engine *engine;
+
+    GLuint program;
+    GLuint vao, vbo, color_vbo;
+    GLint loc_mvp, loc_position, loc_color, loc_heightScalar;
+    GLint loc_positionScale, loc_positionOffset;
+
+    bool compact;
+    VertexPacking packing;
+
+    QVector<Vertex> points;
+    QVector<GLubyte> colors;        // RGBA per point
+    QVector<BatchLine> lines;
+    QStringList shape_files;
+    FeatureIndex index;
+
+    // the lines in view and what the next draw takes from each, refilled
+    // every frame
+    QVector<int> visible;
+    QVector<GLint> line_first;
+    QVector<GLsizei> line_count;
+
+    glm::mat4 model;
+};
+
+#endif // POLYLINEBATCH_H
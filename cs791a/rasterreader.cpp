@@ -0,0 +1,129 @@
+#include "rasterreader.h"
+
+#include <gdal_priv.h>
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Aim for strips of at least this many bytes so row-striped files with a
+// block height of 1 are not read one row per call.
+static const size_t MIN_STRIP_BYTES = 4 * 1024 * 1024;
+
+RasterReader::RasterReader(GDALRasterBand *band, size_t whole_band_limit)
+    : band(band)
+{
+    init(0, band->GetYSize(), whole_band_limit);
+}
+
+RasterReader::RasterReader(GDALRasterBand *band, int first_row, int last_row, size_t whole_band_limit)
+    : band(band)
+{
+    init(first_row, last_row, whole_band_limit);
+}
+
+void RasterReader::init(int first_row, int last_row, size_t whole_band_limit)
+{
+    band_width = band->GetXSize();
+    band_height = band->GetYSize();
+    range_begin = std::max(first_row, 0);
+    range_end = std::min(last_row, band_height);
+    read_failed = false;
+
+    strip_start = first_row;
+    strip_rows = 0;
+    has_carry = false;
+
+    int has_nodata = 0;
+    format.type = band->GetRasterDataType();
+    format.nodata = band->GetNoDataValue(&has_nodata);
+    format.has_nodata = has_nodata;
+
+    if(!isNativeSampleType(format.type))
+        format.type = GDT_Float32;
+
+    norm_offset = 0.0f;
+    norm_scale = 1.0f;
+    fill = NAN;
+
+    int range_rows = std::max(1, range_end - first_row);
+    size_t row_bytes = sizeof(float) * band_width;
+
+    if(row_bytes * range_rows <= whole_band_limit) {
+        strip_height = range_rows;
+    }
+
+    else {
+        int block_x, block_y;
+        band->GetBlockSize(&block_x, &block_y);
+        block_y = std::max(block_y, 1);
+
+        int blocks = std::max<size_t>(1, MIN_STRIP_BYTES / (row_bytes * block_y));
+        strip_height = std::min(range_rows, block_y * blocks);
+    }
+
+    // slot 0 is reserved for the row carried over from the previous strip
+    buffer.resize((strip_height + 1) * band_width);
+
+    if(format.type != GDT_Float32)
+        raw.resize(strip_height * band_width * (GDALGetDataTypeSize(format.type) / 8));
+
+    // the first strip is read lazily so setNormalization can come first
+}
+
+void RasterReader::setNormalization(float min, float max)
+{
+    norm_offset = min;
+    norm_scale = (max > min) ? 1.0f / (max - min) : 0.0f;
+    fill = 0.0f;
+}
+
+const float* RasterReader::row(int y)
+{
+    if(y < range_begin || y >= range_end)
+        return nullptr;
+
+    if(y >= strip_start + strip_rows) {
+        // keep the last row of this strip around as row y-1 of the next one
+        bool carry = (strip_rows > 0) && (y == strip_start + strip_rows);
+
+        if(carry)
+            std::memcpy(buffer.data(), buffer.data() + strip_rows * band_width, sizeof(float) * band_width);
+
+        readStrip(y);
+        has_carry = carry;
+    }
+
+    else if(y < strip_start - (has_carry ? 1 : 0)) {
+        readStrip(y);
+    }
+
+    return buffer.constData() + (1 + y - strip_start) * band_width;
+}
+
+void RasterReader::readStrip(int first_row)
+{
+    strip_start = first_row;
+    strip_rows = std::max(0, std::min(strip_height, range_end - first_row));
+    has_carry = false;
+
+    if(strip_rows == 0)
+        return;
+
+    float *dst = buffer.data() + band_width;
+    void *src = (format.type == GDT_Float32) ? (void*) dst : (void*) raw.data();
+
+    CPLErr err = band->RasterIO(GF_Read, 0, strip_start, band_width, strip_rows,
+                                src, band_width, strip_rows, format.type, 0, 0);
+
+    if(err != CE_None) {
+        qDebug() << "RasterIO failed reading rows" << strip_start << "to" << strip_start + strip_rows;
+        std::fill(dst, dst + (size_t) strip_rows * band_width, fill);
+        read_failed = true;
+        return;
+    }
+
+    decodeSamples(src, format, (size_t) strip_rows * band_width, norm_offset, norm_scale, fill, dst, seen);
+}
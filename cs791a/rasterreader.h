@@ -0,0 +1,69 @@
+#ifndef RASTERREADER_H
+#define RASTERREADER_H
+
+#include <QVector>
+
+#include <cstddef>
+
+#include "samplekernel.h"
+
+class GDALRasterBand;
+
+// Reads a raster band top to bottom in strips aligned to the band's natural
+// block size. The row before the current strip is carried over so a loader
+// can always look at rows y and y+1 without anything being read twice.
+// Samples are read in the band's native type and converted by the SIMD
+// sample kernel, which also tracks the band's min/max as rows go by.
+class RasterReader {
+public:
+    // Bands smaller than whole_band_limit bytes (as float) are read in a
+    // single RasterIO call. Pass 0 to always stream by strips.
+    RasterReader(GDALRasterBand *band, size_t whole_band_limit = 256 * 1024 * 1024);
+
+    // Same, restricted to rows [first_row, last_row) of the band.
+    RasterReader(GDALRasterBand *band, int first_row, int last_row, size_t whole_band_limit = 256 * 1024 * 1024);
+
+    int width() const {return band_width;}
+    int height() const {return band_height;}
+
+    // Returns row y converted to float, or nullptr when y is outside the
+    // rows the reader was made for. Rows are meant to be requested in
+    // increasing order; row y-1 stays valid after row y has been requested.
+    const float* row(int y);
+
+    // Set once a strip could not be read. Its rows come out as nodata and
+    // take no part in range(), so callers check it after their last row.
+    bool failed() const {return read_failed;}
+
+    // Makes every row read after this call come out mapped to [0,1] over
+    // [min,max], with nodata samples at 0. Without it rows hold raw values
+    // and nodata samples are NaN.
+    void setNormalization(float min, float max);
+
+    // Raw min/max of the valid samples read so far.
+    const SampleRange& range() const {return seen;}
+
+private:
+    void init(int first_row, int last_row, size_t whole_band_limit);
+    void readStrip(int first_row);
+
+    GDALRasterBand *band;
+    int band_width, band_height;
+    int range_begin;    // first row this reader may return
+    int range_end;      // one past the last row this reader may return
+    bool read_failed;
+
+    int strip_height;   // rows per RasterIO call, a multiple of the block height
+    int strip_start;    // first row held in buffer slot 1
+    int strip_rows;     // rows actually held, the last strip may be short
+    bool has_carry;     // slot 0 holds row strip_start-1
+
+    SampleFormat format;
+    float norm_offset, norm_scale, fill;
+    SampleRange seen;
+
+    QVector<float> buffer;
+    QVector<char> raw;  // native samples of one strip, unused for Float32 bands
+};
+
+#endif // RASTERREADER_H
@@ -0,0 +1,275 @@
+#include "samplekernel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SAMPLEKERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+typedef void (*DecodeFunc)(const void *src, const SampleFormat& format, size_t count,
+                           float offset, float scale, float fill, float *dst, SampleRange& range);
+
+// scalar path, also used for the tail the vector loops leave behind
+
+template<typename T>
+void decodeRange(const T *src, const SampleFormat& format, size_t begin, size_t end,
+                 float offset, float scale, float fill, float *dst, float& lo, float& hi)
+{
+    float nodata = (float) format.nodata;
+
+    for(size_t i = begin; i < end; i++) {
+        float v = (float) src[i];
+
+        if(v != v || (format.has_nodata && v == nodata)) {
+            dst[i] = fill;
+            continue;
+        }
+
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+        dst[i] = (v - offset) * scale;
+    }
+}
+
+template<typename T>
+void decodeScalar(const void *src, const SampleFormat& format, size_t count,
+                  float offset, float scale, float fill, float *dst, SampleRange& range)
+{
+    decodeRange((const T*) src, format, 0, count, offset, scale, fill, dst, range.min, range.max);
+}
+
+#ifdef SAMPLEKERNEL_X86
+
+// SSE2, four samples per step
+
+#ifdef __SSE2__
+
+inline __m128 loadSSE(const float *p) {return _mm_loadu_ps(p);}
+
+inline __m128 loadSSE(const double *p)
+{
+    return _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p)), _mm_cvtpd_ps(_mm_loadu_pd(p + 2)));
+}
+
+inline __m128 loadSSE(const int16_t *p)
+{
+    __m128i v = _mm_loadl_epi64((const __m128i*) p);
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+}
+
+inline __m128 loadSSE(const uint16_t *p)
+{
+    __m128i v = _mm_loadl_epi64((const __m128i*) p);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+
+inline __m128 loadSSE(const uint8_t *p)
+{
+    int32_t word;
+    std::memcpy(&word, p, sizeof(word));
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(word), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+
+// picks b where mask is set, a elsewhere
+inline __m128 selectSSE(__m128 a, __m128 b, __m128 mask)
+{
+    return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a));
+}
+
+template<typename T>
+void decodeSSE(const void *src_v, const SampleFormat& format, size_t count,
+               float offset, float scale, float fill, float *dst, SampleRange& range)
+{
+    const T *src = (const T*) src_v;
+
+    const __m128 nodata = _mm_set1_ps((float) format.nodata);
+    const __m128 voffset = _mm_set1_ps(offset);
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 vfill = _mm_set1_ps(fill);
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    const __m128 ninf = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+
+    __m128 lo = inf, hi = ninf;
+
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        __m128 v = loadSSE(src + i);
+        __m128 valid = _mm_cmpord_ps(v, v);
+
+        if(format.has_nodata)
+            valid = _mm_andnot_ps(_mm_cmpeq_ps(v, nodata), valid);
+
+        lo = _mm_min_ps(lo, selectSSE(inf, v, valid));
+        hi = _mm_max_ps(hi, selectSSE(ninf, v, valid));
+
+        __m128 r = _mm_mul_ps(_mm_sub_ps(v, voffset), vscale);
+        _mm_storeu_ps(dst + i, selectSSE(vfill, r, valid));
+    }
+
+    float lanes_lo[4], lanes_hi[4];
+    _mm_storeu_ps(lanes_lo, lo);
+    _mm_storeu_ps(lanes_hi, hi);
+
+    for(int l = 0; l < 4; l++) {
+        range.min = std::min(range.min, lanes_lo[l]);
+        range.max = std::max(range.max, lanes_hi[l]);
+    }
+
+    decodeRange(src, format, i, count, offset, scale, fill, dst, range.min, range.max);
+}
+
+#endif // __SSE2__
+
+// AVX2, eight samples per step, only called after a runtime CPU check
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 inline __m256 loadAVX(const float *p) {return _mm256_loadu_ps(p);}
+
+AVX2 inline __m256 loadAVX(const double *p)
+{
+    __m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(p));
+    __m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(p + 4));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+AVX2 inline __m256 loadAVX(const int16_t *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) p)));
+}
+
+AVX2 inline __m256 loadAVX(const uint16_t *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) p)));
+}
+
+AVX2 inline __m256 loadAVX(const uint8_t *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) p)));
+}
+
+template<typename T>
+AVX2 void decodeAVX2(const void *src_v, const SampleFormat& format, size_t count,
+                     float offset, float scale, float fill, float *dst, SampleRange& range)
+{
+    const T *src = (const T*) src_v;
+
+    const __m256 nodata = _mm256_set1_ps((float) format.nodata);
+    const __m256 voffset = _mm256_set1_ps(offset);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 vfill = _mm256_set1_ps(fill);
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    const __m256 ninf = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+
+    __m256 lo = inf, hi = ninf;
+
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8) {
+        __m256 v = loadAVX(src + i);
+        __m256 valid = _mm256_cmp_ps(v, v, _CMP_ORD_Q);
+
+        if(format.has_nodata)
+            valid = _mm256_andnot_ps(_mm256_cmp_ps(v, nodata, _CMP_EQ_OQ), valid);
+
+        lo = _mm256_min_ps(lo, _mm256_blendv_ps(inf, v, valid));
+        hi = _mm256_max_ps(hi, _mm256_blendv_ps(ninf, v, valid));
+
+        __m256 r = _mm256_mul_ps(_mm256_sub_ps(v, voffset), vscale);
+        _mm256_storeu_ps(dst + i, _mm256_blendv_ps(vfill, r, valid));
+    }
+
+    float lanes_lo[8], lanes_hi[8];
+    _mm256_storeu_ps(lanes_lo, lo);
+    _mm256_storeu_ps(lanes_hi, hi);
+
+    for(int l = 0; l < 8; l++) {
+        range.min = std::min(range.min, lanes_lo[l]);
+        range.max = std::max(range.max, lanes_hi[l]);
+    }
+
+    decodeRange(src, format, i, count, offset, scale, fill, dst, range.min, range.max);
+}
+
+#undef AVX2
+
+#endif // SAMPLEKERNEL_X86
+
+struct Kernel {
+    const char *name;
+    DecodeFunc byte, uint16, int16, float32, float64;
+};
+
+#define MAKE_KERNEL(func, name) \
+    Kernel{name, func<uint8_t>, func<uint16_t>, func<int16_t>, func<float>, func<double>}
+
+const Kernel& kernel()
+{
+    static const Kernel picked = [] {
+#ifdef SAMPLEKERNEL_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return MAKE_KERNEL(decodeAVX2, "avx2");
+#ifdef __SSE2__
+        return MAKE_KERNEL(decodeSSE, "sse2");
+#endif
+#endif
+        return MAKE_KERNEL(decodeScalar, "scalar");
+    }();
+
+    return picked;
+}
+
+#undef MAKE_KERNEL
+
+} // namespace
+
+bool isNativeSampleType(GDALDataType type)
+{
+    switch(type) {
+        case GDT_Byte:
+        case GDT_UInt16:
+        case GDT_Int16:
+        case GDT_Float32:
+        case GDT_Float64:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void decodeSamples(const void *src, const SampleFormat& format, size_t count,
+                   float offset, float scale, float fill, float *dst, SampleRange& range)
+{
+    const Kernel& k = kernel();
+
+    switch(format.type) {
+        case GDT_Byte:    k.byte(src, format, count, offset, scale, fill, dst, range); break;
+        case GDT_UInt16:  k.uint16(src, format, count, offset, scale, fill, dst, range); break;
+        case GDT_Int16:   k.int16(src, format, count, offset, scale, fill, dst, range); break;
+        case GDT_Float64: k.float64(src, format, count, offset, scale, fill, dst, range); break;
+        default:          k.float32(src, format, count, offset, scale, fill, dst, range); break;
+    }
+}
+
+void normalizeSamples(float *data, size_t count, float min, float max)
+{
+    SampleFormat format = {GDT_Float32, false, 0.0};
+    SampleRange ignored;
+
+    float scale = (max > min) ? 1.0f / (max - min) : 0.0f;
+
+    decodeSamples(data, format, count, min, scale, 0.0f, data, ignored);
+}
+
+const char* sampleKernelName()
+{
+    return kernel().name;
+}
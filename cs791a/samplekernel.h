@@ -0,0 +1,46 @@
+#ifndef SAMPLEKERNEL_H
+#define SAMPLEKERNEL_H
+
+#include <gdal.h>
+
+#include <cstddef>
+#include <limits>
+
+// How raw samples of a band are laid out and which value marks nodata.
+struct SampleFormat {
+    GDALDataType type;
+    bool has_nodata;
+    double nodata;
+};
+
+// Running min/max over valid samples.
+struct SampleRange {
+    float min = std::numeric_limits<float>::infinity();
+    float max = -std::numeric_limits<float>::infinity();
+
+    bool valid() const {return min <= max;}
+
+    void merge(const SampleRange& other) {
+        if(other.min < min) min = other.min;
+        if(other.max > max) max = other.max;
+    }
+};
+
+// True for the types decodeSamples reads natively (Byte, Int16, UInt16,
+// Float32, Float64). Other types should be read by GDAL as Float32.
+bool isNativeSampleType(GDALDataType type);
+
+// Converts count samples of format.type to float in one sweep, writing
+// (value - offset) * scale to dst and fill for nodata or NaN samples. The raw
+// min/max of the valid samples is merged into range. src and dst may alias
+// when format.type is Float32.
+void decodeSamples(const void *src, const SampleFormat& format, size_t count,
+                   float offset, float scale, float fill, float *dst, SampleRange& range);
+
+// Maps data to [0,1] over [min,max] in place. NaN samples become 0.
+void normalizeSamples(float *data, size_t count, float min, float max);
+
+// Name of the implementation picked for this CPU, for verbose output.
+const char* sampleKernelName();
+
+#endif // SAMPLEKERNEL_H
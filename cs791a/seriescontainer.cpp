@@ -0,0 +1,568 @@
+#include "seriescontainer.h"
+#include "datasetregistry.h"
+#include "rasterreader.h"
+#include "parallel.h"
+#include "seriesstats.h"
+
+#include <gdal_priv.h>
+
+#include <QByteArray>
+#include <QDebug>
+#include <QSaveFile>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+// Bump when the file layout or the chunk coding changes.
+static const quint32 SERIES_CONTAINER_VERSION = 2;
+static const char SERIES_CONTAINER_MAGIC[8] = {'C','S','7','9','1','T','S','C'};
+
+// zlib level for chunks; the deltas are mostly zeros, so the fastest level
+// already does nearly as well as the best
+static const int CHUNK_COMPRESSION = 1;
+
+// decoded time blocks readStep keeps for the steps after the first
+static const int BLOCK_CACHE_SIZE = 2;
+
+static const float QUANT_LEVELS = 65534.0f;
+
+// File layout: Header, the step numbers (padded to 8 bytes), one ChunkEntry
+// per chunk (time block major, then tile rows, then tiles), then the chunks.
+struct SeriesContainer::Header {
+    char magic[8];
+    quint32 version;
+    quint32 encoding;
+    qint32 width, height, steps;
+    qint32 tile_size, time_block;
+    float range_min, range_max;
+    char source_key[20];            // seriesFilesKey of the imported files
+};
+
+struct SeriesContainer::ChunkEntry {
+    quint64 offset;
+    quint32 size;
+    quint32 padding;
+};
+
+static quint16 floatToHalf(float f)
+{
+    quint32 x;
+    std::memcpy(&x, &f, sizeof(x));
+
+    quint32 sign = (x >> 16) & 0x8000;
+    int exp = (int) ((x >> 23) & 0xff) - 127 + 15;
+    quint32 mant = x & 0x7fffff;
+
+    // inf and NaN
+    if(((x >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+    if(exp >= 31)
+        return sign | 0x7c00;
+
+    // subnormal or too small
+    if(exp <= 0) {
+        if(exp < -10)
+            return sign;
+
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        quint32 half = mant >> shift;
+
+        if((mant >> (shift - 1)) & 1)
+            half++;
+
+        return sign | half;
+    }
+
+    // rounding up may carry into the exponent, which is still correct
+    quint32 half = sign | (exp << 10) | (mant >> 13);
+
+    if(mant & 0x1000)
+        half++;
+
+    return half;
+}
+
+static float halfToFloat(quint16 h)
+{
+    quint32 sign = (quint32) (h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    quint32 mant = h & 0x3ff;
+    quint32 x;
+
+    if(exp == 0 && mant == 0) {
+        x = sign;
+    }
+
+    else if(exp == 0) {
+        // subnormal, renormalize
+        exp = 1;
+
+        while(!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+
+        x = sign | ((quint32) (exp - 15 + 127) << 23) | ((mant & 0x3ff) << 13);
+    }
+
+    else if(exp == 31) {
+        x = sign | 0x7f800000 | (mant << 13);
+    }
+
+    else {
+        x = sign | ((quint32) (exp - 15 + 127) << 23) | (mant << 13);
+    }
+
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Maps samples to the integer codes chunks store and back. Quantized codes
+// keep 0 for nodata.
+struct SampleCoder {
+    int encoding;
+    float min, max;
+
+    quint32 encode(float v) const
+    {
+        if(encoding == SeriesContainer::Float16)
+            return floatToHalf(v);
+
+        if(encoding == SeriesContainer::Quantized16) {
+            if(v != v)
+                return 0;
+
+            float t = (max > min) ? (v - min) / (max - min) : 0.0f;
+            return 1 + (quint32) (std::min(std::max(t, 0.0f), 1.0f) * QUANT_LEVELS + 0.5f);
+        }
+
+        quint32 bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        return bits;
+    }
+
+    float decode(quint32 code) const
+    {
+        if(encoding == SeriesContainer::Float16)
+            return halfToFloat(code);
+
+        if(encoding == SeriesContainer::Quantized16)
+            return code ? min + (code - 1) / QUANT_LEVELS * (max - min) : NAN;
+
+        float v;
+        std::memcpy(&v, &code, sizeof(v));
+        return v;
+    }
+};
+
+// Codes n steps of one tile time major and stores each step as its
+// difference to the previous one (wrapping, so it is exact).
+template<typename Code>
+static QByteArray encodeChunk(const QVector<QVector<float>>& grids, int n, int width,
+                              int x0, int z0, int tw, int th, const SampleCoder& coder)
+{
+    int cells = tw * th;
+    QVector<Code> codes(n * cells);
+    Code *c = codes.data();
+
+    for(int t = 0; t < n; t++) {
+        const float *grid = grids[t].constData();
+
+        for(int z = 0; z < th; z++) {
+            for(int x = 0; x < tw; x++)
+                c[t * cells + z * tw + x] = (Code) coder.encode(grid[(z0 + z) * width + x0 + x]);
+        }
+    }
+
+    for(int t = n - 1; t > 0; t--) {
+        for(int i = 0; i < cells; i++)
+            c[t * cells + i] -= c[(t - 1) * cells + i];
+    }
+
+    return qCompress((const uchar*) c, sizeof(Code) * codes.size(), CHUNK_COMPRESSION);
+}
+
+template<typename Code>
+static bool decodeCodes(const QByteArray& raw, int n, int cells, const SampleCoder& coder, QVector<float>& out)
+{
+    if(raw.size() != (int) sizeof(Code) * n * cells)
+        return false;
+
+    QVector<Code> codes(n * cells);
+    std::memcpy(codes.data(), raw.constData(), raw.size());
+    Code *c = codes.data();
+
+    for(int t = 1; t < n; t++) {
+        for(int i = 0; i < cells; i++)
+            c[t * cells + i] += c[(t - 1) * cells + i];
+    }
+
+    out.resize(n * cells);
+    float *o = out.data();
+
+    for(int i = 0; i < n * cells; i++)
+        o[i] = coder.decode(c[i]);
+
+    return true;
+}
+
+bool SeriesContainer::write(const QString& path, const QStringList& files, const QVector<int>& step_numbers,
+                            const SampleRange& range, Encoding encoding, int tile_size, int time_block)
+{
+    if(files.isEmpty() || files.size() != step_numbers.size()) {
+        qDebug() << "No time steps to import into" << path;
+        return false;
+    }
+
+    int width, height;
+    {
+        DatasetHandle ds(files[0]);
+
+        if(!ds) {
+            qDebug() << "Unable to get GDAL Dataset for file: " << files[0];
+            return false;
+        }
+
+        width = ds->GetRasterXSize();
+        height = ds->GetRasterYSize();
+    }
+
+    int steps = files.size();
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_z = (height + tile_size - 1) / tile_size;
+    int blocks = (steps + time_block - 1) / time_block;
+    int tiles = tiles_x * tiles_z;
+
+    SampleCoder coder = {encoding, range.min, range.max};
+
+    QVector<QByteArray> chunk_data(blocks * tiles);
+    QVector<QVector<float>> grids(time_block);
+
+    for(int block = 0; block < blocks; block++) {
+        int first = block * time_block;
+        int n = std::min(time_block, steps - first);
+        std::atomic<bool> failed(false);
+
+        // the block's steps are decoded whole, one file per thread
+        parallelBands(n, n, [&](int t, int, int) {
+            const QString& file = files[first + t];
+            DatasetHandle ds(file);
+
+            if(!ds || ds->GetRasterXSize() != width || ds->GetRasterYSize() != height) {
+                qDebug() << "Unable to import" << file << "(missing or not" << width << "x" << height << ")";
+                failed = true;
+                return;
+            }
+
+            grids[t].resize(width * height);
+            float *grid = grids[t].data();
+            RasterReader reader(ds->GetRasterBand(1));
+
+            for(int z = 0; z < height; z++) {
+                const float *row = reader.row(z);
+                std::copy(row, row + width, grid + z * width);
+            }
+
+            if(reader.failed()) {
+                qDebug() << "Unable to import" << file << "(read error)";
+                failed = true;
+            }
+        });
+
+        if(failed)
+            return false;
+
+        parallelBands(tiles, workerCount(), [&](int, int begin, int end) {
+            for(int i = begin; i < end; i++) {
+                int tx = i % tiles_x, tz = i / tiles_x;
+                int x0 = tx * tile_size, z0 = tz * tile_size;
+                int tw = std::min(tile_size, width - x0), th = std::min(tile_size, height - z0);
+
+                if(encoding == Float32)
+                    chunk_data[block * tiles + i] = encodeChunk<quint32>(grids, n, width, x0, z0, tw, th, coder);
+                else
+                    chunk_data[block * tiles + i] = encodeChunk<quint16>(grids, n, width, x0, z0, tw, th, coder);
+            }
+        });
+    }
+
+    Header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, SERIES_CONTAINER_MAGIC, sizeof(h.magic));
+    h.version = SERIES_CONTAINER_VERSION;
+    h.encoding = encoding;
+    h.width = width;
+    h.height = height;
+    h.steps = steps;
+    h.tile_size = tile_size;
+    h.time_block = time_block;
+    h.range_min = range.min;
+    h.range_max = range.max;
+
+    QByteArray source_key = seriesFilesKey(files);
+    std::memcpy(h.source_key, source_key.constData(), sizeof(h.source_key));
+
+    QVector<qint32> numbers((steps + 1) & ~1, 0);
+    std::copy(step_numbers.begin(), step_numbers.end(), numbers.begin());
+
+    QVector<ChunkEntry> entries(chunk_data.size());
+    quint64 offset = sizeof(Header) + sizeof(qint32) * numbers.size() + sizeof(ChunkEntry) * entries.size();
+    quint64 total = 0;
+
+    for(int i = 0; i < chunk_data.size(); i++) {
+        entries[i].offset = offset;
+        entries[i].size = chunk_data[i].size();
+        entries[i].padding = 0;
+        offset += chunk_data[i].size();
+        total += chunk_data[i].size();
+    }
+
+    QSaveFile out(path);
+
+    if(!out.open(QFile::WriteOnly)) {
+        qDebug() << "Unable to write series container: " << path << out.errorString();
+        return false;
+    }
+
+    out.write((const char*) &h, sizeof(h));
+    out.write((const char*) numbers.constData(), sizeof(qint32) * numbers.size());
+    out.write((const char*) entries.constData(), sizeof(ChunkEntry) * entries.size());
+
+    for(const QByteArray& chunk : chunk_data)
+        out.write(chunk.constData(), chunk.size());
+
+    if(!out.commit()) {
+        qDebug() << "Unable to write series container: " << path << out.errorString();
+        return false;
+    }
+
+    qDebug() << "series container: " << path << steps << "steps of" << width << "x" << height << ","
+             << total / 1024 << "KB in" << chunk_data.size() << "chunks";
+
+    return true;
+}
+
+SeriesContainer::SeriesContainer()
+    : map(nullptr), header(nullptr), step_numbers(nullptr), chunks(nullptr), tiles_x(0), tiles_z(0), blocks(0)
+{
+}
+
+SeriesContainer::~SeriesContainer()
+{
+    if(map)
+        file.unmap(map);
+}
+
+bool SeriesContainer::open(const QString& path)
+{
+    file.setFileName(path);
+
+    if(!file.exists() || !file.open(QFile::ReadOnly))
+        return false;
+
+    qint64 size = file.size();
+
+    if(size < (qint64) sizeof(Header))
+        return false;
+
+    map = file.map(0, size);
+    file.close();
+
+    if(map == nullptr)
+        return false;
+
+    const Header *h = (const Header*) map;
+
+    bool valid = std::memcmp(h->magic, SERIES_CONTAINER_MAGIC, sizeof(h->magic)) == 0
+            && h->version == SERIES_CONTAINER_VERSION
+            && h->encoding <= (quint32) Quantized16
+            && h->width > 0 && h->height > 0 && h->steps > 0
+            && h->tile_size > 0 && h->time_block > 0;
+
+    if(valid) {
+        tiles_x = (h->width + h->tile_size - 1) / h->tile_size;
+        tiles_z = (h->height + h->tile_size - 1) / h->tile_size;
+        blocks = (h->steps + h->time_block - 1) / h->time_block;
+
+        quint64 numbers = (h->steps + 1) & ~1;
+        quint64 count = (quint64) tiles_x * tiles_z * blocks;
+        quint64 table_end = sizeof(Header) + sizeof(qint32) * numbers + sizeof(ChunkEntry) * count;
+
+        valid = table_end <= (quint64) size;
+
+        if(valid) {
+            step_numbers = (const qint32*) (map + sizeof(Header));
+            chunks = (const ChunkEntry*) (map + sizeof(Header) + sizeof(qint32) * numbers);
+
+            for(quint64 i = 0; i < count && valid; i++)
+                valid = chunks[i].offset >= table_end && chunks[i].offset + chunks[i].size <= (quint64) size;
+        }
+    }
+
+    if(!valid) {
+        file.unmap(map);
+        map = nullptr;
+        return false;
+    }
+
+    header = h;
+
+    return true;
+}
+
+int SeriesContainer::width() const
+{
+    return header->width;
+}
+
+int SeriesContainer::height() const
+{
+    return header->height;
+}
+
+int SeriesContainer::steps() const
+{
+    return header->steps;
+}
+
+int SeriesContainer::stepNumber(int step) const
+{
+    return step_numbers[step];
+}
+
+QByteArray SeriesContainer::sourceKey() const
+{
+    return QByteArray(header->source_key, sizeof(header->source_key));
+}
+
+SampleRange SeriesContainer::range() const
+{
+    SampleRange r;
+    r.min = header->range_min;
+    r.max = header->range_max;
+    return r;
+}
+
+// Values of one chunk, time major: step, then row, then column of the tile.
+bool SeriesContainer::decodeChunk(int block, int tile_x, int tile_z, QVector<float>& out) const
+{
+    const ChunkEntry& entry = chunks[((quint64) block * tiles_z + tile_z) * tiles_x + tile_x];
+    QByteArray raw = qUncompress(map + entry.offset, entry.size);
+
+    int tile = header->tile_size;
+    int cells = std::min(tile, header->width - tile_x * tile) * std::min(tile, header->height - tile_z * tile);
+    int n = std::min(header->time_block, header->steps - block * header->time_block);
+
+    SampleCoder coder = {(int) header->encoding, header->range_min, header->range_max};
+
+    if(header->encoding == Float32)
+        return decodeCodes<quint32>(raw, n, cells, coder, out);
+
+    return decodeCodes<quint16>(raw, n, cells, coder, out);
+}
+
+QSharedPointer<const QVector<float>> SeriesContainer::decodedBlock(int block) const
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+
+        for(int i = 0; i < block_cache.size(); i++) {
+            if(block_cache[i].block == block) {
+                CachedBlock hit = block_cache[i];
+                block_cache.remove(i);
+                block_cache.prepend(hit);
+                return hit.values;
+            }
+        }
+    }
+
+    int width = header->width, height = header->height, tile = header->tile_size;
+    size_t grid = (size_t) width * height;
+    int n = std::min(header->time_block, header->steps - block * header->time_block);
+
+    QSharedPointer<QVector<float>> values(new QVector<float>(n * grid));
+    float *v = values->data();
+    std::atomic<bool> failed(false);
+
+    parallelBands(tiles_x * tiles_z, workerCount(), [&](int, int begin, int end) {
+        QVector<float> chunk;
+
+        for(int i = begin; i < end; i++) {
+            int tx = i % tiles_x, tz = i / tiles_x;
+
+            if(!decodeChunk(block, tx, tz, chunk)) {
+                failed = true;
+                return;
+            }
+
+            int x0 = tx * tile, z0 = tz * tile;
+            int tw = std::min(tile, width - x0), th = std::min(tile, height - z0);
+            const float *c = chunk.constData();
+
+            for(int t = 0; t < n; t++) {
+                for(int z = 0; z < th; z++, c += tw)
+                    std::copy(c, c + tw, v + t * grid + (size_t) (z0 + z) * width + x0);
+            }
+        }
+    });
+
+    if(failed)
+        return QSharedPointer<const QVector<float>>();
+
+    // two threads may have decoded the same block, either copy will do
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    CachedBlock decoded = {block, values};
+    block_cache.prepend(decoded);
+
+    if(block_cache.size() > BLOCK_CACHE_SIZE)
+        block_cache.resize(BLOCK_CACHE_SIZE);
+
+    return values;
+}
+
+bool SeriesContainer::readStep(int step, float *out) const
+{
+    if(!header || step < 0 || step >= header->steps)
+        return false;
+
+    QSharedPointer<const QVector<float>> block = decodedBlock(step / header->time_block);
+
+    if(!block)
+        return false;
+
+    size_t grid = (size_t) header->width * header->height;
+    const float *values = block->constData() + (step % header->time_block) * grid;
+    std::copy(values, values + grid, out);
+
+    return true;
+}
+
+bool SeriesContainer::readHistory(int x, int z, float *out) const
+{
+    if(!header || x < 0 || z < 0 || x >= header->width || z >= header->height)
+        return false;
+
+    int tile = header->tile_size;
+    int tx = x / tile, tz = z / tile;
+    int tw = std::min(tile, header->width - tx * tile), th = std::min(tile, header->height - tz * tile);
+    int cell = (z - tz * tile) * tw + (x - tx * tile);
+
+    QVector<float> chunk;
+
+    for(int block = 0; block < blocks; block++) {
+        if(!decodeChunk(block, tx, tz, chunk))
+            return false;
+
+        int n = chunk.size() / (tw * th);
+
+        for(int t = 0; t < n; t++)
+            out[block * header->time_block + t] = chunk[t * tw * th + cell];
+    }
+
+    return true;
+}
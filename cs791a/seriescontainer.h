@@ -0,0 +1,84 @@
+#ifndef SERIESCONTAINER_H
+#define SERIESCONTAINER_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QSharedPointer>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include <mutex>
+
+#include "samplekernel.h"
+
+// One file holding every step of a time series, so playback and analysis do
+// not pay a GDAL open and decode per step. The grid is cut into tiles and
+// time into blocks of steps; each tile of each block is a chunk stored time
+// major, every step as the difference to the one before (which is mostly
+// zeros for slowly changing data) and compressed with zlib. Steps can be
+// kept as float32 (lossless), float16 or 16 bit quantized over the series
+// range. The reader maps the file, so any step or any cell's history only
+// touches the chunks it needs. Reading is thread safe.
+class SeriesContainer {
+public:
+    enum Encoding {Float32 = 0, Float16 = 1, Quantized16 = 2};
+
+    // Imports band 1 of files, in order, into path. All files must be the
+    // same size; range is the raw range of the series, which quantized
+    // encoding maps onto 16 bits. Returns false and reports why on failure.
+    static bool write(const QString& path, const QStringList& files, const QVector<int>& step_numbers,
+                      const SampleRange& range, Encoding encoding, int tile_size = 64, int time_block = 16);
+
+    SeriesContainer();
+    ~SeriesContainer();
+
+    // Maps path. Returns false when it is missing or malformed.
+    bool open(const QString& path);
+
+    int width() const;
+    int height() const;
+    int steps() const;
+    int stepNumber(int step) const;
+    SampleRange range() const;
+
+    // seriesFilesKey of the files the series was imported from, to check
+    // it against the files there are now.
+    QByteArray sourceKey() const;
+
+    // Raw values of step, width() x height() row major, nodata as NaN.
+    // Decodes the chunks of the step's time block, which are kept around
+    // for the steps after it.
+    bool readStep(int step, float *out) const;
+
+    // Raw values of cell (x, z) over every step, steps() floats.
+    bool readHistory(int x, int z, float *out) const;
+
+private:
+    struct Header;
+    struct ChunkEntry;
+
+    SeriesContainer(const SeriesContainer&);
+    SeriesContainer& operator=(const SeriesContainer&);
+
+    bool decodeChunk(int block, int tile_x, int tile_z, QVector<float>& out) const;
+    QSharedPointer<const QVector<float>> decodedBlock(int block) const;
+
+    QFile file;
+    uchar *map;
+    const Header *header;
+    const qint32 *step_numbers;
+    const ChunkEntry *chunks;
+    int tiles_x, tiles_z, blocks;
+
+    struct CachedBlock {
+        int block;
+        QSharedPointer<const QVector<float>> values;
+    };
+
+    // the last time blocks readStep decoded, most recent first
+    mutable std::mutex cache_mutex;
+    mutable QVector<CachedBlock> block_cache;
+};
+
+#endif // SERIESCONTAINER_H
@@ -0,0 +1,254 @@
+#include "seriesprobe.h"
+#include "timeseries.h"
+#include "seriescontainer.h"
+#include "rasterreader.h"
+#include "parallel.h"
+
+#include <gdal_priv.h>
+
+#include <QDebug>
+#include <QDir>
+#include <QSet>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+SeriesProbe::SeriesProbe(const QString& directory, const QString& dem, const QString& mask, size_t budget_bytes)
+    : directory(directory), dem_file(dem), mask_file(mask), budget_bytes(budget_bytes), ready(false)
+{
+    loader = std::thread(&SeriesProbe::load, this);
+}
+
+SeriesProbe::~SeriesProbe()
+{
+    loader.join();
+
+    for(Variable& variable : variables)
+        delete variable.series;
+}
+
+QStringList SeriesProbe::findVariables(const QString& directory)
+{
+    QDir dir(directory);
+    QSet<QString> found;
+
+    // <variable>.<step>.tif
+    for(const QString& name : dir.entryList(QStringList() << "*.tif", QDir::Files)) {
+        QStringList parts = name.split('.');
+
+        bool ok = false;
+        if(parts.size() == 3)
+            parts[1].toInt(&ok);
+
+        if(ok)
+            found.insert(parts[0]);
+    }
+
+    for(const QString& name : dir.entryList(QStringList() << "*.tsc", QDir::Files))
+        found.insert(name.left(name.size() - 4));
+
+    QStringList names = found.values();
+    names.sort();
+
+    return names;
+}
+
+void SeriesProbe::load()
+{
+    dem = DatasetRegistry::band(dem_file);
+
+    if(!mask_file.isEmpty())
+        mask = DatasetRegistry::band(mask_file);
+
+    size_t cached = 0;
+
+    for(const QString& name : findVariables(directory)) {
+        Variable variable;
+        variable.name = name;
+        variable.series = new TimeSeries(directory, name, 1.0f);
+        variable.width = variable.height = 0;
+
+        if(variable.series->isEmpty()) {
+            delete variable.series;
+            continue;
+        }
+
+        if(const SeriesContainer *container = variable.series->getContainer()) {
+            variable.width = container->width();
+            variable.height = container->height();
+            variables.push_back(variable);
+            continue;
+        }
+
+        {
+            DatasetHandle ds(variable.series->file(0));
+
+            if(ds) {
+                variable.width = ds->GetRasterXSize();
+                variable.height = ds->GetRasterYSize();
+            }
+        }
+
+        if(!variable.width) {
+            qDebug() << "Unable to get GDAL Dataset for file: " << variable.series->file(0);
+            delete variable.series;
+            continue;
+        }
+
+        // a QVector holds under 2 GB
+        size_t bytes = sizeof(float) * variable.width * variable.height * variable.series->size();
+
+        if(cached + bytes <= budget_bytes && bytes <= (size_t) std::numeric_limits<int>::max()) {
+            transpose(variable);
+            cached += bytes;
+        }
+
+        else
+            qDebug() << "probe:" << name << "does not fit the cache," << bytes / (1024 * 1024)
+                     << "MB, reading it on each click";
+
+        variables.push_back(variable);
+    }
+
+    ready = true;
+}
+
+// Reads every step of variable and scatters it into cells, the steps spread
+// over worker threads. Each thread writes its own steps' slots only.
+void SeriesProbe::transpose(Variable& variable)
+{
+    const TimeSeries& series = *variable.series;
+    int width = variable.width, height = variable.height;
+    int steps = series.size();
+
+    variable.cells.fill(NAN, (int) ((size_t) width * height * steps));
+    float *cells = variable.cells.data();
+
+    parallelBands(steps, workerCount(), [&](int, int begin, int end) {
+        for(int t = begin; t < end; t++) {
+            DatasetHandle ds(series.file(t));
+
+            if(!ds || ds->GetRasterXSize() != width || ds->GetRasterYSize() != height) {
+                qDebug() << "Skipping unreadable or mismatched step: " << series.file(t);
+                continue;
+            }
+
+            RasterReader reader(ds->GetRasterBand(1));
+
+            for(int z = 0; z < height; z++) {
+                const float *row = reader.row(z);
+                float *out = cells + (size_t) z * width * steps + t;
+
+                for(int x = 0; x < width; x++)
+                    out[(size_t) x * steps] = row[x];
+            }
+
+            if(reader.failed()) {
+                qDebug() << "Skipping unreadable step: " << series.file(t);
+
+                for(size_t i = 0; i < (size_t) width * height; i++)
+                    cells[i * steps + t] = NAN;
+            }
+        }
+    });
+}
+
+// Cell (x, z) of every step file, for variables without a copy. Steps that
+// cannot be read are NaN.
+static void readCellHistory(const TimeSeries& series, int x, int z, float *values)
+{
+    parallelBands(series.size(), workerCount(), [&](int, int begin, int end) {
+        for(int t = begin; t < end; t++) {
+            DatasetHandle ds(series.file(t));
+            values[t] = NAN;
+
+            if(!ds || x >= ds->GetRasterXSize() || z >= ds->GetRasterYSize())
+                continue;
+
+            GDALRasterBand *band = ds->GetRasterBand(1);
+            float v;
+
+            if(band->RasterIO(GF_Read, x, z, 1, 1, &v, 1, 1, GDT_Float32, 0, 0) != CE_None)
+                continue;
+
+            int has_nodata = 0;
+            double nodata = band->GetNoDataValue(&has_nodata);
+
+            if(!has_nodata || v != (float) nodata)
+                values[t] = v;
+        }
+    });
+}
+
+static float sampleAt(const QSharedPointer<const BandBuffer>& band, int x, int z)
+{
+    if(!band || x < 0 || z < 0 || x >= band->width || z >= band->height)
+        return NAN;
+
+    return band->samples[z * band->width + x];
+}
+
+float SeriesProbe::elevation(int x, int z) const
+{
+    return ready ? sampleAt(dem, x, z) : NAN;
+}
+
+float SeriesProbe::maskValue(int x, int z) const
+{
+    return ready ? sampleAt(mask, x, z) : NAN;
+}
+
+bool SeriesProbe::histories(int x, int z, QVector<History>& out) const
+{
+    out.clear();
+
+    if(!ready)
+        return false;
+
+    for(const Variable& variable : variables) {
+        if(x < 0 || z < 0 || x >= variable.width || z >= variable.height)
+            continue;
+
+        const TimeSeries& series = *variable.series;
+        int steps = series.size();
+
+        History history;
+        history.variable = variable.name;
+        history.step_numbers.resize(steps);
+        history.values.resize(steps);
+
+        for(int t = 0; t < steps; t++)
+            history.step_numbers[t] = series.stepNumber(t);
+
+        if(const SeriesContainer *container = series.getContainer()) {
+            if(!container->readHistory(x, z, history.values.data()))
+                continue;
+        }
+
+        else if(!variable.cells.isEmpty()) {
+            const float *cell = variable.cells.constData() + ((size_t) z * variable.width + x) * steps;
+            std::copy(cell, cell + steps, history.values.data());
+        }
+
+        else
+            readCellHistory(series, x, z, history.values.data());
+
+        out.push_back(history);
+    }
+
+    return true;
+}
+
+size_t SeriesProbe::cacheBytes() const
+{
+    if(!ready)
+        return 0;
+
+    size_t bytes = 0;
+
+    for(const Variable& variable : variables)
+        bytes += variable.cells.size() * sizeof(float);
+
+    return bytes;
+}
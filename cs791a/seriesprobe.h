@@ -0,0 +1,81 @@
+#ifndef SERIESPROBE_H
+#define SERIESPROBE_H
+
+#include <QSharedPointer>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "datasetregistry.h"
+
+class TimeSeries;
+
+// What the probe reports about one grid cell: its elevation, mask value and
+// the history of every variable in the data directory. The data files hold a
+// whole grid per step, so one cell's history would mean opening every file
+// on each click. Instead every variable is read once, on a background
+// thread, into a pixel major copy (a cell's steps next to each other) and a
+// probe is one contiguous read per variable. Variables imported into a
+// series container are read from its mapped chunks directly, and those whose
+// copy would not fit the byte budget one pixel per step file on each click.
+class SeriesProbe {
+public:
+    struct History {
+        QString variable;
+        QVector<int> step_numbers;
+        QVector<float> values;      // raw, nodata as NaN
+    };
+
+    // dem and mask are the rasters of the grid the cells index; mask may be
+    // empty. budget_bytes bounds the pixel major copies. Loading starts
+    // right away.
+    SeriesProbe(const QString& directory, const QString& dem, const QString& mask, size_t budget_bytes);
+    ~SeriesProbe();
+
+    // Names of the variables with steps in directory (em, snow, ...),
+    // sorted.
+    static QStringList findVariables(const QString& directory);
+
+    bool isReady() const {return ready;}
+
+    // Raw DEM and mask samples at cell (x, z), NaN off the raster or
+    // without one.
+    float elevation(int x, int z) const;
+    float maskValue(int x, int z) const;
+
+    // The history of every variable whose rasters cover cell (x, z).
+    // Returns false while still loading.
+    bool histories(int x, int z, QVector<History>& out) const;
+
+    // Bytes held by the pixel major copies.
+    size_t cacheBytes() const;
+
+private:
+    SeriesProbe(const SeriesProbe&);
+    SeriesProbe& operator=(const SeriesProbe&);
+
+    struct Variable {
+        QString name;
+        TimeSeries *series;
+        int width, height;
+        QVector<float> cells;       // width * height x steps, if it fit the budget
+    };
+
+    void load();
+    void transpose(Variable& variable);
+
+    QString directory, dem_file, mask_file;
+    size_t budget_bytes;
+
+    QSharedPointer<const BandBuffer> dem, mask;
+    std::vector<Variable> variables;
+
+    std::atomic<bool> ready;
+    std::thread loader;
+};
+
+#endif // SERIESPROBE_H
@@ -0,0 +1,346 @@
+#include "seriesreduce.h"
+#include "timeseries.h"
+#include "seriescontainer.h"
+#include "datasetregistry.h"
+#include "rasterreader.h"
+#include "parallel.h"
+
+#include <gdal_priv.h>
+
+#include <QDebug>
+#include <QStringList>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+bool Reduction::parse(const QString& spec)
+{
+    QStringList parts = spec.split(":");
+    QString name = parts[0];
+    bool ok = true;
+
+    if(name == "sum" && parts.size() == 1)
+        op = Sum;
+    else if(name == "mean" && parts.size() == 1)
+        op = Mean;
+    else if(name == "min" && parts.size() == 1)
+        op = Min;
+    else if(name == "max" && parts.size() == 1)
+        op = Max;
+    else if(name == "argmax" && parts.size() == 1)
+        op = ArgMax;
+    else if(name == "crossing" && parts.size() == 2) {
+        op = Crossing;
+        threshold = parts[1].toFloat(&ok);
+    }
+    else if(name == "diff" && parts.size() == 3) {
+        bool ok2;
+        op = Difference;
+        first = parts[1].toInt(&ok);
+        second = parts[2].toInt(&ok2);
+        ok = ok && ok2;
+    }
+    else
+        return false;
+
+    return ok;
+}
+
+// Kernels folding one step into the running layer over cells [begin, end).
+// NaN samples are nodata and leave a cell as it is. The SSE2 loops do four
+// cells a step, the scalar ones finish the tail.
+
+// acc0 sum, acc1 count
+static void accumulateSum(const float *v, float *sum, float *count, size_t begin, size_t end)
+{
+    size_t i = begin;
+
+#ifdef __SSE2__
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    for(; i + 4 <= end; i += 4) {
+        __m128 x = _mm_loadu_ps(v + i);
+        __m128 valid = _mm_cmpord_ps(x, x);
+
+        _mm_storeu_ps(sum + i, _mm_add_ps(_mm_loadu_ps(sum + i), _mm_and_ps(valid, x)));
+        _mm_storeu_ps(count + i, _mm_add_ps(_mm_loadu_ps(count + i), _mm_and_ps(valid, one)));
+    }
+#endif
+
+    for(; i < end; i++) {
+        if(v[i] == v[i]) {
+            sum[i] += v[i];
+            count[i] += 1.0f;
+        }
+    }
+}
+
+// min/max take the accumulator when the sample is NaN, which is what the SSE
+// instructions do with the sample as the first operand
+static void accumulateMin(const float *v, float *acc, size_t begin, size_t end)
+{
+    size_t i = begin;
+
+#ifdef __SSE2__
+    for(; i + 4 <= end; i += 4)
+        _mm_storeu_ps(acc + i, _mm_min_ps(_mm_loadu_ps(v + i), _mm_loadu_ps(acc + i)));
+#endif
+
+    for(; i < end; i++)
+        acc[i] = (v[i] < acc[i]) ? v[i] : acc[i];
+}
+
+static void accumulateMax(const float *v, float *acc, size_t begin, size_t end)
+{
+    size_t i = begin;
+
+#ifdef __SSE2__
+    for(; i + 4 <= end; i += 4)
+        _mm_storeu_ps(acc + i, _mm_max_ps(_mm_loadu_ps(v + i), _mm_loadu_ps(acc + i)));
+#endif
+
+    for(; i < end; i++)
+        acc[i] = (v[i] > acc[i]) ? v[i] : acc[i];
+}
+
+// acc0 largest sample so far, acc1 the step it came from; ties keep the
+// earlier step
+static void accumulateArgMax(const float *v, float step, float *max, float *arg, size_t begin, size_t end)
+{
+    size_t i = begin;
+
+#ifdef __SSE2__
+    const __m128 s = _mm_set1_ps(step);
+
+    for(; i + 4 <= end; i += 4) {
+        __m128 x = _mm_loadu_ps(v + i);
+        __m128 m = _mm_loadu_ps(max + i);
+        __m128 greater = _mm_cmpgt_ps(x, m);
+
+        _mm_storeu_ps(max + i, _mm_or_ps(_mm_and_ps(greater, x), _mm_andnot_ps(greater, m)));
+        _mm_storeu_ps(arg + i, _mm_or_ps(_mm_and_ps(greater, s), _mm_andnot_ps(greater, _mm_loadu_ps(arg + i))));
+    }
+#endif
+
+    for(; i < end; i++) {
+        if(v[i] > max[i]) {
+            max[i] = v[i];
+            arg[i] = step;
+        }
+    }
+}
+
+// acc0 1 while the cell is at or above threshold, acc1 the last step it
+// dropped below
+static void accumulateCrossing(const float *v, float step, float threshold, float *above, float *crossed,
+                               size_t begin, size_t end)
+{
+    for(size_t i = begin; i < end; i++) {
+        float x = v[i];
+
+        if(x != x)
+            continue;
+
+        bool now_above = x >= threshold;
+
+        if(above[i] != 0.0f && !now_above)
+            crossed[i] = step;
+
+        above[i] = now_above ? 1.0f : 0.0f;
+    }
+}
+
+// Band 1 of step, raw with nodata as NaN.
+static bool readStepRaw(const TimeSeries& series, int step, QVector<float>& grid, int& width, int& height)
+{
+    const SeriesContainer *container = series.getContainer();
+
+    if(container) {
+        width = container->width();
+        height = container->height();
+        grid.resize(width * height);
+
+        return container->readStep(step, grid.data());
+    }
+
+    DatasetHandle ds(series.file(step));
+
+    if(!ds)
+        return false;
+
+    width = ds->GetRasterXSize();
+    height = ds->GetRasterYSize();
+    grid.resize(width * height);
+
+    RasterReader reader(ds->GetRasterBand(1));
+
+    for(int z = 0; z < height; z++) {
+        const float *row = reader.row(z);
+        std::copy(row, row + width, grid.data() + (size_t) z * width);
+    }
+
+    return !reader.failed();
+}
+
+bool reduceSeries(const TimeSeries& series, const Reduction& reduction, QVector<float>& layer, int& width, int& height,
+                  const std::atomic<bool> *cancel)
+{
+    QVector<int> steps;
+
+    if(reduction.op == Reduction::Difference) {
+        int a = series.findStep(reduction.first), b = series.findStep(reduction.second);
+
+        if(a < 0 || b < 0) {
+            qDebug() << "Reduction steps" << reduction.first << reduction.second << "not in the series";
+            return false;
+        }
+
+        steps << a << b;
+    }
+
+    else {
+        for(int i = 0; i < series.size(); i++)
+            steps << i;
+    }
+
+    if(steps.isEmpty()) {
+        qDebug() << "No time steps to reduce";
+        return false;
+    }
+
+    QVector<float> current, next;
+
+    if(!readStepRaw(series, steps[0], current, width, height)) {
+        qDebug() << "Unable to read time step: " << series.stepName(steps[0]);
+        return false;
+    }
+
+    size_t cells = (size_t) width * height;
+    const float inf = std::numeric_limits<float>::infinity();
+
+    QVector<float> acc0, acc1(cells, 0.0f);
+
+    switch(reduction.op) {
+        case Reduction::Min: acc0.fill(inf, cells); break;
+        case Reduction::Max: case Reduction::ArgMax: acc0.fill(-inf, cells); acc1.fill(-1.0f, cells); break;
+        case Reduction::Crossing: acc0.fill(0.0f, cells); acc1.fill(-1.0f, cells); break;
+        default: acc0.fill(0.0f, cells); break;
+    }
+
+    float *a0 = acc0.data(), *a1 = acc1.data();
+
+    for(int k = 0; k < steps.size(); k++) {
+        if(cancel && *cancel)
+            return false;
+
+        int next_width = 0, next_height = 0;
+        bool next_ok = true;
+
+        const float *v = current.constData();
+        float step = steps[k];
+
+        // one pool task loads the next step while the other folds this one
+        // in, spread over the rest of the pool
+        parallelFor(2, [&](int task) {
+            if(task == 0) {
+                if(k + 1 < steps.size())
+                    next_ok = readStepRaw(series, steps[k + 1], next, next_width, next_height);
+            }
+
+            else if(reduction.op == Reduction::Difference) {
+                // first step goes in negated, the second one adds to it
+                parallelBands(cells, workerCount(), [&](int, int begin, int end) {
+                    for(int i = begin; i < end; i++)
+                        a0[i] = (k == 0) ? -v[i] : a0[i] + v[i];
+                });
+            }
+
+            else {
+                parallelBands(cells, workerCount(), [&](int, int begin, int end) {
+                    switch(reduction.op) {
+                        case Reduction::Sum: case Reduction::Mean: accumulateSum(v, a0, a1, begin, end); break;
+                        case Reduction::Min: accumulateMin(v, a0, begin, end); break;
+                        case Reduction::Max: accumulateMax(v, a0, begin, end); break;
+                        case Reduction::ArgMax: accumulateArgMax(v, step, a0, a1, begin, end); break;
+                        case Reduction::Crossing: accumulateCrossing(v, step, reduction.threshold, a0, a1, begin, end); break;
+                        default: break;
+                    }
+                });
+            }
+        });
+
+        if(k + 1 < steps.size()) {
+            if(!next_ok || next_width != width || next_height != height) {
+                qDebug() << "Unable to reduce time step" << series.stepName(steps[k + 1])
+                         << "(missing or not" << width << "x" << height << ")";
+                return false;
+            }
+
+            current.swap(next);
+        }
+    }
+
+    layer.resize(cells);
+    float *out = layer.data();
+
+    parallelBands(cells, workerCount(), [&](int, int begin, int end) {
+        for(int i = begin; i < end; i++) {
+            switch(reduction.op) {
+                case Reduction::Sum: out[i] = (a1[i] > 0.0f) ? a0[i] : NAN; break;
+                case Reduction::Mean: out[i] = (a1[i] > 0.0f) ? a0[i] / a1[i] : NAN; break;
+                case Reduction::Min: case Reduction::Max: out[i] = std::isinf(a0[i]) ? NAN : a0[i]; break;
+                case Reduction::ArgMax: case Reduction::Crossing: out[i] = (a1[i] >= 0.0f) ? series.stepNumber((int) a1[i]) : NAN; break;
+                case Reduction::Difference: out[i] = a0[i]; break;
+            }
+        }
+    });
+
+    return true;
+}
+
+bool writeLayer(const QString& path, const QVector<float>& layer, int width, int height, const QString& reference)
+{
+    GDALDriver *driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+
+    if(!driver)
+        return false;
+
+    auto t = path.toLatin1();
+    GDALDataset *out = driver->Create(t.constData(), width, height, 1, GDT_Float32, nullptr);
+
+    if(!out) {
+        qDebug() << "Unable to write layer: " << path;
+        return false;
+    }
+
+    if(!reference.isEmpty()) {
+        DatasetHandle ref(reference);
+        double geot[6];
+
+        if(ref && ref->GetRasterXSize() == width && ref->GetRasterYSize() == height
+                && ref->GetGeoTransform(geot) == CE_None) {
+            out->SetGeoTransform(geot);
+            out->SetProjection(ref->GetProjectionRef());
+        }
+    }
+
+    GDALRasterBand *band = out->GetRasterBand(1);
+    band->SetNoDataValue(NAN);
+
+    CPLErr err = band->RasterIO(GF_Write, 0, 0, width, height, (void*) layer.constData(),
+                                width, height, GDT_Float32, 0, 0);
+
+    GDALClose((GDALDatasetH) out);
+
+    if(err != CE_None) {
+        qDebug() << "Unable to write layer: " << path;
+        return false;
+    }
+
+    return true;
+}
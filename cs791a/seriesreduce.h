@@ -0,0 +1,43 @@
+#ifndef SERIESREDUCE_H
+#define SERIESREDUCE_H
+
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+
+class TimeSeries;
+
+// A per cell reduction of a time series to one layer.
+struct Reduction {
+    enum Operation {Sum, Mean, Min, Max, ArgMax, Crossing, Difference};
+
+    Operation op = Mean;
+    float threshold = 0.0f;         // Crossing
+    int first = 0, second = 0;      // Difference, as step numbers
+
+    // Reads "sum", "mean", "min", "max", "argmax", "crossing:<threshold>"
+    // or "diff:<first step>:<second step>". Returns false on anything else.
+    bool parse(const QString& spec);
+};
+
+// Reduces series cell by cell into layer, width x height raw values with NaN
+// where no step had data:
+//   sum, mean, min, max   of the valid samples
+//   argmax                step number of the largest sample
+//   crossing              step number at which the cell last fell below
+//                         threshold after being at or above it (e.g. the
+//                         day snow disappeared)
+//   diff                  second step minus first step
+// Steps are streamed through one at a time, the next one loading while the
+// current one is folded into the running layer across worker threads, so
+// the series is never held whole. Returns false and reports why on failure,
+// or quietly once cancel gets set.
+bool reduceSeries(const TimeSeries& series, const Reduction& reduction, QVector<float>& layer, int& width, int& height,
+                  const std::atomic<bool> *cancel = nullptr);
+
+// Writes layer as a single band float GeoTIFF, georeferenced like reference
+// when it is given.
+bool writeLayer(const QString& path, const QVector<float>& layer, int width, int height, const QString& reference);
+
+#endif // SERIESREDUCE_H
@@ -0,0 +1,279 @@
+#include "seriesstats.h"
+#include "engine.h"
+#include "datasetregistry.h"
+#include "rasterreader.h"
+#include "parallel.h"
+
+#include <gdal_priv.h>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+// Bump when the file layout or the statistics change.
+static const quint32 STATS_CACHE_VERSION = 1;
+static const char STATS_CACHE_MAGIC[8] = {'C','S','7','9','1','S','T','S'};
+
+// File layout: StatsHeader, then histogram_bins quint64 counts.
+struct StatsHeader {
+    char magic[8];
+    quint32 version;
+    quint32 histogram_bins;
+    char key[20];
+    float range_min, range_max;
+    quint64 count;
+};
+
+float SeriesStats::percentile(float p) const
+{
+    if(!valid())
+        return 0.0f;
+
+    double target = std::max(0.0f, std::min(p, 1.0f)) * count;
+    double bin_width = (double) (range.max - range.min) / histogram.size();
+    quint64 below = 0;
+
+    for(int bin = 0; bin < histogram.size(); bin++) {
+        if(below + histogram[bin] >= target && histogram[bin] > 0) {
+            double frac = (target - below) / histogram[bin];
+            return range.min + (bin + frac) * bin_width;
+        }
+
+        below += histogram[bin];
+    }
+
+    return range.max;
+}
+
+// Only sizes and mtimes go into the key; hashing the contents would cost
+// the full read the cache is there to skip.
+QByteArray seriesFilesKey(const QStringList& files)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+
+    for(const QString& name : files) {
+        QFileInfo info(name);
+        hash.addData(QString("%1:%2:%3").arg(info.fileName()).arg(info.size())
+                     .arg(info.lastModified().toMSecsSinceEpoch()).toUtf8());
+    }
+
+    return hash.result();
+}
+
+static bool loadStats(const QString& path, const QByteArray& key, SeriesStats& stats)
+{
+    QFile file(path);
+
+    if(!file.open(QFile::ReadOnly))
+        return false;
+
+    QByteArray data = file.readAll();
+
+    if(data.size() != (int) (sizeof(StatsHeader) + sizeof(quint64) * SeriesStats::HISTOGRAM_BINS))
+        return false;
+
+    StatsHeader h;
+    std::memcpy(&h, data.constData(), sizeof(h));
+
+    bool valid = std::memcmp(h.magic, STATS_CACHE_MAGIC, sizeof(h.magic)) == 0
+            && h.version == STATS_CACHE_VERSION
+            && h.histogram_bins == (quint32) SeriesStats::HISTOGRAM_BINS
+            && std::memcmp(h.key, key.constData(), sizeof(h.key)) == 0;
+
+    if(!valid)
+        return false;
+
+    stats.range.min = h.range_min;
+    stats.range.max = h.range_max;
+    stats.count = h.count;
+    stats.histogram.resize(SeriesStats::HISTOGRAM_BINS);
+    std::memcpy(stats.histogram.data(), data.constData() + sizeof(h), sizeof(quint64) * SeriesStats::HISTOGRAM_BINS);
+
+    return true;
+}
+
+static void saveStats(const QString& path, const QByteArray& key, const SeriesStats& stats)
+{
+    StatsHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, STATS_CACHE_MAGIC, sizeof(h.magic));
+    std::memcpy(h.key, key.constData(), sizeof(h.key));
+    h.version = STATS_CACHE_VERSION;
+    h.histogram_bins = SeriesStats::HISTOGRAM_BINS;
+    h.range_min = stats.range.min;
+    h.range_max = stats.range.max;
+    h.count = stats.count;
+
+    QSaveFile out(path);
+
+    if(!out.open(QFile::WriteOnly)) {
+        qDebug() << "Unable to write statistics cache: " << path << out.errorString();
+        return;
+    }
+
+    out.write((const char*) &h, sizeof(h));
+    out.write((const char*) stats.histogram.constData(), sizeof(quint64) * stats.histogram.size());
+
+    if(!out.commit())
+        qDebug() << "Unable to write statistics cache: " << path << out.errorString();
+}
+
+// Two sweeps over the files, each band of threads taking a slice of them:
+// the global range first (from metadata where the files have it), then the
+// histogram over that range. A file that opens but cannot be read fails the
+// whole scan rather than leaving a hole in statistics that get cached, and
+// so does setting cancel.
+static bool computeStats(const QStringList& files, SeriesStats& stats, const std::atomic<bool> *cancel)
+{
+    int bands = std::min(workerCount(), (int) files.size());
+    std::atomic<bool> failed(false);
+
+    QVector<SampleRange> ranges(bands);
+    SampleRange *band_range = ranges.data();
+
+    parallelBands(files.size(), bands, [&](int band, int begin, int end) {
+        for(int f = begin; f < end; f++) {
+            if(cancel && *cancel) {
+                failed = true;
+                break;
+            }
+
+            SampleRange range;
+
+            if(!DatasetRegistry::knownRange(files[f], range)) {
+                DatasetHandle ds(files[f]);
+
+                if(!ds) {
+                    qDebug() << "Unable to get GDAL Dataset for file: " << files[f];
+                    continue;
+                }
+
+                RasterReader reader(ds->GetRasterBand(1));
+                for(int z = 0; z < reader.height(); z++)
+                    reader.row(z);
+
+                if(reader.failed()) {
+                    failed = true;
+                    continue;
+                }
+
+                range = reader.range();
+                DatasetRegistry::storeRange(files[f], range);
+            }
+
+            band_range[band].merge(range);
+        }
+    });
+
+    for(const SampleRange& r : ranges)
+        stats.range.merge(r);
+
+    if(failed || !stats.range.valid())
+        return false;
+
+    const int bins = SeriesStats::HISTOGRAM_BINS;
+    float min = stats.range.min;
+    float scale = (stats.range.max > stats.range.min) ? bins / (stats.range.max - stats.range.min) : 0.0f;
+
+    QVector<QVector<quint64>> histograms(bands, QVector<quint64>(bins, 0));
+    QVector<quint64> counts(bands, 0);
+
+    parallelBands(files.size(), bands, [&](int band, int begin, int end) {
+        quint64 *histogram = histograms[band].data();
+
+        for(int f = begin; f < end; f++) {
+            if(cancel && *cancel) {
+                failed = true;
+                break;
+            }
+
+            DatasetHandle ds(files[f]);
+
+            if(!ds)
+                continue;
+
+            RasterReader reader(ds->GetRasterBand(1));
+
+            for(int z = 0; z < reader.height(); z++) {
+                const float *row = reader.row(z);
+
+                for(int x = 0; x < reader.width(); x++) {
+                    float v = row[x];
+
+                    // NaN is nodata
+                    if(v != v)
+                        continue;
+
+                    // metadata ranges can be approximate, so clamp both ends
+                    int bin = std::max(0, std::min((int) ((v - min) * scale), bins - 1));
+                    histogram[bin]++;
+                    counts[band]++;
+                }
+            }
+
+            if(reader.failed())
+                failed = true;
+        }
+    });
+
+    if(failed)
+        return false;
+
+    stats.histogram.fill(0, bins);
+
+    for(int band = 0; band < bands; band++) {
+        for(int bin = 0; bin < bins; bin++)
+            stats.histogram[bin] += histograms[band][bin];
+
+        stats.count += counts[band];
+    }
+
+    return stats.valid();
+}
+
+bool seriesStatistics(const Options& options, const QString& name, const QStringList& files, SeriesStats& stats,
+                      const std::atomic<bool> *cancel)
+{
+    stats = SeriesStats();
+
+    if(files.isEmpty())
+        return false;
+
+    QString dir = QString::fromStdString(options.cache_directory);
+    if(dir.isEmpty())
+        dir = QFileInfo(files[0]).absolutePath();
+    else
+        QDir().mkpath(dir);
+
+    // series in other directories use the same variable names, so the name
+    // alone would collide in a shared cache directory
+    QByteArray where = QCryptographicHash::hash(QFileInfo(files[0]).absolutePath().toUtf8(),
+                                                QCryptographicHash::Sha1).toHex().left(8);
+    QString path = QDir(dir).filePath(name + "." + QString::fromLatin1(where) + ".stats");
+    QByteArray key = seriesFilesKey(files);
+
+    if(options.mesh_cache && loadStats(path, key, stats)) {
+        if(options.verbose)
+            qDebug() << "series statistics: " << path << "loaded from cache";
+
+        return true;
+    }
+
+    stats = SeriesStats();
+
+    if(!computeStats(files, stats, cancel))
+        return false;
+
+    if(options.mesh_cache)
+        saveStats(path, key, stats);
+
+    return true;
+}
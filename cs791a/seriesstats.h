@@ -0,0 +1,44 @@
+#ifndef SERIESSTATS_H
+#define SERIESSTATS_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include <atomic>
+
+#include "samplekernel.h"
+
+struct Options;
+
+// Statistics of band 1 over every file of a time series together, so all
+// steps can be colored on one scale.
+struct SeriesStats {
+    static const int HISTOGRAM_BINS = 1024;
+
+    SampleRange range;              // raw min/max over all files
+    quint64 count = 0;              // valid samples over all files
+    QVector<quint64> histogram;     // HISTOGRAM_BINS even bins over range
+
+    bool valid() const {return count > 0;}
+
+    // Raw value below which a fraction p of the samples lie, interpolated
+    // within its histogram bin.
+    float percentile(float p) const;
+};
+
+// Statistics of files, read from a sidecar cache when one matches the files'
+// sizes and mtimes, otherwise computed with the files spread over worker
+// threads and written to the cache. The cache file is named after name and
+// a hash of the files' directory, and lives in the cache directory or else
+// next to the first file. Returns false when no file could be read or cancel
+// got set.
+bool seriesStatistics(const Options& options, const QString& name, const QStringList& files, SeriesStats& stats,
+                      const std::atomic<bool> *cancel = nullptr);
+
+// 20 byte key of the names, sizes and mtimes of files, in order. Caches
+// derived from the files store it to tell when they went stale.
+QByteArray seriesFilesKey(const QStringList& files);
+
+#endif // SERIESSTATS_H
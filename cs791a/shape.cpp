@@ -2,18 +2,172 @@
 #include "engine.h"
 #include "vertex.h"
 #include "terrain.h"
-#include "graphics.h"
+#include "rasterreader.h"
+#include "elevationgrid.h"
+#include "datasetregistry.h"
 
 #include <gdal_priv.h>
 #include <ogrsf_frmts.h>
-#include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtc/type_ptr.hpp>
+#include <ogr_spatialref.h>
 
+#include <QByteArray>
 #include <QDebug>
+#include <QElapsedTimer>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// Appends the vertices of every line in geometry to xs and ys and the lines
+// to lines. Points and polygons are skipped, polygon outlines come in
+// through their boundary.
+static void collectLines(OGRGeometry *geometry, int feature, QVector<double>& xs, QVector<double>& ys,
+                         QVector<Shape::Line>& lines, QVector<OGRRawPoint>& scratch)
+{
+    switch(wkbFlatten(geometry->getGeometryType())) {
+        case wkbLineString: {
+            OGRLineString *line = (OGRLineString*) geometry;
+            int count = line->getNumPoints();
+
+            scratch.resize(count);
+            line->getPoints(scratch.data());
+
+            if(count < 2)
+                break;
+
+            int first = xs.size();
+
+            Shape::Line drawn;
+            drawn.first[0] = first;
+            drawn.count[0] = count;
+            drawn.feature = feature;
+            lines.push_back(drawn);
+
+            xs.resize(first + count);
+            ys.resize(first + count);
+
+            double *x = xs.data() + first, *y = ys.data() + first;
+
+            for(int i = 0; i < count; i++) {
+                x[i] = scratch[i].x;
+                y[i] = scratch[i].y;
+            }
+        }
+        break;
+
+        case wkbMultiLineString:
+        case wkbGeometryCollection: {
+            OGRGeometryCollection *collection = (OGRGeometryCollection*) geometry;
+
+            for(int i = 0; i < collection->getNumGeometries(); i++)
+                collectLines(collection->getGeometryRef(i), feature, xs, ys, lines, scratch);
+        }
+        break;
+
+        default:
+        break;
+    }
+}
+
+// Reprojects xs and ys in place from the layer's CRS to the DEM's when they
+// differ, in one call for all points. Points that fail to reproject are
+// dropped from xs, ys and their lines, and lines left with fewer than two
+// points go too.
+static void reproject(OGRLayer *layer, GDALDataset *dem, QVector<double>& xs, QVector<double>& ys,
+                      QVector<Shape::Line>& lines)
+{
+    OGRSpatialReference *source = layer->GetSpatialRef();
+    QByteArray wkt(dem->GetProjectionRef());
+
+    // without both there is nothing to go on, assume they match
+    if(source == nullptr || wkt.isEmpty() || xs.isEmpty())
+        return;
+
+    OGRSpatialReference target;
+    char *text = wkt.data();
+    target.importFromWkt(&text);
+
+    if(source->IsSame(&target))
+        return;
+
+    OGRCoordinateTransformation *transform = OGRCreateCoordinateTransformation(source, &target);
+
+    if(transform == nullptr) {
+        qDebug() << "Unable to reproject shape onto the DEM, drawing it unprojected";
+        return;
+    }
+
+    // the return value only says whether every point made it, the failed
+    // ones are flagged in success
+    QVector<int> success(xs.size(), 0);
+    transform->Transform(xs.size(), xs.data(), ys.data(), nullptr, success.data());
+    OGRCoordinateTransformation::DestroyCT(transform);
+
+    if(std::find(success.begin(), success.end(), 0) == success.end())
+        return;
+
+    int kept = 0, kept_lines = 0;
+
+    for(const Shape::Line& line : lines) {
+        int first = kept;
+
+        for(int i = line.first[0]; i < line.first[0] + line.count[0]; i++) {
+            if(success[i]) {
+                xs[kept] = xs[i];
+                ys[kept] = ys[i];
+                kept++;
+            }
+        }
+
+        if(kept - first < 2) {
+            kept = first;
+            continue;
+        }
+
+        Shape::Line& out = lines[kept_lines++];
+        out = line;
+        out.first[0] = first;
+        out.count[0] = kept - first;
+    }
+
+    qDebug() << "Unable to reproject" << xs.size() - kept << "of" << xs.size()
+             << "shape points onto the DEM, dropping them," << lines.size() - kept_lines << "lines left empty";
+
+    xs.resize(kept);
+    ys.resize(kept);
+    lines.resize(kept_lines);
+}
+
+// Rows first_row to last_row of band 1 of dem as an elevation grid,
+// normalized over range. Null when they cannot be read.
+static QSharedPointer<const ElevationGrid> readElevationRows(GDALDataset *dem, const SampleRange& range,
+                                                             int first_row, int last_row)
+{
+    int width = dem->GetRasterXSize();
+
+    RasterReader reader(dem->GetRasterBand(1), first_row, last_row + 1);
+    reader.setNormalization(range.min, range.max);
+
+    QVector<float> window((last_row - first_row + 1) * width);
+
+    for(int z = first_row; z <= last_row; z++) {
+        const float *row = reader.row(z);
+        std::copy(row, row + width, window.data() + (z - first_row) * width);
+    }
+
+    if(reader.failed())
+        return QSharedPointer<const ElevationGrid>();
+
+    return QSharedPointer<const ElevationGrid>(new ElevationGrid(width, dem->GetRasterYSize(), window, first_row));
+}
 
 Shape::Shape(Engine *eng, const QString &shape_file, Terrain *large_dem)
-    : engine(eng)
+    : engine(eng), file(shape_file), loaded(false), hue(0.0f), features(0), base_tolerance(0.0f)
 {
+    QElapsedTimer timer;
+    timer.start();
+
     auto t = shape_file.toLatin1();
     OGRDataSource* ds = OGRSFDriverRegistrar::Open( t.constData(), FALSE );
 
@@ -21,188 +175,233 @@ Shape::Shape(Engine *eng, const QString &shape_file, Terrain *large_dem)
     if(ds == nullptr)
     {
         qDebug() << "Unable to open shape file: " << shape_file;
-        engine->stop(1);
+        return;
     }
     // Now lets grab the first layer
     OGRLayer *layer = ds->GetLayer(0);
 
-    // Grab the spatial reference and create a coordinate transform function
-    //OGRSpatialReference *sr = layer->GetSpatialRef();
+    bool boundary = shape_file.contains("bound");
 
-    // Get Geography Coordinate System
-    //OGRSpatialReference *geog = sr->CloneGeogCS();
+    // red for boundaries, blue otherwise
+    hue = boundary ? 0.0f : 2.0f / 3.0f;
 
-    // Now to create coordinate transform function
-    //OGRCoordinateTransformation *poTransform = OGRCreateCoordinateTransformation( sr, geog );
-
-
-    // Taking from http://www.compsci.wm.edu/SciClone/documentation/software/geo/gdal-1.9.0/html/ogr/ogr_apitut.html
+    // every vertex of the layer in two flat arrays, so the transforms below
+    // run over all of them at once
+    QVector<double> xs, ys;
+    QVector<OGRRawPoint> scratch;
     OGRFeature *poFeature;
 
-    float xOffset = large_dem->getDataset()->GetRasterXSize() / 2;
-    float zOffset = large_dem->getDataset()->GetRasterYSize() / 2;
-    auto geot = large_dem->getGeot();
-
-    Vertex tempVert;
-
-    GDALRasterBand *raster = large_dem->getDataset()->GetRasterBand(1);
+    layer->ResetReading();
+    while( (poFeature = layer->GetNextFeature()) != nullptr )
+    {
+        OGRGeometry *poGeometry = poFeature->GetGeometryRef();
 
-    int width = raster->GetXSize();//terrain_img.getWidth();
-    int height = raster->GetYSize();//terrain_img.getHeight();
+        if(poGeometry != nullptr && boundary) {
+            OGRGeometry *outline = poGeometry->Boundary();
 
-    int gotMin, gotMax;
+            if(outline) {
+                collectLines(outline, features, xs, ys, lines, scratch);
+                delete outline;
+            }
+        }
 
-    float min = raster->GetMinimum(&gotMin);
-    float max = raster->GetMaximum(&gotMax);
+        else if(poGeometry != nullptr)
+            collectLines(poGeometry, features, xs, ys, lines, scratch);
 
-    double minMax[2] = {min, max};
+        OGRFeature::DestroyFeature( poFeature );
+        features++;
+    }
 
-    if(!(gotMin && gotMax)) {
-        GDALComputeRasterMinMax((GDALRasterBandH) raster, TRUE, minMax);
+    // a handle of our own, shapes load alongside the terrains
+    DatasetHandle dem(large_dem->getMapFile());
 
-        min = minMax[0];
-        max = minMax[1];
+    if(!dem) {
+        qDebug() << "Unable to get GDAL Dataset for file: " << large_dem->getMapFile();
+        OGRDataSource::DestroyDataSource( ds );
+        return;
     }
 
-    float maxOffset = max - min;
+    reproject(layer, dem.get(), xs, ys, lines);
 
-    QVector<QVector<float>> pixels(height, QVector<float>(width));
+    OGRDataSource::DestroyDataSource( ds );
 
-    for(int i = 0; i < height; i++) {
-        raster->RasterIO(GF_Read, 0, i, width, 1, pixels[i].data(), width, 1, GDT_Float32, 0, 0);
-    }
+    int width = dem->GetRasterXSize();
+    int height = dem->GetRasterYSize();
 
-    layer->ResetReading();
-    while( (poFeature = layer->GetNextFeature()) != nullptr )
-    {
-        //OGRFeatureDefn *poFDefn = layer->GetLayerDefn();
-
-        OGRGeometry *poGeometry;
+    double geot[6];
+    dem->GetGeoTransform(geot);
 
-        if(shape_file.contains("bound")) {
-            poGeometry = poFeature->GetGeometryRef()->Boundary();
+    int count = xs.size();
+    QVector<float> cols(count), rows(count);
+    ElevationGrid::toPixels(geot, xs.constData(), ys.constData(), count, cols.data(), rows.data());
 
-            color[0] = 1;
-            color[1] = 0;
-            color[2] = 0;
-            color[3] = 1;
-        }
+    // the full grid of the DEM the shapes drape over. It is null when the
+    // terrain holds no whole grid (streamed, too large to decode whole), and
+    // then only the rows the shape crosses are read, normalized over the
+    // same range as the terrain
+    QSharedPointer<const ElevationGrid> grid = large_dem->getElevation();
 
-        else {
-            poGeometry = poFeature->GetGeometryRef();
+    if(!grid) {
+        int first_row = 0, last_row = 0;
 
-            color[0] = 0;
-            color[1] = 0;
-            color[2] = 1;
-            color[3] = 1;
+        if(count > 0) {
+            auto bounds = std::minmax_element(rows.begin(), rows.end());
+            first_row = std::max(0, std::min(int(std::floor(*bounds.first)), height - 1));
+            last_row = std::max(first_row, std::min(int(std::ceil(*bounds.second)), height - 1));
         }
 
-        if( poGeometry != nullptr
-            && wkbFlatten(poGeometry->getGeometryType()) == wkbPoint )
-        {
-            //OGRPoint *poPoint = (OGRPoint *) poGeometry;
+        grid = readElevationRows(dem.get(), large_dem->getHeightRange(), first_row, last_row);
 
-            //printf( "%.3f,%3.f\n", poPoint->getX(), poPoint->getY() );
+        if(!grid) {
+            qDebug() << "Unable to read the elevations under shape file: " << shape_file;
+            return;
         }
-        else if (poGeometry != nullptr
-            && wkbFlatten(poGeometry->getGeometryType()) == wkbLineString)
-        {
-            OGRLineString* ls = (OGRLineString*)poGeometry;
-            for(int i = 0; i < ls->getNumPoints(); i++ )
-            {
-                OGRPoint p;
-                ls->getPoint(i,&p);
+    }
 
-                // This function can transform a larget set of points.....
-                float x = p.getX() - geot[0];
-                float z = p.getY() - geot[3];
+    // same layout as the terrain's vertices
+    float grid_scale = large_dem->getGridScale();
+    int woffset = width / 2;
+    int hoffset = height / 2;
 
-                tempVert.position[0] = (x / 10) - xOffset;
-                //tempVert.position[1] = 1.f;
-                tempVert.position[2] = (-z / 10) - zOffset;
+    points.resize(count);
+    Vertex *point = points.data();
 
+    for(int i = 0; i < count; i++) {
+        point[i].position[0] = (cols[i] - woffset) * grid_scale;
+        point[i].position[1] = grid->sample(cols[i], rows[i]) + 0.04;
+        point[i].position[2] = (rows[i] - hoffset) * grid_scale;
+    }
 
-                tempVert.position[1] = ((pixels[(-z / 10)][(x / 10)] - min) / maxOffset) + 0.04;
-                qDebug() << -z << ' ' << x;
-                //qDebug() << tempVert.position[0] << ' ' << tempVert.position[1] << ' ' << tempVert.position[2];
+    // level 1 drops detail finer than a DEM cell, which draping does not
+    // resolve anyway
+    base_tolerance = grid_scale;
+    buildPyramid();
 
-                points.push_back(tempVert);
+    loaded = true;
 
-                //qDebug() << x << ' ' << -z;
-                //poTransform->Transform (1, &x, &y);
-                //qDebug() << p.getX() << " " << p.getY()  << "Transformed!: " << x << " " << y;
-            }
-        }
-        OGRFeature::DestroyFeature( poFeature );
-    }
+    if(engine->getOptions().verbose)
+        qDebug() << "shape: " << shape_file << count << "vertices," << lines.size() << "lines,"
+                 << points.size() - count << "simplified vertices in" << timer.elapsed() << "ms";
+}
 
-    OGRDataSource::DestroyDataSource( ds );
+void Shape::featureColor(int feature, GLubyte rgba[4]) const
+{
+    // golden ratio steps put consecutive features far apart within a
+    // quarter turn around the file's hue
+    float offset = (feature * 0.618034f - std::floor(feature * 0.618034f)) - 0.5f;
+    float h = hue + offset * 0.25f;
+    h -= std::floor(h);
+
+    // HSV to RGB at full value
+    const float saturation = 0.8f;
+
+    for(int c = 0; c < 3; c++) {
+        float k = std::fmod(5.0f - 2.0f * c + h * 6.0f, 6.0f);
+        float v = 1.0f - saturation * std::max(0.0f, std::min(std::min(k, 4.0f - k), 1.0f));
+        rgba[c] = (GLubyte) std::lround(v * 255.0f);
+    }
 
-    init();
+    rgba[3] = 255;
 }
 
-void Shape::init()
+float Shape::levelTolerance(int level) const
 {
-    initGL();
+    return level > 0 ? std::ldexp(base_tolerance, level - 1) : 0.0f;
 }
 
-void Shape::initGL()
+// Douglas-Peucker over the ground (x, z) positions of a line, marking the
+// vertices kept at tolerance in keep. The ends are always kept.
+static void simplifyLine(const Vertex *line, int count, float tolerance, QVector<char>& keep)
 {
-    program = engine->graphics->getShaderProgram("shape");
-    Vertex *geo = points.data();
+    keep.fill(0, count);
+    keep[0] = keep[count - 1] = 1;
 
-    glGenVertexArrays(1, &vao);
-    glGenBuffers(1, &vbo);
+    std::vector<std::pair<int, int>> spans;
+    spans.push_back(std::make_pair(0, count - 1));
 
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(*geo) * points.size(), geo, GL_STATIC_DRAW);
+    float limit = tolerance * tolerance;
 
-    loc_mvp = glGetUniformLocation(program, "mvpMatrix");
-    loc_position = glGetAttribLocation(program, "v_position");
-    loc_heightScalar = glGetUniformLocation(program, "heightScalar");
-    loc_color = glGetUniformLocation(program, "lineColor");
+    while(!spans.empty()) {
+        int a = spans.back().first, b = spans.back().second;
+        spans.pop_back();
 
-    //qDebug() << loc_mvp << ' ' << loc_position << ' ' << loc_heightScalar << ' ' << loc_color;
-}
+        float ax = line[a].position[0], az = line[a].position[2];
+        float dx = line[b].position[0] - ax, dz = line[b].position[2] - az;
+        float length2 = dx * dx + dz * dz;
 
-void Shape::tick(float dt)
-{
-    Q_UNUSED(dt);
+        int worst = -1;
+        float worst_d2 = limit;
+
+        for(int i = a + 1; i < b; i++) {
+            float px = line[i].position[0] - ax, pz = line[i].position[2] - az;
+
+            // distance to the segment, not the infinite line, so spikes
+            // past the ends count
+            float t = length2 > 0.0f ? std::max(0.0f, std::min(1.0f, (px * dx + pz * dz) / length2)) : 0.0f;
+            float ex = px - t * dx, ez = pz - t * dz;
+            float d2 = ex * ex + ez * ez;
+
+            if(d2 > worst_d2) {
+                worst_d2 = d2;
+                worst = i;
+            }
+        }
+
+        if(worst >= 0) {
+            keep[worst] = 1;
+            spans.push_back(std::make_pair(a, worst));
+            spans.push_back(std::make_pair(worst, b));
+        }
+    }
 }
 
-void Shape::render()
+// Appends the coarser levels of every line after the full resolution
+// points. Every level is simplified from the full line, not the level
+// before, so its error stays within its own tolerance rather than adding up
+// over the levels. With one line and larger tolerances Douglas-Peucker only
+// ever splits less, so each level keeps a subset of the one before, and a
+// level keeping as many reuses the range of the one before.
+void Shape::buildPyramid()
 {
-    glm::mat4 mvp = engine->graphics->projection * engine->graphics->view * model;
+    QVector<Vertex> coarse;
+    QVector<char> keep;
+
+    int base = points.size();
 
-    glUseProgram(program);
+    for(Line& line : lines) {
+        const Vertex *full = points.constData() + line.first[0];
+        int count = line.count[0];
 
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        line.lower = line.upper = glm::vec3(full[0].position[0], full[0].position[1], full[0].position[2]);
 
-    glUniformMatrix4fv(loc_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+        for(int i = 1; i < count; i++) {
+            glm::vec3 p(full[i].position[0], full[i].position[1], full[i].position[2]);
+            line.lower = glm::min(line.lower, p);
+            line.upper = glm::max(line.upper, p);
+        }
 
-    //glEnableVertexAttribArray(loc_heightScalar);
-    glUniform1f(loc_heightScalar, engine->getOptions().height_scalar);
-    glUniform4fv(loc_color, 1, color);
+        for(int level = 1; level < LOD_LEVELS; level++) {
+            line.first[level] = line.first[level - 1];
+            line.count[level] = line.count[level - 1];
 
-    glEnableVertexAttribArray(loc_position);
+            if(line.count[level] <= 2)
+                continue;
 
-    glVertexAttribPointer( loc_position,
-                           3,
-                           GL_FLOAT,
-                           GL_FALSE,
-                           sizeof(Vertex),
-                           (void*)offsetof(Vertex,position));
+            simplifyLine(full, count, levelTolerance(level), keep);
 
+            int kept = std::count(keep.constBegin(), keep.constEnd(), 1);
 
-    // draw object
-    glDrawArrays(GL_POINTS, 0, points.size());//mode, starting index, count
+            if(kept == line.count[level - 1])
+                continue;
 
-    // disable attribute pointers
-    glDisableVertexAttribArray(loc_position);
+            line.first[level] = base + coarse.size();
+            line.count[level] = kept;
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+            for(int i = 0; i < count; i++)
+                if(keep[i])
+                    coarse.push_back(full[i]);
+        }
+    }
 
-    glUseProgram(0);
+    points += coarse;
 }
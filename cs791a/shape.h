@@ -5,34 +5,64 @@
 #include <QVector>
 
 #include "gl.h"
+#include "vertex.h"
 
 #include <glm/glm.hpp>
 
 class Engine;
-struct Vertex;
 class Terrain;
 
+// The lines of a shapefile's first layer, draped over a DEM and laid out
+// like that terrain's vertices. Only loads; PolylineBatch draws them.
 class Shape {
 public:
+    // Loads on whatever thread it is made on. isLoaded() is false, the
+    // reason having been printed, when a file cannot be opened.
     Shape(Engine *eng, const QString& shape_file, Terrain *large_dem);
 
-    void init();
-    void initGL();
-    void tick(float dt);
-    void render();
+    bool isLoaded() const {return loaded;}
 
-private:
-    Engine *engine;
+    // levels of detail per line, each simplified with twice the tolerance
+    // of the one before
+    static const int LOD_LEVELS = 5;
+
+    // one line string of the layer; a feature (a multi line string, a
+    // polygon outline with holes) may have several
+    struct Line {
+        int first[LOD_LEVELS];      // into getPoints(), level 0 has every vertex
+        int count[LOD_LEVELS];
+        int feature;
+        glm::vec3 lower, upper;     // bounds, y normalized like the points
+    };
+
+    const QVector<Vertex>& getPoints() const {return points;}
+    const QVector<Line>& getLines() const {return lines;}
+    int featureCount() const {return features;}
+
+    // RGBA of feature. Hues are spread around the file's own (red for
+    // boundaries, blue otherwise), so features next to each other can be
+    // told apart while the files still stand out from one another.
+    void featureColor(int feature, GLubyte rgba[4]) const;
 
-    GLuint program;
-    GLuint vbo, vao;
-    GLint loc_mvp, loc_position, loc_color, loc_heightScalar;
+    const QString& getFile() const {return file;}
 
-    GLfloat color[4];
+    // Largest distance, in world units across the ground, between a line
+    // and its simplification at level (0 at level 0).
+    float levelTolerance(int level) const;
+
+private:
+    void buildPyramid();
+
+    Engine *engine;
+    QString file;
+    bool loaded;
 
-    glm::mat4 model;
+    float hue;                      // of the file, in turns
 
     QVector<Vertex> points;
+    QVector<Line> lines;
+    int features;
+    float base_tolerance;           // of level 1
 };
 
 #endif // SHAPE_H
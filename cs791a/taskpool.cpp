@@ -0,0 +1,91 @@
+#include "taskpool.h"
+
+#include <algorithm>
+
+TaskPool::TaskPool(int threads)
+    : running(0), quit(false), cancelled(false)
+{
+    for(int i = 0; i < std::max(threads, 1); i++)
+        workers.emplace_back(&TaskPool::workerMain, this);
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+        cancelled = true;
+        jobs.clear();
+    }
+
+    wake.notify_all();
+
+    for(std::thread& t : workers)
+        t.join();
+
+    for(Stage& stage : finished)
+        if(stage.discard)
+            stage.discard();
+}
+
+void TaskPool::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if(quit)
+            return;
+
+        jobs.push_back(job);
+    }
+
+    wake.notify_one();
+}
+
+void TaskPool::finish(std::function<void()> stage, std::function<void()> discard)
+{
+    Stage s = {stage, discard};
+
+    std::lock_guard<std::mutex> lock(mutex);
+    finished.push_back(s);
+}
+
+bool TaskPool::runFinished()
+{
+    std::deque<Stage> ready;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.swap(finished);
+    }
+
+    for(Stage& stage : ready)
+        stage.run();
+
+    // a job submits its follow ups and hands over its stage before it
+    // stops running, so nothing is missed between the checks
+    std::lock_guard<std::mutex> lock(mutex);
+    return jobs.empty() && running == 0 && finished.empty();
+}
+
+void TaskPool::workerMain()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for(;;) {
+        wake.wait(lock, [this] {return quit || !jobs.empty();});
+
+        if(quit)
+            return;
+
+        std::function<void()> job = jobs.front();
+        jobs.pop_front();
+        running++;
+
+        lock.unlock();
+        job();
+        lock.lock();
+
+        running--;
+    }
+}
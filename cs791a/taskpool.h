@@ -0,0 +1,60 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs independent CPU jobs (reading and meshing files) on worker threads
+// and passes the GL half of each back to the thread owning the context.
+// A job hands that half to finish(); the GL thread runs whatever has
+// finished from runFinished(), once a frame, in the order it finished.
+// Jobs may submit more jobs, e.g. ones that depend on what they loaded.
+class TaskPool {
+public:
+    explicit TaskPool(int threads);
+
+    // Cancels the jobs already running and waits for them; queued ones are
+    // dropped. Stages that never ran get their discard called instead, so
+    // what they would have taken over is freed.
+    ~TaskPool();
+
+    // Any thread. Jobs submitted while the pool is going away are dropped.
+    void submit(std::function<void()> job);
+    void finish(std::function<void()> stage, std::function<void()> discard = std::function<void()>());
+
+    // Set once the pool is going away. Long jobs check it now and then and
+    // give up early.
+    const std::atomic<bool>* cancelFlag() const {return &cancelled;}
+
+    // GL thread. Runs the stages finished so far. Returns true once every
+    // job and stage has run.
+    bool runFinished();
+
+private:
+    TaskPool(const TaskPool&);
+    TaskPool& operator=(const TaskPool&);
+
+    struct Stage {
+        std::function<void()> run;
+        std::function<void()> discard;
+    };
+
+    void workerMain();
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> jobs;
+    std::deque<Stage> finished;
+    int running;
+    bool quit;
+    std::atomic<bool> cancelled;
+
+    std::vector<std::thread> workers;
+};
+
+#endif // TASKPOOL_H
@@ -2,6 +2,18 @@
 #include "engine.h"
 #include "terrain.h"
 #include "graphics.h"
+#include "rasterreader.h"
+#include "parallel.h"
+#include "samplekernel.h"
+#include "meshcache.h"
+#include "terrainlod.h"
+#include "tilestreamer.h"
+#include "datasetregistry.h"
+#include "trianglemask.h"
+#include "timeseries.h"
+#include "seriescontainer.h"
+#include "camera.h"
+#include "elevationgrid.h"
 
 #include <gdal_priv.h>
 #include <cpl_conv.h>
@@ -13,24 +25,244 @@
 
 #include <QDebug>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+// Width in cells of the column bands the index builder walks. Two rows of a
+// band fit in a typical post-transform vertex cache, so most vertices are only
+// shaded once.
+static const int CACHE_BAND_WIDTH = 12;
+
+// Writes the indices of every cell in rows [begin, end) for which
+// keep(x, z, upper) is true, one column band at a time for vertex cache
+// reuse. With out == nullptr only counts them.
+template<typename Keep>
+static int emitGridIndices(GLuint *out, int width, int begin, int end, Keep keep)
+{
+    int count = 0;
+
+    for(int band = 0; band < width - 1; band += CACHE_BAND_WIDTH) {
+        int band_end = std::min(band + CACHE_BAND_WIDTH, width - 1);
+
+        for(int z = begin; z < end; z++) {
+            for(int x = band; x < band_end; x++) {
+                GLuint i = z * width + x;
+
+                if(keep(x, z, true)) {
+                    if(out) {
+                        out[count] = i;
+                        out[count + 1] = i + 1;
+                        out[count + 2] = i + width;
+                    }
+                    count += 3;
+                }
+
+                if(keep(x, z, false)) {
+                    if(out) {
+                        out[count] = i + width;
+                        out[count + 1] = i + width + 1;
+                        out[count + 2] = i + 1;
+                    }
+                    count += 3;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+// Builds the triangle list of the cells kept by keep(x, z, upper). Rows of
+// cells are split into bands that are counted and then written in parallel,
+// each into its own slice of the output found by a prefix sum of the counts.
+template<typename Keep>
+static void buildGridIndices(QVector<GLuint>& indices, int width, int height, Keep keep)
+{
+    int rows = height - 1;
+    int bands = workerCount();
+
+    QVector<int> offsets(bands + 1, 0);
+    int *offset = offsets.data();
+
+    parallelBands(rows, bands, [&](int band, int begin, int end) {
+        offset[band + 1] = emitGridIndices((GLuint*) nullptr, width, begin, end, keep);
+    });
+
+    for(int band = 0; band < bands; band++)
+        offset[band + 1] += offset[band];
+
+    indices.resize(offset[bands]);
+    GLuint *out = indices.data();
+
+    parallelBands(rows, bands, [&](int band, int begin, int end) {
+        emitGridIndices(out + offset[band], width, begin, end, keep);
+    });
+}
+
+// Calls func(z, row) for every row of band 1 of file. The rows are split into
+// bands that are read and processed on separate threads, each with its own
+// pooled dataset handle since GDAL handles are not thread safe. A band whose
+// thread cannot get a handle is read afterwards on the calling thread. Rows
+// come out mapped to [0,1] over *normalize when it is given, raw otherwise.
+// Sets seen to the raw min/max over the whole band, which a raw sweep also
+// records in the registry. Returns false when some rows could not be read,
+// leaving them unset or nodata.
+template<typename F>
+static bool forEachRowParallel(const QString& file, int height, const SampleRange *normalize, SampleRange& seen,
+                               F func)
+{
+    int bands = workerCount();
+    QVector<SampleRange> ranges(bands);
+    QVector<int> unread_begin(bands, 0), unread_end(bands, 0);
+    SampleRange *band_range = ranges.data();
+    int *skipped_begin = unread_begin.data();
+    int *skipped_end = unread_end.data();
+    std::atomic<bool> failed(false);
+
+    auto readRows = [&](GDALDataset *ds, int band, int begin, int end) {
+        RasterReader reader(ds->GetRasterBand(1), begin, end);
+
+        if(normalize)
+            reader.setNormalization(normalize->min, normalize->max);
+
+        for(int z = begin; z < end; z++)
+            func(z, reader.row(z));
+
+        band_range[band] = reader.range();
+
+        if(reader.failed())
+            failed = true;
+    };
+
+    parallelBands(height, bands, [&](int band, int begin, int end) {
+        DatasetHandle ds(file);
+
+        if(!ds) {
+            skipped_begin[band] = begin;
+            skipped_end[band] = end;
+            return;
+        }
+
+        readRows(ds.get(), band, begin, end);
+    });
+
+    for(int band = 0; band < bands; band++) {
+        if(skipped_begin[band] == skipped_end[band])
+            continue;
+
+        DatasetHandle ds(file);
+
+        if(!ds) {
+            qDebug() << "Unable to get GDAL Dataset for file: " << file << "rows"
+                     << skipped_begin[band] << "to" << skipped_end[band];
+            return false;
+        }
+
+        readRows(ds.get(), band, skipped_begin[band], skipped_end[band]);
+    }
+
+    if(failed) {
+        qDebug() << "Unable to read every row of file: " << file;
+        return false;
+    }
+
+    seen = SampleRange();
+    for(const SampleRange& r : ranges)
+        seen.merge(r);
+
+    if(!normalize)
+        DatasetRegistry::storeRange(file, seen);
+
+    return true;
+}
+
+// Second pass for bands without min/max metadata: maps the raw values the
+// decode sweep left in field(vertex) to [0,1] over range, nodata to 0.
+template<typename Field>
+static void normalizeVertices(Vertex *verts, int count, const SampleRange& range, Field field)
+{
+    float min = range.min;
+    float scale = (range.max > range.min) ? 1.0f / (range.max - range.min) : 0.0f;
+
+    parallelBands(count, workerCount(), [&](int, int begin, int end) {
+        for(int i = begin; i < end; i++) {
+            float& v = field(verts[i]);
+            v = (v == v) ? (v - min) * scale : 0.0f;
+        }
+    });
+}
+
+GLuint Terrain::patch_vao = 0;
+GLuint Terrain::patch_vbo = 0;
+GLuint Terrain::patch_ibo = 0;
+GLsizei Terrain::patch_index_count = 0;
+
+// Same as normalizeSamples, split across threads for whole grids.
+static void normalizeGrid(float *data, int count, const SampleRange& range)
+{
+    parallelBands(count, workerCount(), [&](int, int begin, int end) {
+        normalizeSamples(data + begin, end - begin, range.min, range.max);
+    });
+}
+
+// [0,1] to 16 bit unorm, out of range values clamped.
+static GLushort toUnorm16(float v)
+{
+    return (GLushort) (std::min(std::max(v, 0.0f), 1.0f) * 65535.0f + 0.5f);
+}
+
 Terrain::Terrain(Engine *eng, const QString& map, GLuint prog)
-    : engine(eng), map_file(map), program(prog)
+    : engine(eng), map_file(map), program(prog), grid_width(0), grid_height(0), grid_scale(1.0f),
+      compact(eng->getOptions().compact_vertices), data_front(0),
+      series_texture(0), series_layer_scale(0.0f), series_time(0.0f), lod(nullptr), streamer(nullptr),
+      vertex_owner(nullptr), mask_partner(nullptr), mask_enabled(true),
+      heightmap(eng->getOptions().heightmap), mask_mode(0), height_texture(0), mask_texture(0), data_texture(0),
+      dataset(nullptr)
 {
-    //init();
+    data_vbo[0] = data_vbo[1] = 0;
+    data_bytes[0] = data_bytes[1] = 0;
 }
 
 Terrain::~Terrain()
 {
-     GDALClose( (GDALDatasetH) dataset );
+    delete lod;
+    delete streamer;
+
+    if(series_texture)
+        glDeleteTextures(1, &series_texture);
+
+    if(dataset)
+        DatasetRegistry::release(map_file);
 }
 
-void Terrain::init()
+bool Terrain::load()
+{
+    if(!initTerrainFile())
+        return false;
+
+    if(engine->getOptions().lod && !heightmap && !streamer) {
+        // LOD appends its skirts to the geometry, so a cached mesh is copied
+        // out of the mapping first
+        if(mesh_cache) {
+            mesh_cache->copyVertices(geometry);
+            mesh_cache.clear();
+        }
+
+        lod = new TerrainLod(engine->getOptions().lod_error, engine->getOptions().lod_budget);
+        lod->build(geometry, grid_width, grid_height);
+        indices = lod->getIndices();
+    }
+
+    return true;
+}
+
+void Terrain::upload()
 {
     QString color_map = QString::fromStdString(engine->getOptions().color_map);
 
     textures.push_back(engine->graphics->createTextureFromFile(color_map, GL_TEXTURE_1D));
 
-    initTerrainFile();
     initGL();
 }
 
@@ -41,40 +273,71 @@ void Terrain::tick(float dt)
 
 void Terrain::render()
 {
+    if(heightmap) {
+        renderHeightmap();
+        return;
+    }
+
     glm::mat4 mvp = engine->graphics->projection * engine->graphics->view * model;
 
+    if(streamer) {
+        renderStreamed(mvp);
+        return;
+    }
+
     glUseProgram(program);
 
     glBindVertexArray(vao);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
 
     glUniformMatrix4fv(loc_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
 
     //glEnableVertexAttribArray(loc_heightScalar);
     glUniform1f(loc_heightScalar, engine->getOptions().height_scalar);
 
-    glEnableVertexAttribArray(loc_position);
-
-    if(program == engine->graphics->getShaderProgram("data"))
-        glEnableVertexAttribArray(loc_dataPoint);
+    // the programs are shared with heightmap terrains, which mask in the
+    // fragment shader instead of by indices
+    glUniform1i(loc_heightmap, GL_FALSE);
+    glUniform1i(loc_maskMode, 0);
+    const Terrain *source = vertexSource();
 
+    glUniform3fv(loc_positionScale, 1, glm::value_ptr(source->packing.scale));
+    glUniform3fv(loc_positionOffset, 1, glm::value_ptr(source->packing.offset));
 
-    glVertexAttribPointer( loc_position,
-                           3,
-                           GL_FLOAT,
-                           GL_FALSE,
-                           sizeof(Vertex),
-                           (void*)offsetof(Vertex,position));
+    glEnableVertexAttribArray(loc_position);
 
-    if(program == engine->graphics->getShaderProgram("data"))
-        glVertexAttribPointer(loc_dataPoint,
-                              1,
-                              GL_FLOAT,
+    if(source->compact) {
+        // positions arrive as plain integers and are decoded by the shader
+        glVertexAttribPointer(loc_position,
+                              3,
+                              GL_UNSIGNED_SHORT,
                               GL_FALSE,
-                              sizeof(Vertex),
-                              (void*)offsetof(Vertex,dataPoint));
+                              sizeof(CompactVertex),
+                              (void*)offsetof(CompactVertex,position));
+    }
+
+    else {
+        glVertexAttribPointer( loc_position,
+                               3,
+                               GL_FLOAT,
+                               GL_FALSE,
+                               sizeof(Vertex),
+                               (void*)offsetof(Vertex,position));
+    }
+
+    // data values come tightly packed from their own buffer, unorm when compact
+    if(program == engine->graphics->getShaderProgram("data") && data_bytes[data_front]) {
+        glEnableVertexAttribArray(loc_dataPoint);
+        glBindBuffer(GL_ARRAY_BUFFER, data_vbo[data_front]);
 
+        if(compact)
+            glVertexAttribPointer(loc_dataPoint, 1, GL_UNSIGNED_SHORT, GL_TRUE, 0, 0);
+        else
+            glVertexAttribPointer(loc_dataPoint, 1, GL_FLOAT, GL_FALSE, 0, 0);
 
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    }
 
     // send texture locations for all textures
     for(int i = 0; i < textures.size(); i++) {
@@ -84,333 +347,833 @@ void Terrain::render()
         //glUniform1i(loc_texture,i);
     }
 
+    if(series_texture && program == engine->graphics->getShaderProgram("series")) {
+        // its sampler is set to unit 4 when the program is created
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, series_texture);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUniform1i(loc_gridWidth, grid_width);
+        glUniform1f(loc_seriesLayer, series_time * series_layer_scale);
+    }
+
     // draw object
-    glDrawArrays(GL_TRIANGLES, 0, geometry.size());//mode, starting index, count
+    if(lod) {
+        lod->select(model, engine->graphics->projection * engine->graphics->view, engine->graphics->camera->getPosition(),
+                    engine->getOptions().height_scalar, engine->graphics->getPixelScale());
+
+        glMultiDrawElements(GL_TRIANGLES, lod->getDrawCounts().constData(), GL_UNSIGNED_INT,
+                            lod->getDrawOffsets().constData(), lod->getDrawCounts().size());
+    }
+
+    else {
+        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);//mode, count, type, offset
+    }
 
     // disable attribute pointers
     glDisableVertexAttribArray(loc_position);
 
-    if(program == engine->graphics->getShaderProgram("data"))
+    if(program == engine->graphics->getShaderProgram("data") && data_bytes[data_front])
         glDisableVertexAttribArray(loc_dataPoint);
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
     glBindVertexArray(0);
 
     glUseProgram(0);
 }
 
-void Terrain::initTerrainFile()
+bool Terrain::initTerrainFile()
 {
-    auto t = map_file.toLatin1();
-    dataset = (GDALDataset*) GDALOpen(t.constData(), GA_ReadOnly);
+    dataset = DatasetRegistry::open(map_file);
 
     if(dataset == nullptr) {
         qDebug() << "Unable to get GDAL Dataset for file: " << map_file;
-        exit(1);
+        return false;
     }
 
+    geot.resize(6);
+    dataset->GetGeoTransform(geot.data());
+    projection = dataset->GetProjectionRef();
+
     GDALRasterBand *raster = dataset->GetRasterBand(1);
 
     int width = raster->GetXSize();//terrain_img.getWidth();
     int height = raster->GetYSize();//terrain_img.getHeight();
 
-    int gotMin, gotMax;
-
-    float min = raster->GetMinimum(&gotMin);
-    float max = raster->GetMaximum(&gotMax);
-
-    double minMax[2] = {min, max};
-
-    if(!(gotMin && gotMax)) {
-        GDALComputeRasterMinMax((GDALRasterBandH) raster, TRUE, minMax);
+    float scale = engine->getOptions().map_scalar;
+    grid_scale = scale;
+
+    // with known min/max heights are normalized as they are decoded,
+    // otherwise the decode sweep finds them and a second pass normalizes
+    bool known = DatasetRegistry::knownRange(map_file, height_range);
+
+    if(engine->getOptions().stream) {
+        grid_width = width;
+        grid_height = height;
+
+        // tiles are normalized as they load, so the range has to be exact
+        // up front: an estimate would clip the heights past it. Without
+        // metadata that takes one pass over the file, which GDAL makes
+        // block by block without holding the band
+        if(!known) {
+            double min_max[2];
+            GDALComputeRasterMinMax((GDALRasterBandH) raster, FALSE, min_max);
+            height_range.min = min_max[0];
+            height_range.max = min_max[1];
+            DatasetRegistry::storeRange(map_file, height_range);
+        }
 
-        min = minMax[0];
-        max = minMax[1];
+        const Options& options = engine->getOptions();
+        streamer = new TileStreamer(map_file, height_range, scale, options.tile_size,
+                                    (size_t) options.tile_budget * 1024 * 1024, std::max(1, workerCount() / 2));
+        return streamer->isLoaded();
     }
 
-    if(engine->getOptions().verbose)
-        qDebug() << "terrain: " << map_file << "x: " << width << " y: " << height << "   min: " << min << " max: " << max;
-
-    int woffset = width / 2;
-    int hoffset = height / 2;
+    if(heightmap) {
+        grid_width = width;
+        grid_height = height;
+        heights.resize(width * height);
+        float *h = heights.data();
 
-    Vertex tempVert;
-    tempVert.position[1] = 0;
+        SampleRange seen;
+        bool read = forEachRowParallel(map_file, height, known ? &height_range : nullptr, seen,
+                                       [&](int z, const float *lineData) {
+            std::copy(lineData, lineData + width, h + z * width);
+        });
 
-    float maxOffset = max - min;
+        if(!read)
+            return false;
 
-    float scale = engine->getOptions().map_scalar;
-    float *lineData = (float*) CPLMalloc(sizeof(float) * width);
-    float *lineData2 = (float*) CPLMalloc(sizeof(float) * width);
+        if(!known) {
+            height_range = seen;
+            normalizeGrid(h, width * height, height_range);
+        }
 
-    for(int z = -hoffset; z < height - hoffset-1; z++) {
-        raster->RasterIO(GF_Read, 0, z + hoffset, width, 1, lineData, width, 1, GDT_Float32, 0, 0);
-        raster->RasterIO(GF_Read, 0, z + hoffset + 1, width, 1, lineData2, width, 1, GDT_Float32, 0, 0);
+        // the heights only live on the GPU after upload, apart from this
+        // copy kept for draping
+        std::lock_guard<std::mutex> lock(elevation_mutex);
+        elevation = QSharedPointer<const ElevationGrid>(new ElevationGrid(width, height, heights));
 
-        for(int x = -woffset; x < width - woffset-1; x++) {
-            tempVert.position[0] = x*scale;
-            tempVert.position[1] = (lineData[x+woffset]-min) / maxOffset;
-            tempVert.position[2] = z*scale;
+        return true;
+    }
 
-            geometry.push_back(tempVert);
+    QSharedPointer<MeshCache> cache(new MeshCache(engine->getOptions(), QStringList() << map_file,
+                                                  QString("dem scale=%1").arg(scale)));
 
-            tempVert.position[0] = (x+1) * scale;
-            tempVert.position[1] = (lineData[x+woffset+1]-min) / maxOffset;
-            tempVert.position[2] = z*scale;
+    if(cache->load()) {
+        grid_width = cache->gridWidth();
+        grid_height = cache->gridHeight();
+        height_range = cache->range();
+        cache->copyIndices(0, indices);
 
-            geometry.push_back(tempVert);
+        // the vertices stay in the mapping and are uploaded from there
+        mesh_cache = cache;
 
-            tempVert.position[0] = x*scale;
-            tempVert.position[1] = (lineData2[x+woffset]-min) / maxOffset;
-            tempVert.position[2] = (z+1) * scale;
+        if(engine->getOptions().verbose)
+            qDebug() << "terrain: " << map_file << "loaded from mesh cache";
 
-            geometry.push_back(tempVert);
+        return true;
+    }
 
-            // push bottom row of triangles
-            tempVert.position[0] = x*scale;
-            tempVert.position[1] = (lineData2[x+woffset]-min) / maxOffset;
-            tempVert.position[2] = (z+1) * scale;
+    int woffset = width / 2;
+    int hoffset = height / 2;
 
-            geometry.push_back(tempVert);
+    grid_width = width;
+    grid_height = height;
+    geometry.resize(width * height);
+    Vertex *verts = geometry.data();
+
+    // one vertex per sample, row major
+    SampleRange seen;
+    bool read = forEachRowParallel(map_file, height, known ? &height_range : nullptr, seen,
+                                   [&](int z, const float *lineData) {
+        Vertex *row = verts + z * width;
+
+        for(int x = 0; x < width; x++) {
+            row[x].position[0] = (x - woffset) * scale;
+            row[x].position[1] = lineData[x];
+            row[x].position[2] = (z - hoffset) * scale;
+        }
+    });
 
-            tempVert.position[0] = (x+1) * scale;
-            tempVert.position[1] = (lineData2[x+woffset+1]-min) / maxOffset;
-            tempVert.position[2] = (z+1) * scale;
+    if(!read)
+        return false;
 
-            geometry.push_back(tempVert);
+    if(!known) {
+        height_range = seen;
+        normalizeVertices(verts, width * height, height_range, [](Vertex& v) -> float& {return v.position[1];});
+    }
 
-            tempVert.position[0] = (x+1) * scale;
-            tempVert.position[1] = (lineData[x+woffset+1]-min) / maxOffset;
-            tempVert.position[2] = z*scale;
+    if(engine->getOptions().verbose)
+        qDebug() << "terrain: " << map_file << "x: " << width << " y: " << height
+                 << "   min: " << height_range.min << " max: " << height_range.max
+                 << " kernel: " << sampleKernelName();
 
-            geometry.push_back(tempVert);
+    buildGridIndices(indices, width, height, [](int, int, bool) {return true;});
 
-        }
-    }
+    cache->save(width, height, height_range, geometry, QVector<const QVector<GLuint>*>() << &indices);
 
-    CPLFree(lineData);
-    CPLFree(lineData2);
+    return true;
 }
 
 void Terrain::initGL(bool genBuffer)
 {
-    Vertex *geo = geometry.data();
+    if(streamer) {
+        loc_mvp = glGetUniformLocation(program, "mvpMatrix");
+        loc_position = glGetAttribLocation(program, "v_position");
+        loc_texture = glGetUniformLocation(program, "tex");
+        loc_heightScalar = glGetUniformLocation(program, "heightScalar");
+        loc_positionScale = glGetUniformLocation(program, "positionScale");
+        loc_positionOffset = glGetUniformLocation(program, "positionOffset");
+        loc_heightmap = glGetUniformLocation(program, "heightmap");
+        loc_maskMode = glGetUniformLocation(program, "maskMode");
+        return;
+    }
+
+    if(heightmap) {
+        initHeightmapGL();
+        return;
+    }
 
     if(genBuffer) {
         glGenVertexArrays(1, &vao);
-        glGenBuffers(1, &vbo);
+        glGenBuffers(1, &ibo);
+
+        // the mask terrain draws from its DEM terrain's buffer, so that one
+        // has to be set up first
+        if(vertex_owner)
+            vbo = vertex_owner->vbo;
+        else
+            glGenBuffers(1, &vbo);
     }
 
     glBindVertexArray(vao);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(*geo) * geometry.size(), geo, GL_STATIC_DRAW);
 
+    if(!vertex_owner)
+        uploadVertices();
+
+    if(genBuffer) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), indices.data(), GL_STATIC_DRAW);
+
+        if(mask_mode == 2)
+            updateDataGather();
+    }
+
+    getLocations();
+}
+
+void Terrain::getLocations()
+{
     loc_mvp = glGetUniformLocation(program, "mvpMatrix");
     loc_position = glGetAttribLocation(program, "v_position");
     loc_texture = glGetUniformLocation(program, "tex");
     loc_heightScalar = glGetUniformLocation(program, "heightScalar");
     loc_dataPoint = glGetAttribLocation(program, "dataPoint");
+    loc_gridWidth = glGetUniformLocation(program, "gridWidth");
+    loc_seriesLayer = glGetUniformLocation(program, "seriesLayer");
+    loc_positionScale = glGetUniformLocation(program, "positionScale");
+    loc_positionOffset = glGetUniformLocation(program, "positionOffset");
+
+    loc_heightmap = glGetUniformLocation(program, "heightmap");
+    loc_grid = glGetAttribLocation(program, "v_grid");
+    loc_gridSize = glGetUniformLocation(program, "gridSize");
+    loc_gridScale = glGetUniformLocation(program, "gridScale");
+    loc_patchesX = glGetUniformLocation(program, "patchesX");
+    loc_patchSize = glGetUniformLocation(program, "patchSize");
+    loc_maskMode = glGetUniformLocation(program, "maskMode");
+}
+
+// Fills the bound vertex buffer from geometry, or the mesh cache mapping.
+void Terrain::uploadVertices()
+{
+    const Vertex *geo = vertexData();
+    int count = vertexCount();
+
+    QVector<CompactVertex> packed;
+
+    // x and z quantize to exact grid indices, heights to 16 bit unorm over
+    // their range (skirts hang below 0). A grid too large for that keeps the
+    // float layout.
+    if(compact && !packVertices(geo, count, glm::vec3(grid_scale, 0.0f, grid_scale), packed, packing)) {
+        qDebug() << "terrain: " << map_file << "too large for compact vertices, keeping floats";
+        compact = false;
+    }
+
+    if(compact)
+        glBufferData(GL_ARRAY_BUFFER, sizeof(CompactVertex) * packed.size(), packed.constData(), GL_STATIC_DRAW);
+
+    else {
+        packing = VertexPacking();
+        glBufferData(GL_ARRAY_BUFFER, sizeof(*geo) * count, geo, GL_STATIC_DRAW);
+    }
+}
+
+const Vertex* Terrain::vertexData() const
+{
+    return mesh_cache ? mesh_cache->vertices() : geometry.constData();
+}
+
+int Terrain::vertexCount() const
+{
+    return mesh_cache ? mesh_cache->vertexCount() : geometry.size();
+}
+
+void Terrain::renderStreamed(const glm::mat4& mvp)
+{
+    // the model transform only ever translates terrains
+    glm::vec3 camera = engine->graphics->camera->getPosition() - glm::vec3(model[3]);
+
+    streamer->update(mvp, camera, engine->getOptions().height_scalar, engine->graphics->getPixelScale(),
+                     engine->getOptions().tile_detail);
+
+    glUseProgram(program);
+
+    glUniformMatrix4fv(loc_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+    glUniform1f(loc_heightScalar, engine->getOptions().height_scalar);
+    glUniform1i(loc_heightmap, GL_FALSE);
+    glUniform1i(loc_maskMode, 0);
+
+    for(int i = 0; i < textures.size(); i++) {
+        glUniform1i(loc_texture,i);
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D,textures[i]);
+    }
+
+    streamer->render(loc_position, loc_positionScale, loc_positionOffset);
+
+    glUseProgram(0);
+}
+
+void Terrain::initHeightmapGL()
+{
+    initPatch();
+
+    // the mask terrain is handed the textures of its DEM terrain
+    if(!height_texture) {
+        uploadGridTexture(height_texture, GL_R32F, GL_RED, GL_FLOAT, heights.constData());
+
+        if(!mask_cells.isEmpty())
+            uploadGridTexture(mask_texture, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, mask_cells.constData());
+    }
+
+    heights.clear();
+    heights.squeeze();
+    mask_cells.clear();
+    mask_cells.squeeze();
+
+    getLocations();
+}
+
+// Uploads one grid_width x grid_height texture, or refills it when it
+// already exists. Sampled with texelFetch, so no filtering.
+void Terrain::uploadGridTexture(GLuint& texture, GLenum internal_format, GLenum format, GLenum type, const void *data)
+{
+    bool exists = texture != 0;
+
+    if(!exists)
+        glGenTextures(1, &texture);
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if(exists) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, grid_width, grid_height, format, type, data);
+    }
+
+    else {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, grid_width, grid_height, 0, format, type, data);
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Builds the (PATCH_SIZE+1)^2 vertex patch every heightmap terrain draws
+// instanced. Vertices only hold their column and row within the patch; the
+// attribute is pointed at them when drawing since v_grid's location depends
+// on the program.
+void Terrain::initPatch()
+{
+    if(patch_vao)
+        return;
+
+    int side = PATCH_SIZE + 1;
+
+    QVector<GLfloat> grid;
+    grid.reserve(side * side * 2);
+
+    for(int z = 0; z < side; z++) {
+        for(int x = 0; x < side; x++) {
+            grid.push_back(x);
+            grid.push_back(z);
+        }
+    }
+
+    QVector<GLuint> patch_indices(PATCH_SIZE * PATCH_SIZE * 6);
+    emitGridIndices(patch_indices.data(), side, 0, PATCH_SIZE, [](int, int, bool) {return true;});
+    patch_index_count = patch_indices.size();
+
+    glGenVertexArrays(1, &patch_vao);
+    glGenBuffers(1, &patch_vbo);
+    glGenBuffers(1, &patch_ibo);
+
+    glBindVertexArray(patch_vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, patch_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * grid.size(), grid.constData(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, patch_ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * patch_indices.size(), patch_indices.constData(), GL_STATIC_DRAW);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void Terrain::renderHeightmap()
+{
+    glm::mat4 mvp = engine->graphics->projection * engine->graphics->view * model;
+
+    // patches cover the cells, so one less than the samples on each side
+    int patches_x = (grid_width - 1 + PATCH_SIZE - 1) / PATCH_SIZE;
+    int patches_z = (grid_height - 1 + PATCH_SIZE - 1) / PATCH_SIZE;
+
+    glUseProgram(program);
+    glBindVertexArray(patch_vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, patch_vbo);
+    glEnableVertexAttribArray(loc_grid);
+    glVertexAttribPointer(loc_grid, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+    glUniformMatrix4fv(loc_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+    glUniform1f(loc_heightScalar, engine->getOptions().height_scalar);
+    glUniform1i(loc_heightmap, GL_TRUE);
+    glUniform2i(loc_gridSize, grid_width, grid_height);
+    glUniform1f(loc_gridScale, grid_scale);
+    glUniform1i(loc_patchesX, patches_x);
+    glUniform1i(loc_patchSize, PATCH_SIZE);
+    glUniform1i(loc_maskMode, mask_mode);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_1D, textures.isEmpty() ? 0 : textures[0]);
+    glUniform1i(loc_texture, 0);
+
+    // the heightmap samplers are set to units 1 to 3 when the programs are
+    // created
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, height_texture);
+
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, mask_texture);
+
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, data_texture);
+
+    glDrawElementsInstanced(GL_TRIANGLES, patch_index_count, GL_UNSIGNED_INT, 0, patches_x * patches_z);
+
+    glDisableVertexAttribArray(loc_grid);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(0);
+    glUseProgram(0);
 }
 
 
 // static functions
-QVector<Terrain*> Terrain::createTerrainFromDEMandMask(Engine *engine, const QString& dem, const QString& mask, Terrain *large_dem)
+QVector<Terrain*> Terrain::loadTerrainFromDEMandMask(Engine *engine, const QString& dem, const QString& mask,
+                                                     GLuint dem_program, GLuint mask_program, Terrain *large_dem)
 {
-    QVector<Terrain*> terrain_vec(2);
+    Terrain *dem_t = new Terrain(engine, dem, dem_program);
+    Terrain *mask_t = new Terrain(engine, mask, mask_program);
+
+    GDALDataset *dataset = DatasetRegistry::open(dem);
+    GDALDataset *dataset_mask = DatasetRegistry::open(mask);
 
-    Terrain *dem_t = new Terrain(engine, dem, engine->graphics->getShaderProgram("gray"));
-    Terrain *mask_t = new Terrain(engine, mask, engine->graphics->getShaderProgram("color"));
+    // the terrains give back whichever handles were opened when deleted
+    dem_t->dataset = dataset;
+    mask_t->dataset = dataset_mask;
 
-    auto t = dem.toLatin1();
-    auto t2 = mask.toLatin1();
-    GDALDataset *dataset = (GDALDataset*) GDALOpen(t.constData(), GA_ReadOnly);
-    GDALDataset *dataset_mask = (GDALDataset*) GDALOpen(t2.constData(), GA_ReadOnly);
+    auto fail = [&] {
+        delete dem_t;
+        delete mask_t;
+        return QVector<Terrain*>();
+    };
 
     if(dataset == nullptr) {
         qDebug() << "Unable to get GDAL Dataset for file: " << dem;
-        exit(1);
+        return fail();
     }
 
     if(dataset_mask == nullptr) {
         qDebug() << "Unable to get GDAL Dataset for mask file: " << mask;
-        exit(1);
+        return fail();
     }
 
     GDALRasterBand *raster = dataset->GetRasterBand(1);
-    GDALRasterBand *raster_mask = dataset_mask->GetRasterBand(1);
 
     int width = raster->GetXSize();//terrain_img.getWidth();
     int height = raster->GetYSize();//terrain_img.getHeight();
-    int width_mask = raster_mask->GetXSize();
-    //int height_mask = raster_mask->GetYSize();
 
-    int gotMin, gotMax;
-    float large_min, large_max;
-    float large_max_offset;
+    // heights are normalized over the large DEM's range when there is one so
+    // both line up, else over this DEM's own range
+    SampleRange range;
+    bool known = true;
+
+    if(large_dem)
+        range = large_dem->height_range;
+    else
+        known = DatasetRegistry::knownRange(dem, range);
+
+    float scale = engine->getOptions().map_scalar * (2.5f / 10.0f);
+    float threshold = engine->getOptions().mask_threshold;
+    bool heightmap = engine->getOptions().heightmap;
+
+    dem_t->grid_scale = mask_t->grid_scale = scale;
+    dem_t->mask_mode = 1;
+    mask_t->mask_mode = 2;
+
+    QString params = QString("masked scale=%1 threshold=%2").arg(scale).arg(threshold);
+    if(large_dem)
+        params += QString(" range=%1,%2").arg(range.min).arg(range.max);
+
+    // heightmap mode builds no mesh, so there is nothing to cache
+    QSharedPointer<MeshCache> cache(new MeshCache(engine->getOptions(),
+                                                  heightmap ? QStringList() : QStringList() << dem << mask, params));
+
+    if(cache->load()) {
+        dem_t->grid_width = mask_t->grid_width = cache->gridWidth();
+        dem_t->grid_height = mask_t->grid_height = cache->gridHeight();
+        dem_t->height_range = mask_t->height_range = cache->range();
+
+        dem_t->mesh_cache = cache;
+        cache->copyIndices(0, mask_t->indices);
+        cache->copyIndices(1, dem_t->indices);
+
+        if(engine->getOptions().verbose)
+            qDebug() << "terrain: " << dem << "and mask" << mask << "loaded from mesh cache";
+
+        return finishMaskedTerrain(engine, dem_t, mask_t, dataset, dataset_mask);
+    }
 
-    if(large_dem) {
-        GDALRasterBand *large_raster = large_dem->dataset->GetRasterBand(1);
-        large_min = large_raster->GetMinimum(&gotMin);
-        large_max = large_raster->GetMaximum(&gotMax);
+    int woffset = width / 2;
+    int hoffset = height / 2;
 
-        if(!(gotMin && gotMax)) {
-            double minMax[2] = {large_min, large_max};
-            GDALComputeRasterMinMax((GDALRasterBandH) large_raster, TRUE, minMax);
+    QVector<Vertex> grid(heightmap ? 0 : width * height);
+    QVector<float> grid_heights(heightmap ? width * height : 0);
+    Vertex *verts = grid.data();
+    float *h = grid_heights.data();
+
+    SampleRange seen;
+    bool read = forEachRowParallel(dem, height, known ? &range : nullptr, seen,
+                                   [&](int z, const float *lineData) {
+        if(heightmap) {
+            std::copy(lineData, lineData + width, h + z * width);
+            return;
+        }
 
-            large_min = minMax[0];
-            large_max = minMax[1];
+        Vertex *row = verts + z * width;
+
+        for(int x = 0; x < width; x++) {
+            row[x].position[0] = (x - woffset) * scale;
+            row[x].position[1] = lineData[x];
+            row[x].position[2] = (z - hoffset) * scale;
         }
+    });
+
+    if(!read)
+        return fail();
+
+    if(!known) {
+        range = seen;
 
-        large_max_offset = large_max - large_min;
+        if(heightmap)
+            normalizeGrid(h, width * height, range);
+        else
+            normalizeVertices(verts, width * height, range, [](Vertex& v) -> float& {return v.position[1];});
     }
 
-    float min = raster->GetMinimum(&gotMin);
-    float max = raster->GetMaximum(&gotMax);
+    dem_t->grid_width = mask_t->grid_width = width;
+    dem_t->grid_height = mask_t->grid_height = height;
 
-    double minMax[2] = {min, max};
+    if(!mask_t->loadTriangleMask())
+        return fail();
 
-    if(!(gotMin && gotMax)) {
-        GDALComputeRasterMinMax((GDALRasterBandH) raster, TRUE, minMax);
+    dem_t->triangle_mask = mask_t->triangle_mask;
 
-        min = minMax[0];
-        max = minMax[1];
+    if(engine->getOptions().verbose)
+        qDebug() << "terrain: " << dem << "   min: " << range.min << " max: " << range.max;
+
+    dem_t->height_range = mask_t->height_range = range;
+
+    if(heightmap) {
+        // both terrains draw from the same textures, uploaded by dem_t
+        dem_t->heights = grid_heights;
+        dem_t->mask_cells.resize(width * height);
+
+        for(int i = 0; i < width * height; i++)
+            dem_t->mask_cells[i] = dem_t->triangle_mask->vertexInside(i);
+
+        return finishMaskedTerrain(engine, dem_t, mask_t, dataset, dataset_mask);
     }
 
-    float min_mask = raster_mask->GetMinimum(&gotMin);
-    float max_mask = raster_mask->GetMaximum(&gotMax);
+    dem_t->geometry = grid;
+
+    mask_t->rebuildMaskIndices();
+    dem_t->rebuildMaskIndices();
 
-    minMax[0] = min_mask;
-    minMax[1] = max_mask;
+    cache->save(width, height, range, grid, QVector<const QVector<GLuint>*>() << &mask_t->indices << &dem_t->indices);
 
-    if(!(gotMin && gotMax)) {
-        GDALComputeRasterMinMax((GDALRasterBandH) raster_mask, TRUE, minMax);
+    return finishMaskedTerrain(engine, dem_t, mask_t, dataset, dataset_mask);
+}
 
-        min_mask = minMax[0];
-        max_mask = minMax[1];
+// Reads the mask raster into per vertex samples normalized over its range and
+// classifies them at the configured threshold. Vertices past the mask's edge
+// are -inf so no threshold takes them in.
+bool Terrain::loadTriangleMask()
+{
+    int width = grid_width, height = grid_height;
+
+    int mask_width = 0;
+    {
+        DatasetHandle ds(map_file);
+        if(ds)
+            mask_width = ds->GetRasterXSize();
     }
 
-    if(engine->getOptions().verbose) {
-        qDebug() << "terrain: " << dem << "   min: " << min << " max: " << max;
-        qDebug() << "terrain mask: " << mask << "   min: " << min_mask << " max: " << max_mask;
+    SampleRange range;
+    bool known = DatasetRegistry::knownRange(map_file, range);
+
+    QVector<float> values(width * height);
+    float *v = values.data();
+
+    SampleRange seen;
+    // cells past the right or bottom edge of a smaller mask are outside
+    bool read = forEachRowParallel(map_file, height, known ? &range : nullptr, seen,
+                                   [&](int z, const float *lineData_mask) {
+        float *value_row = v + z * width;
+
+        for(int x = 0; x < width; x++)
+            value_row[x] = (lineData_mask && x < mask_width) ? lineData_mask[x] : -INFINITY;
+    });
+
+    if(!read)
+        return false;
+
+    if(!known) {
+        range = seen;
+        normalizeGrid(v, width * height, range);
     }
 
-    int woffset = width / 2;
-    int hoffset = height / 2;
+    if(engine->getOptions().verbose)
+        qDebug() << "terrain mask: " << map_file << "   min: " << range.min << " max: " << range.max;
 
-    Vertex tempVert;
+    triangle_mask = QSharedPointer<TriangleMask>(new TriangleMask(width, height, values));
+    triangle_mask->setThreshold(engine->getOptions().mask_threshold);
 
-    float maxOffset = max - min;
-    float maxOffset_mask = max_mask - min_mask;
+    return true;
+}
 
-    float scale = engine->getOptions().map_scalar * (2.5f / 10.0f);
-    float *lineData = (float*) CPLMalloc(sizeof(float) * width);
-    float *lineData2 = (float*) CPLMalloc(sizeof(float) * width);
-    float *lineData_mask = (float*) CPLMalloc(sizeof(float) * width_mask);
-    float *lineData2_mask = (float*) CPLMalloc(sizeof(float) * width_mask);
+// The DEM terrain (mask_mode 1) keeps the triangles outside the mask, the
+// mask terrain (mask_mode 2) those inside.
+void Terrain::rebuildMaskIndices()
+{
+    bool inside = (mask_mode == 2);
+
+    if(!mask_enabled) {
+        if(inside)
+            indices.clear();
+        else
+            buildGridIndices(indices, grid_width, grid_height, [](int, int, bool) {return true;});
 
-    if(!large_dem) {
-        large_max_offset = maxOffset;
-        large_min = min;
+        return;
     }
 
-    for(int z = -hoffset; z < height - hoffset-1; z++) {
-        raster->RasterIO(GF_Read, 0, z + hoffset, width, 1, lineData, width, 1, GDT_Float32, 0, 0);
-        raster->RasterIO(GF_Read, 0, z + hoffset + 1, width, 1, lineData2, width, 1, GDT_Float32, 0, 0);
-        raster_mask->RasterIO(GF_Read, 0, z + hoffset, width_mask, 1, lineData_mask, width_mask, 1, GDT_Float32, 0, 0);
-        raster_mask->RasterIO(GF_Read, 0, z + hoffset + 1, width_mask, 1, lineData2_mask, width_mask, 1, GDT_Float32, 0, 0);
+    const TriangleMask *mask = triangle_mask.data();
 
-        for(int x = -woffset; x < width - woffset-1; x++) {
+    buildGridIndices(indices, grid_width, grid_height,
+                     [=](int x, int z, bool upper) {return mask->contains(x, z, upper) == inside;});
+}
 
-            if((((lineData_mask[x+woffset]-min_mask) / maxOffset_mask) >= 0.1f) && (((lineData_mask[x+woffset+1]-min_mask) / maxOffset_mask) >= 0.1f)
-                    && (((lineData2_mask[x+woffset]-min_mask) / maxOffset_mask) >= 0.1f)) {
+void Terrain::setMaskThreshold(float threshold)
+{
+    if(!mask_mode)
+        return;
 
-                tempVert.position[0] = x*scale;
-                tempVert.position[1] = (lineData[x+woffset]-large_min) / large_max_offset;
-                tempVert.position[2] = z*scale;
-                mask_t->geometry.push_back(tempVert);
+    Terrain *mask_side = (mask_mode == 2) ? this : mask_partner;
+    Terrain *dem_side = (mask_mode == 1) ? this : mask_partner;
 
-                tempVert.position[0] = (x+1) * scale;
-                tempVert.position[1] = (lineData[x+woffset+1]-large_min) / large_max_offset;
-                tempVert.position[2] = z*scale;
-                mask_t->geometry.push_back(tempVert);
+    // meshes loaded from the cache come without the mask samples
+    if(!mask_side->triangle_mask) {
+        if(!mask_side->loadTriangleMask()) {
+            qDebug() << "Unable to read terrain mask: " << mask_side->map_file;
+            return;
+        }
 
-                tempVert.position[0] = x*scale;
-                tempVert.position[1] = (lineData2[x+woffset]-large_min) / large_max_offset;
-                tempVert.position[2] = (z+1) * scale;
-                mask_t->geometry.push_back(tempVert);
-            }
+        dem_side->triangle_mask = mask_side->triangle_mask;
+    }
 
-            else {
-                tempVert.position[0] = x*scale;
-                tempVert.position[1] = (lineData[x+woffset]-large_min) / large_max_offset;
-                tempVert.position[2] = z*scale;
-                dem_t->geometry.push_back(tempVert);
-
-                tempVert.position[0] = (x+1) * scale;
-                tempVert.position[1] = (lineData[x+woffset+1]-large_min) / large_max_offset;
-                tempVert.position[2] = z*scale;
-                dem_t->geometry.push_back(tempVert);
-
-                tempVert.position[0] = x*scale;
-                tempVert.position[1] = (lineData2[x+woffset]-large_min) / large_max_offset;
-                tempVert.position[2] = (z+1) * scale;
-                dem_t->geometry.push_back(tempVert);
-            }
+    triangle_mask->setThreshold(threshold);
+    applyMask();
+}
 
-            if((((lineData2_mask[x+woffset]-min_mask) / maxOffset_mask) >= 0.1f) && (((lineData2_mask[x+woffset+1]-min_mask) / maxOffset_mask) >= 0.1f)
-                    && (((lineData_mask[x+woffset+1]-min_mask) / maxOffset_mask) >= 0.1f)) {
+void Terrain::setMaskEnabled(bool enabled)
+{
+    if(!mask_mode)
+        return;
+
+    if(!triangle_mask && !heightmap) {
+        // both lists are trivial with the mask off, and turning it back on
+        // needs the samples
+        Terrain *mask_side = (mask_mode == 2) ? this : mask_partner;
+        if(!mask_side->loadTriangleMask()) {
+            qDebug() << "Unable to read terrain mask: " << mask_side->map_file;
+            return;
+        }
 
-                tempVert.position[0] = x*scale;
-                tempVert.position[1] = (lineData2[x+woffset]-large_min) / large_max_offset;
-                tempVert.position[2] = (z+1) * scale;
-                mask_t->geometry.push_back(tempVert);
+        mask_partner->triangle_mask = triangle_mask = mask_side->triangle_mask;
+    }
 
-                tempVert.position[0] = (x+1) * scale;
-                tempVert.position[1] = (lineData2[x+woffset+1]-large_min) / large_max_offset;
-                tempVert.position[2] = (z+1) * scale;
-                mask_t->geometry.push_back(tempVert);
+    mask_enabled = mask_partner->mask_enabled = enabled;
 
-                tempVert.position[0] = (x+1) * scale;
-                tempVert.position[1] = (lineData[x+woffset+1]-large_min) / large_max_offset;
-                tempVert.position[2] = z*scale;
-                mask_t->geometry.push_back(tempVert);
-            }
+    applyMask();
+}
 
-            else {
-                tempVert.position[0] = x*scale;
-                tempVert.position[1] = (lineData2[x+woffset]-large_min) / large_max_offset;
-                tempVert.position[2] = (z+1) * scale;
-                dem_t->geometry.push_back(tempVert);
-
-                tempVert.position[0] = (x+1) * scale;
-                tempVert.position[1] = (lineData2[x+woffset+1]-large_min) / large_max_offset;
-                tempVert.position[2] = (z+1) * scale;
-                dem_t->geometry.push_back(tempVert);
-
-                tempVert.position[0] = (x+1) * scale;
-                tempVert.position[1] = (lineData[x+woffset+1]-large_min) / large_max_offset;
-                tempVert.position[2] = z*scale;
-                dem_t->geometry.push_back(tempVert);
-            }
+float Terrain::getMaskThreshold() const
+{
+    return triangle_mask ? triangle_mask->threshold() : engine->getOptions().mask_threshold;
+}
+
+// Pushes the current mask state to the GPU for both terrains of the pair:
+// new index lists, or in heightmap mode a new mask texture.
+void Terrain::applyMask()
+{
+    if(heightmap) {
+        Terrain *dem_side = (mask_mode == 1) ? this : mask_partner;
+        int count = grid_width * grid_height;
+
+        dem_side->mask_cells.resize(count);
+        for(int i = 0; i < count; i++)
+            dem_side->mask_cells[i] = mask_enabled && triangle_mask->vertexInside(i);
+
+        dem_side->uploadGridTexture(dem_side->mask_texture, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE,
+                                    dem_side->mask_cells.constData());
+        dem_side->mask_cells.clear();
+        return;
+    }
+
+    Terrain *sides[2] = {this, mask_partner};
+
+    for(Terrain *t : sides) {
+        t->rebuildMaskIndices();
+
+        glBindVertexArray(t->vao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * t->indices.size(), t->indices.constData(), GL_STATIC_DRAW);
+
+        if(t->mask_mode == 2)
+            t->updateDataGather();
+    }
+
+    glBindVertexArray(0);
+}
+
+// Records the vertices the index list draws, the only ones a data layer
+// needs values for, as runs of consecutive vertices within a row. The
+// pixels they read are worked out by dataGather once the data raster's size
+// is known.
+void Terrain::updateDataGather()
+{
+    int count = grid_width * grid_height;
+    QVector<char> used(count, 0);
+    char *u = used.data();
+
+    for(GLuint i : indices)
+        u[i] = 1;
 
+    QSharedPointer<DataGather> gather(new DataGather);
+    gather->raster_width = gather->raster_height = -1;
+
+    for(int z = 0; z < grid_height; z++) {
+        const char *row = u + z * grid_width;
+
+        for(int x = 0; x < grid_width; x++) {
+            if(!row[x])
+                continue;
+
+            int end = x + 1;
+            while(end < grid_width && row[end])
+                end++;
+
+            GatherRun run = {GLuint(z * grid_width + x), 0, end - x};
+            gather->drawn.push_back(run);
+
+            x = end;
         }
     }
 
-    CPLFree(lineData);
-    CPLFree(lineData2);
-    CPLFree(lineData_mask);
-    CPLFree(lineData2_mask);
-    //GDALClose((GDALDatasetH) dataset);
-    //GDALClose((GDALDatasetH) dataset_mask);
+    std::lock_guard<std::mutex> lock(gather_mutex);
+    data_gather = gather;
+}
+
+QSharedPointer<const Terrain::DataGather> Terrain::dataGather(int raster_width, int raster_height) const
+{
+    std::lock_guard<std::mutex> lock(gather_mutex);
+
+    if(!data_gather || (data_gather->raster_width == raster_width && data_gather->raster_height == raster_height))
+        return data_gather;
+
+    // first step of a series, or a raster of another size: clip the drawn
+    // runs to the raster, always from the whole grid's so a larger raster
+    // gets back what a smaller one cut off
+    QSharedPointer<DataGather> gather(new DataGather);
+    gather->raster_width = raster_width;
+    gather->raster_height = raster_height;
+    gather->drawn = data_gather->drawn;
+
+    for(const GatherRun& run : gather->drawn) {
+        int x = run.vertex % grid_width, z = run.vertex / grid_width;
+
+        if(x >= raster_width || z >= raster_height)
+            continue;
+
+        GatherRun clipped = {run.vertex, quint32(z * raster_width + x), std::min(run.length, raster_width - x)};
+        gather->runs.push_back(clipped);
+    }
+
+    data_gather = gather;
+
+    return data_gather;
+}
+
+QVector<Terrain*> Terrain::finishMaskedTerrain(Engine *engine, Terrain *dem_t, Terrain *mask_t,
+                                               GDALDataset *dataset, GDALDataset *dataset_mask)
+{
+    Q_UNUSED(engine);
+
+    QVector<Terrain*> terrain_vec(2);
 
     dem_t->dataset = dataset;
     mask_t->dataset = dataset_mask;
 
-    dem_t->initGL();
-    mask_t->initGL();
-    mask_t->textures.push_back(engine->graphics->createTextureFromFile(QString::fromStdString(engine->getOptions().color_map),
-        GL_TEXTURE_1D));
+    dem_t->geot.resize(6);
+    mask_t->geot.resize(6);
+    dataset->GetGeoTransform(dem_t->geot.data());
+    dataset_mask->GetGeoTransform(mask_t->geot.data());
+    dem_t->projection = dataset->GetProjectionRef();
+    mask_t->projection = dataset_mask->GetProjectionRef();
+
+    mask_t->vertex_owner = dem_t;
+    dem_t->mask_partner = mask_t;
+    mask_t->mask_partner = dem_t;
 
     terrain_vec[0] = dem_t;
     terrain_vec[1] = mask_t;
@@ -418,149 +1181,520 @@ QVector<Terrain*> Terrain::createTerrainFromDEMandMask(Engine *engine, const QSt
     return terrain_vec;
 }
 
+void Terrain::uploadMaskedTerrain(Engine *engine, const QVector<Terrain*>& terrains)
+{
+    Terrain *dem_t = terrains[0], *mask_t = terrains[1];
+
+    dem_t->initGL();
+
+    mask_t->height_texture = dem_t->height_texture;
+    mask_t->mask_texture = dem_t->mask_texture;
+    mask_t->initGL();
+    mask_t->textures.push_back(engine->graphics->createTextureFromFile(QString::fromStdString(engine->getOptions().color_map),
+        GL_TEXTURE_1D));
+}
+
 void Terrain::applyDataset(const QString& file)
 {
-    auto t = file.toLatin1();
-    GDALDataset *dataset_data = (GDALDataset*) GDALOpen(t.constData(), GA_ReadOnly);
-    GDALDataset *dataset_mask = dataset;//(GDALDataset*) GDALOpen(map_file.toLatin1()constData(), GA_ReadOnly);
+    if(streamer) {
+        qDebug() << "Data layers are not supported on streamed terrain: " << file;
+        return;
+    }
 
-    if(dataset == nullptr) {
-        qDebug() << "Unable to get GDAL Dataset for data file: " << file;
+    DataValues data;
+
+    if(!decodeDataset(file, data)) {
+        qDebug() << "Unable to read data file: " << file;
         exit(1);
     }
 
-    if(dataset_mask == nullptr) {
-        qDebug() << "Unable to get GDAL Dataset for mask file: " << map_file;
-        exit(1);
+    uploadDataset(data);
+}
+
+bool Terrain::decodeDataset(const QString& file, DataValues& data) const
+{
+    if(!readDataset(file, data.values, false))
+        return false;
+
+    packDataValues(data);
+
+    return true;
+}
+
+bool Terrain::decodeStep(const TimeSeries& series, int step, DataValues& data) const
+{
+    if(!readStep(series, step, data.values, false))
+        return false;
+
+    packDataValues(data);
+
+    return true;
+}
+
+// A compact terrain's data buffer holds 16 bit unorm values, packed here so
+// the GL thread only copies them.
+void Terrain::packDataValues(DataValues& data) const
+{
+    if(!compact || heightmap) {
+        data.packed.clear();
+        return;
+    }
+
+    data.packed.resize(data.values.size());
+    const float *in = data.values.constData();
+    GLushort *out = data.packed.data();
+
+    parallelBands(data.values.size(), workerCount(), [&](int, int begin, int end) {
+        for(int i = begin; i < end; i++)
+            out[i] = toUnorm16(in[i]);
+    });
+}
+
+bool Terrain::readDataset(const QString& file, QVector<float>& values, bool whole_grid) const
+{
+    DatasetHandle dataset_data(file);
+
+    if(!dataset_data) {
+        values.clear();
+        return false;
     }
 
     GDALRasterBand *raster = dataset_data->GetRasterBand(1);
-    GDALRasterBand *raster_mask = dataset_mask->GetRasterBand(1);
 
-    int width = raster->GetXSize();//terrain_img.getWidth();
-    int height = raster->GetYSize();//terrain_img.getHeight();
-    int width_mask = raster_mask->GetXSize();
-    //int height_mask = raster_mask->GetYSize();
+    int raster_width = raster->GetXSize();
+    int height = std::min(raster->GetYSize(), grid_height);
+
+    // read raw into one contiguous buffer, normalized below
+    QVector<float> band(raster_width * height);
+    float *b = band.data();
 
-    int gotMin, gotMax;
+    RasterReader reader(raster);
 
-    float min = raster->GetMinimum(&gotMin);
-    float max = raster->GetMaximum(&gotMax);
+    for(int z = 0; z < height; z++) {
+        const float *lineData = reader.row(z);
+        std::copy(lineData, lineData + raster_width, b + z * raster_width);
+    }
+
+    if(reader.failed()) {
+        values.clear();
+        return false;
+    }
 
-    double minMax[2] = {min, max};
+    SampleRange range = data_range;
 
-    if(!(gotMin && gotMax)) {
-        GDALComputeRasterMinMax((GDALRasterBandH) raster, TRUE, minMax);
+    if(!range.valid() && !DatasetRegistry::knownRange(file, range)) {
+        range = reader.range();
 
-        min = minMax[0];
-        max = minMax[1];
+        if(height == raster->GetYSize())
+            DatasetRegistry::storeRange(file, range);
     }
 
-    float min_mask = raster_mask->GetMinimum(&gotMin);
-    float max_mask = raster_mask->GetMaximum(&gotMax);
+    fillDataValues(b, raster_width, height, range, values, whole_grid);
+
+    if(engine->getOptions().verbose)
+        qDebug() << "terrain data: " << file << "   min: " << range.min << " max: " << range.max;
+
+    return true;
+}
 
-    minMax[0] = min_mask;
-    minMax[1] = max_mask;
+bool Terrain::readStep(const TimeSeries& series, int step, QVector<float>& values, bool whole_grid) const
+{
+    const SeriesContainer *container = series.getContainer();
 
-    if(!(gotMin && gotMax)) {
-        GDALComputeRasterMinMax((GDALRasterBandH) raster_mask, TRUE, minMax);
+    if(!container)
+        return readDataset(series.file(step), values, whole_grid);
 
-        min_mask = minMax[0];
-        max_mask = minMax[1];
+    QVector<float> band(container->width() * container->height());
+
+    if(!container->readStep(step, band.data())) {
+        values.clear();
+        return false;
     }
 
-    if(engine->getOptions().verbose) {
-        qDebug() << "terrain mask: " << map_file << "   min: " << min << " max: " << max;
-        qDebug() << "terrain data: " << file << "   min: " << min_mask << " max: " << max_mask;
+    // the container's range is already the whole series'
+    SampleRange range = data_range.valid() ? data_range : container->range();
+    fillDataValues(band.constData(), container->width(), container->height(), range, values, whole_grid);
+
+    return true;
+}
+
+void Terrain::applyLayer(const QVector<float>& layer, int band_width, int band_height)
+{
+    SampleRange range;
+
+    for(float v : layer) {
+        if(v == v) {
+            range.min = std::min(range.min, v);
+            range.max = std::max(range.max, v);
+        }
     }
 
-    int woffset = width / 2;
-    int hoffset = height / 2;
+    DataValues data;
+    fillDataValues(layer.constData(), band_width, band_height, range, data.values, false);
+    packDataValues(data);
+    uploadDataset(data);
 
-    float maxOffset = max - min;
-    float maxOffset_mask = max_mask - min_mask;
+    if(engine->getOptions().verbose)
+        qDebug() << "terrain layer:   min: " << range.min << " max: " << range.max;
+}
 
-    float *lineData = (float*) CPLMalloc(sizeof(float) * width);
-    float *lineData2 = (float*) CPLMalloc(sizeof(float) * width);
-    float *lineData_mask = (float*) CPLMalloc(sizeof(float) * width_mask);
-    float *lineData2_mask = (float*) CPLMalloc(sizeof(float) * width_mask);
+// Turns a raw band_width x band_height band into values, normalized over
+// range with nodata as 0.
+void Terrain::fillDataValues(const float *band, int band_width, int band_height, const SampleRange& range,
+                             QVector<float>& values, bool whole_grid) const
+{
+    int count = heightmap ? grid_width * grid_height : vertexSource()->vertexCount();
 
-    int i = 0;
-    for(int z = -hoffset; z < height - hoffset-1; z++) {
-        raster->RasterIO(GF_Read, 0, z + hoffset, width, 1, lineData, width, 1, GDT_Float32, 0, 0);
-        raster->RasterIO(GF_Read, 0, z + hoffset + 1, width, 1, lineData2, width, 1, GDT_Float32, 0, 0);
-        raster_mask->RasterIO(GF_Read, 0, z + hoffset, width_mask, 1, lineData_mask, width_mask, 1, GDT_Float32, 0, 0);
-        raster_mask->RasterIO(GF_Read, 0, z + hoffset + 1, width_mask, 1, lineData2_mask, width_mask, 1, GDT_Float32, 0, 0);
+    QSharedPointer<const DataGather> gather = (heightmap || whole_grid) ? QSharedPointer<const DataGather>()
+                                                                        : dataGather(band_width, band_height);
 
-        for(int x = -woffset; x < width - woffset-1; x++) {
+    // vertices the gather skips are never drawn, so what they hold does not
+    // matter
+    if(gather)
+        values.resize(count);
+    else
+        values.fill(0.0f, count);
 
-            if((((lineData_mask[x+woffset]-min_mask) / maxOffset_mask) >= 0.1f) && (((lineData_mask[x+woffset+1]-min_mask) / maxOffset_mask) >= 0.1f)
-                    && (((lineData2_mask[x+woffset]-min_mask) / maxOffset_mask) >= 0.1f)) {
+    float *v = values.data();
 
+    if(gather) {
+        // mask terrain: normalize just the pixels under drawn vertices
+        // straight into place. Runs are contiguous in both the raster and
+        // the vertices, so each goes through the vector decode kernel.
+        SampleFormat format = {GDT_Float32, false, 0.0};
+        SampleRange ignored;
+        float scale = (range.max > range.min) ? 1.0f / (range.max - range.min) : 0.0f;
 
-                geometry[i].dataPoint = (lineData[x+woffset]-min) / maxOffset;
-                i++;
-                geometry[i].dataPoint = (lineData[x+woffset+1]-min) / maxOffset;
-                i++;
-                geometry[i].dataPoint = (lineData2[x+woffset]-min) / maxOffset;
-                i++;
-            }
+        for(const GatherRun& run : gather->runs)
+            decodeSamples(band + run.pixel, format, run.length, range.min, scale, 0.0f, v + run.vertex, ignored);
+
+        return;
+    }
+
+    // vertices are one per sample, so the data pixel under a vertex is the
+    // one at the same row and column. Values past the grid (LOD skirts) and
+    // off the data raster stay 0.
+    int width = std::min(band_width, grid_width);
+    int height = std::min(band_height, grid_height);
+
+    for(int z = 0; z < height; z++) {
+        float *row = v + z * grid_width;
+        std::copy(band + z * band_width, band + z * band_width + width, row);
+        normalizeSamples(row, width, range.min, range.max);
+    }
+}
+
+void Terrain::uploadDataset(DataValues& data)
+{
+    std::swap(data_values, data);
 
+    if(heightmap)
+        uploadGridTexture(data_texture, GL_R32F, GL_RED, GL_FLOAT, data_values.values.constData());
+    else
+        uploadData();
 
-            if((((lineData2_mask[x+woffset]-min_mask) / maxOffset_mask) >= 0.1f) && (((lineData2_mask[x+woffset+1]-min_mask) / maxOffset_mask) >= 0.1f)
-                    && (((lineData_mask[x+woffset+1]-min_mask) / maxOffset_mask) >= 0.1f)) {
+    GLuint data_program = engine->graphics->getShaderProgram("data");
 
-                geometry[i].dataPoint = (lineData2[x+woffset]-min) / maxOffset;
-                i++;
-                geometry[i].dataPoint = (lineData2[x+woffset+1]-min) / maxOffset;
-                i++;
-                geometry[i].dataPoint = (lineData[x+woffset+1]-min) / maxOffset;
-                i++;
+    if(program != data_program) {
+        program = data_program;
+        getLocations();
+    }
+}
+
+bool Terrain::decodeSeries(const TimeSeries& series, size_t budget_bytes, int max_layers, SeriesLayers& out,
+                           const std::atomic<bool> *cancel) const
+{
+    // the series shader finds a vertex's texel from its index, which LOD
+    // skirt vertices past the grid do not have
+    if(heightmap || streamer || lod || vertexSource()->lod || series.isEmpty())
+        return false;
+
+    int count = grid_width * grid_height;
+    size_t layer_bytes = sizeof(GLushort) * count;
+    int steps = series.size();
+    int layers = (int) std::min<size_t>(std::min(steps, max_layers), budget_bytes / layer_bytes);
+
+    if(layers < std::min(steps, 2)) {
+        qDebug() << "Time series does not fit in" << budget_bytes / (1024 * 1024) << "MB: " << series.stepName(0);
+        return false;
+    }
+
+    // past the budget keep evenly spaced steps; the shader maps time onto
+    // layers linearly, which rounding the steps puts off by under half a step
+    QVector<int> layer_step(layers, 0);
+    for(int l = 1; l < layers; l++)
+        layer_step[l] = (int) std::lround((double) l * (steps - 1) / (layers - 1));
+
+    out.steps = steps;
+    out.layers = layers;
+    out.texels.resize(count * layers);
+
+    // decoded a batch of steps at a time, one per thread, so only a batch
+    // is held as floats next to the packed layers
+    int batch = std::min(workerCount(), layers);
+    QVector<QVector<float>> decoded(batch);
+
+    for(int first = 0; first < layers; first += batch) {
+        if(cancel && *cancel)
+            return false;
+
+        int n = std::min(batch, layers - first);
+
+        parallelBands(n, n, [&](int b, int, int) {
+            int step = layer_step[first + b];
+
+            if(!readStep(series, step, decoded[b], true)) {
+                qDebug() << "Unable to read time step: " << series.stepName(step);
+                decoded[b].fill(0.0f, count);
             }
 
-        }
+            const float *in = decoded[b].constData();
+            GLushort *packed = out.texels.data() + (size_t) (first + b) * count;
+
+            for(int i = 0; i < count; i++)
+                packed[i] = toUnorm16(in[i]);
+        });
     }
 
-    CPLFree(lineData);
-    CPLFree(lineData2);
-    CPLFree(lineData_mask);
-    CPLFree(lineData2_mask);
-    //GDALClose((GDALDatasetH) dataset);
-    //GDALClose((GDALDatasetH) dataset_mask);
-    program = engine->graphics->getShaderProgram("data");
-    initGL(false);
+    return true;
+}
+
+void Terrain::uploadSeries(const SeriesLayers& layers)
+{
+    series_layer_scale = (layers.steps > 1) ? float(layers.layers - 1) / (layers.steps - 1) : 0.0f;
+
+    if(series_texture)
+        glDeleteTextures(1, &series_texture);
+
+    glGenTextures(1, &series_texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, series_texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16, grid_width, grid_height, layers.layers, 0, GL_RED,
+                 GL_UNSIGNED_SHORT, layers.texels.constData());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    if(engine->getOptions().verbose)
+        qDebug() << "time series: " << layers.layers << "of" << layers.steps << "steps resident,"
+                 << sizeof(GLushort) * layers.texels.size() / (1024 * 1024) << "MB";
+
+    program = engine->graphics->getShaderProgram("series");
+    getLocations();
+}
+
+// Fills the data buffer the last frame did not draw from with data_values
+// and makes it the one drawn from now on, so the upload never waits on the
+// GPU still reading the previous step.
+void Terrain::uploadData()
+{
+    if(!data_vbo[0])
+        glGenBuffers(2, data_vbo);
+
+    int back = 1 - data_front;
+    const void *src = data_values.values.constData();
+    GLsizeiptr bytes = sizeof(GLfloat) * data_values.values.size();
+
+    // packed when decoded
+    if(compact) {
+        src = data_values.packed.constData();
+        bytes = sizeof(GLushort) * data_values.packed.size();
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, data_vbo[back]);
+
+    if(bytes == data_bytes[back])
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, src);
+    else
+        glBufferData(GL_ARRAY_BUFFER, bytes, src, GL_STREAM_DRAW);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    data_bytes[back] = bytes;
+    data_front = back;
+}
+
+QSharedPointer<const ElevationGrid> Terrain::getElevation() const
+{
+    std::lock_guard<std::mutex> lock(elevation_mutex);
+
+    if(elevation || streamer)
+        return elevation;
+
+    // the grid part of the geometry, without LOD skirts
+    const Terrain *source = vertexSource();
+    int count = grid_width * grid_height;
+
+    if(count == 0 || source->vertexCount() < count)
+        return elevation;
+
+    QVector<float> heights(count);
+    float *h = heights.data();
+    const Vertex *v = source->vertexData();
+
+    for(int i = 0; i < count; i++)
+        h[i] = v[i].position[1];
+
+    elevation = QSharedPointer<const ElevationGrid>(new ElevationGrid(grid_width, grid_height, heights));
+
+    return elevation;
+}
+
+glm::vec3 Terrain::getOrigin() const
+{
+    return glm::vec3((0 - grid_width / 2) * grid_scale, 0.0f, (0 - grid_height / 2) * grid_scale);
 }
 
 std::pair<double,double> Terrain::getGeoTransformFromDEMs(Terrain *large, Terrain *small)
 {
-    QString proj = large->dataset->GetProjectionRef();
+    QString proj = large->projection;
 
     OGRSpatialReference sr1;
     auto t = proj.toLatin1();
     char *test = t.data();
     sr1.importFromWkt(&test);
 
-    proj = small->dataset->GetProjectionRef();
+    proj = small->projection;
 
     t = proj.toLatin1();
     OGRSpatialReference sr2;
     test = t.data();
     sr2.importFromWkt(&test);
 
+    // the projections and geotransforms were read when the terrains were
+    // loaded, the shared handles are not touched off the loading thread
     OGRCoordinateTransformation* poTransform = OGRCreateCoordinateTransformation( &sr2, &sr1 );
-    large->geot.resize(6);
-    small->geot.resize(6);
-    large->dataset->GetGeoTransform(large->geot.data());
-    small->dataset->GetGeoTransform(small->geot.data());
-    //
+
     double x = small->geot[0];
     double y = small->geot[3];
+
+    // without a transform the projections are taken to be the same
+    if(!poTransform) {
+        qDebug() << "Unable to transform between the projections of" << small->map_file << "and" << large->map_file;
+        return std::pair<double,double>(x,y);
+    }
+
     // DCEWsqrext.tif upperleft hand corner is convert to tl2p5_dem.tif coordinate system.
-    poTransform->Transform (1, &x, &y);
+    // Only the offset is needed, the small DEM keeps its own cell size.
+    if(!poTransform->Transform (1, &x, &y)) {
+        qDebug() << "Unable to transform the corner of" << small->map_file << "into" << large->map_file;
+        x = small->geot[0];
+        y = small->geot[3];
+    }
+
+    OGRCoordinateTransformation::DestroyCT(poTransform);
 
     return std::pair<double,double>(x,y);
 }
 
+// Marches the ray over the grid half a cell at a time, comparing it with the
+// bilinear surface between the vertices, and bisects the step where it
+// first goes below the surface.
+bool Terrain::pick(const glm::vec3& origin, const glm::vec3& direction, int& cell_x, int& cell_z,
+                   glm::vec3 *hit) const
+{
+    const Terrain *source = vertexSource();
+
+    if(heightmap || streamer || grid_width < 2 || grid_height < 2 || source->vertexCount() < grid_width * grid_height)
+        return false;
+
+    float height_scalar = engine->getOptions().height_scalar;
+    const Vertex *v = source->vertexData();
+
+    // in grid units from here on: x and z are column and row, y is world
+    glm::vec3 start = origin - glm::vec3(model[3]);
+    glm::vec3 o(start.x / grid_scale + grid_width / 2, start.y, start.z / grid_scale + grid_height / 2);
+    glm::vec3 d(direction.x / grid_scale, direction.y, direction.z / grid_scale);
+
+    auto surface = [&](float gx, float gz) {
+        int x0 = std::min(std::max(int(gx), 0), grid_width - 2);
+        int z0 = std::min(std::max(int(gz), 0), grid_height - 2);
+        float fx = gx - x0, fz = gz - z0;
+
+        const Vertex *r0 = v + z0 * grid_width + x0;
+        const Vertex *r1 = r0 + grid_width;
+
+        float h0 = r0[0].position[1] + (r0[1].position[1] - r0[0].position[1]) * fx;
+        float h1 = r1[0].position[1] + (r1[1].position[1] - r1[0].position[1]) * fx;
+
+        return (h0 + (h1 - h0) * fz) * height_scalar;
+    };
+
+    // clip the ray to the grid's footprint
+    float t_near = 0.0f, t_far = INFINITY;
+    float lo[2] = {0.0f, 0.0f}, hi[2] = {float(grid_width - 1), float(grid_height - 1)};
+    float p[2] = {o.x, o.z}, dir[2] = {d.x, d.z};
+
+    for(int axis = 0; axis < 2; axis++) {
+        if(std::fabs(dir[axis]) < 1e-12f) {
+            if(p[axis] < lo[axis] || p[axis] > hi[axis])
+                return false;
+            continue;
+        }
+
+        float t0 = (lo[axis] - p[axis]) / dir[axis];
+        float t1 = (hi[axis] - p[axis]) / dir[axis];
+
+        if(t0 > t1)
+            std::swap(t0, t1);
+
+        t_near = std::max(t_near, t0);
+        t_far = std::min(t_far, t1);
+    }
+
+    // looking straight down there is nothing to clip against but the far
+    // plane
+    if(t_far == INFINITY)
+        t_far = t_near + 5000.0f;
+
+    if(t_near > t_far)
+        return false;
+
+    float across = std::sqrt(d.x * d.x + d.z * d.z);
+    float step = across > 1e-6f ? 0.5f / across : t_far - t_near;
+
+    auto above = [&](float t) {
+        glm::vec3 at = o + d * t;
+        return at.y - surface(at.x, at.z);
+    };
+
+    float t_prev = t_near;
+    float f_prev = above(t_near);
+
+    if(f_prev <= 0.0f)
+        return false;               // starts under the terrain
+
+    while(t_prev < t_far) {
+        float t = std::min(t_prev + step, t_far);
+
+        if(above(t) <= 0.0f) {
+            float a = t_prev, b = t;
+
+            for(int i = 0; i < 20; i++) {
+                float mid = 0.5f * (a + b);
+                (above(mid) > 0.0f ? a : b) = mid;
+            }
+
+            glm::vec3 at = o + d * b;
+            cell_x = std::min(std::max(int(at.x + 0.5f), 0), grid_width - 1);
+            cell_z = std::min(std::max(int(at.z + 0.5f), 0), grid_height - 1);
+
+            // t is the same along the world and grid rays
+            if(hit)
+                *hit = origin + direction * b;
+
+            return true;
+        }
+
+        t_prev = t;
+    }
+
+    return false;
+}
+
 void Terrain::translate(const glm::vec3& vec)
 {
     model = glm::translate(model, vec);
@@ -1,31 +1,107 @@
 #ifndef TERRAIN_H
 #define TERRAIN_H
 
+#include <QSharedPointer>
 #include <QVector>
 #include <QString>
+#include <QStringList>
+#include <atomic>
+#include <mutex>
 #include <utility>
 
 #include "gl.h"
 #include "vertex.h"
+#include "samplekernel.h"
+#include "vertexpack.h"
 
 #include <glm/glm.hpp>
 
 class GDALDataset;
+class TerrainLod;
+class TileStreamer;
+class TriangleMask;
+class TimeSeries;
+class ElevationGrid;
+class MeshCache;
 
 class Engine;
 
+// A data layer decoded for a terrain, ready for Terrain::uploadDataset: one
+// value per vertex normalized to [0,1], plus for a compact terrain the same
+// values packed to 16 bit unorm, which is what its data buffer takes.
+struct DataValues {
+    QVector<float> values;
+    QVector<GLushort> packed;
+
+    bool isEmpty() const {return values.isEmpty();}
+};
+
 class Terrain {
 public:
     Terrain(Engine *eng, const QString& map, GLuint prog);
     ~Terrain();
 
-    void init();
+    // load does the CPU side (reading, meshing) and may run on any thread;
+    // upload then creates the GL objects on the GL thread. load returns
+    // false, having said why, when the DEM cannot be read.
+    bool load();
+    void upload();
     void tick(float dt);
     void render();
 
     void applyDataset(const QString& file);
 
-    static QVector<Terrain*> createTerrainFromDEMandMask(Engine *engine, const QString& dem, const QString& mask, Terrain *large_dem = nullptr);
+    // applyDataset in two halves. decodeDataset reads band 1 of file into
+    // values normalized to [0,1], one per vertex (per cell in heightmap
+    // mode), packed too when the terrain is compact; it touches no GL state
+    // and is safe to call from any thread. Returns false, with data empty,
+    // when the file cannot be read. A mask terrain only fills the vertices
+    // inside its mask.
+    // uploadDataset hands the values to the GPU on the GL thread and takes
+    // ownership of them, giving back the previous step's storage.
+    bool decodeDataset(const QString& file, DataValues& data) const;
+
+    // decodeDataset for step of series, whether its steps are files or a
+    // series container.
+    bool decodeStep(const TimeSeries& series, int step, DataValues& data) const;
+    void uploadDataset(DataValues& data);
+
+    // Shows a raw band_width x band_height layer (e.g. a series reduction)
+    // like a dataset, normalized over its own range. GL thread.
+    void applyLayer(const QVector<float>& layer, int band_width, int band_height);
+
+    // Raw range every data file is normalized over from now on, so the
+    // steps of a series share one color scale. Without it each file uses
+    // its own min/max. Set it before decoding on other threads.
+    void setDataRange(const SampleRange& range) {data_range = range;}
+
+    // A data series kept whole on the GPU, in two halves. decodeSeries picks
+    // the steps that fit max_layers (GL_MAX_ARRAY_TEXTURE_LAYERS) and
+    // budget_bytes, an evenly spaced subset when the series is over budget,
+    // and decodes them into layers on any thread. It returns false when the
+    // terrain cannot take a series (heightmap, streamed, LOD), not even two
+    // steps fit, or cancel got set. uploadSeries hands the layers to the GPU
+    // on the GL thread, and the data is drawn from them from then on,
+    // interpolating between steps at the time given to setSeriesTime.
+    struct SeriesLayers {
+        int steps;                  // of the whole series
+        int layers;
+        QVector<GLushort> texels;   // layer after layer
+    };
+
+    bool decodeSeries(const TimeSeries& series, size_t budget_bytes, int max_layers, SeriesLayers& out,
+                      const std::atomic<bool> *cancel = nullptr) const;
+    void uploadSeries(const SeriesLayers& layers);
+    void setSeriesTime(float step) {series_time = step;}
+
+    // A DEM and its mask as a pair of terrains, in two halves like load and
+    // upload; large_dem only has to be loaded. The programs are looked up on the GL thread
+    // beforehand. Returns an empty vector, having said why, when either file
+    // cannot be read.
+    static QVector<Terrain*> loadTerrainFromDEMandMask(Engine *engine, const QString& dem, const QString& mask,
+                                                       GLuint dem_program, GLuint mask_program,
+                                                       Terrain *large_dem = nullptr);
+    static void uploadMaskedTerrain(Engine *engine, const QVector<Terrain*>& terrains);
 
     static std::pair<double,double> getGeoTransformFromDEMs(Terrain *large, Terrain *small);
 
@@ -35,23 +111,175 @@ public:
 
     GDALDataset* getDataset() const {return dataset;}
 
+    const QString& getMapFile() const {return map_file;}
+    bool isStreamed() const {return streamer != nullptr;}
+
+    // Raw min/max the heights are normalized over.
+    const SampleRange& getHeightRange() const {return height_range;}
+
+    // For the two terrains of a masked DEM: re-classifies their shared mask
+    // at a new normalized threshold, or switches it off so the DEM terrain
+    // draws everything and the mask terrain nothing. Either terrain of the
+    // pair can be called; only the index lists (or mask texture) change.
+    bool hasMask() const {return mask_mode != 0;}
+    void setMaskThreshold(float threshold);
+    void setMaskEnabled(bool enabled);
+    float getMaskThreshold() const;
+    bool isMaskEnabled() const {return mask_enabled;}
+
+    // Position of the first DEM sample before the model transform, at
+    // height 0.
+    glm::vec3 getOrigin() const;
+
+    int getGridWidth() const {return grid_width;}
+    int getGridHeight() const {return grid_height;}
+    float getGridScale() const {return grid_scale;}
+
+    // The normalized heights as one contiguous grid for draping vector data,
+    // made from the terrain's own samples on first request and shared from
+    // then on. Null for streamed terrains, which never hold the whole DEM.
+    QSharedPointer<const ElevationGrid> getElevation() const;
+
+    // Grid cell where a world space ray (direction normalized) first hits
+    // the terrain surface, and the world position of the hit when hit is
+    // given. Returns false when it misses, or when there is no geometry to
+    // pick against (heightmap, streamed).
+    bool pick(const glm::vec3& origin, const glm::vec3& direction, int& cell_x, int& cell_z,
+              glm::vec3 *hit = nullptr) const;
+
     void translate(const glm::vec3& vec);
 
 private:
-    void initTerrainFile();
+    static QVector<Terrain*> finishMaskedTerrain(Engine *engine, Terrain *dem_t, Terrain *mask_t,
+                                                 GDALDataset *dataset, GDALDataset *dataset_mask);
+
+    bool initTerrainFile();
     void initGL(bool genBuffer = true);
+    void uploadVertices();
+    const Vertex* vertexData() const;
+    int vertexCount() const;
+    void uploadData();
+    void getLocations();
+    void initHeightmapGL();
+    void renderHeightmap();
+    void renderStreamed(const glm::mat4& mvp);
+    void uploadGridTexture(GLuint& texture, GLenum internal_format, GLenum format, GLenum type, const void *data);
+
+    static void initPatch();
+
+    bool loadTriangleMask();
+    void rebuildMaskIndices();
+    void applyMask();
+    void updateDataGather();
+    // decodeDataset and decodeStep as floats only; whole_grid fills every
+    // vertex of a mask terrain, not just those inside the mask
+    bool readDataset(const QString& file, QVector<float>& values, bool whole_grid) const;
+    bool readStep(const TimeSeries& series, int step, QVector<float>& values, bool whole_grid) const;
+    void fillDataValues(const float *band, int band_width, int band_height, const SampleRange& range,
+                        QVector<float>& values, bool whole_grid) const;
+    void packDataValues(DataValues& data) const;
+    const Terrain* vertexSource() const {return vertex_owner ? vertex_owner : this;}
 
     Engine *engine;
     QString map_file;
     GLuint program;
 
-    GLuint vbo, vao;
+    GLuint vbo, vao, ibo;
     GLint loc_mvp, loc_position, loc_texture, loc_heightScalar;
-    GLint loc_dataPoint;
+    GLint loc_dataPoint, loc_positionScale, loc_positionOffset;
+    GLint loc_gridWidth, loc_seriesLayer;
+    GLint loc_heightmap, loc_grid, loc_gridSize, loc_gridScale;
+    GLint loc_patchesX, loc_patchSize, loc_maskMode;
 
+    // one vertex per DEM sample (row major), drawn through indices. Empty
+    // when the mesh came from the cache, whose mapping then holds the
+    // vertices for as long as the terrain lives.
     QVector<Vertex> geometry;
+    QSharedPointer<MeshCache> mesh_cache;
+    QVector<GLuint> indices;
+    int grid_width, grid_height;
+    float grid_scale;
+
+    // --compact-vertices: CompactVertex instead of Vertex. X and Z go up as
+    // grid indices, so grids wider than 65536 do not fit; uploadVertices
+    // turns it off for those and keeps the float layout.
+    bool compact;
+    VertexPacking packing;
+
+    // data layer, one value per vertex in its own buffer so a new time
+    // step only uploads 4 bytes a vertex (2 when compact). Two buffers are
+    // filled in turn, data_front is the one drawn. Kept around between
+    // steps to avoid reallocating.
+    GLuint data_vbo[2];
+    GLsizeiptr data_bytes[2];
+    int data_front;
+    DataValues data_values;
+
+    // invalid unless set by setDataRange
+    SampleRange data_range;
+
+    // resident data series, one 16 bit unorm layer per kept step
+    GLuint series_texture;
+    float series_layer_scale;       // layers per step
+    float series_time;              // in steps
+
+    // mask terrain: the vertices its indices draw, as runs along grid rows,
+    // and those runs clipped to the last data raster's size with the pixel
+    // each starts at. Rebuilt when the mask changes and re-clipped when a
+    // raster of another size comes; decodeDataset reads it from any thread.
+    struct GatherRun {
+        GLuint vertex;
+        quint32 pixel;
+        int length;
+    };
+
+    struct DataGather {
+        int raster_width, raster_height;
+        QVector<GatherRun> drawn;       // whole grid, pixel unset
+        QVector<GatherRun> runs;        // on the raster
+    };
+
+    QSharedPointer<const DataGather> dataGather(int raster_width, int raster_height) const;
+
+    mutable std::mutex gather_mutex;
+    mutable QSharedPointer<const DataGather> data_gather;
+
+    // raw min/max the heights were normalized over
+    SampleRange height_range;
+
+    mutable std::mutex elevation_mutex;
+    mutable QSharedPointer<const ElevationGrid> elevation;
+
+    // set when drawing through chunked level of detail; geometry then also
+    // holds the skirt vertices after the grid and indices every LOD range
+    TerrainLod *lod;
+
+    // set when the DEM is streamed in tiles; there is no geometry then
+    TileStreamer *streamer;
+
+    // masked DEMs: both terrains draw from the DEM terrain's geometry and
+    // vertex buffer (vertex_owner is set on the mask terrain) and split the
+    // triangles by the shared mask bitmap
+    Terrain *vertex_owner;
+    Terrain *mask_partner;
+    QSharedPointer<TriangleMask> triangle_mask;
+    bool mask_enabled;
+
+    // heightmap mode: no geometry, the DEM lives in textures and one shared
+    // patch mesh is displaced by the heightmap path of the terrain shaders
+    bool heightmap;
+    int mask_mode;                  // 0 none, 1 outside the mask, 2 inside
+    QVector<float> heights;         // normalized, row major; freed after upload
+    QVector<char> mask_cells;       // 1 inside the mask; freed after upload
+    GLuint height_texture, mask_texture, data_texture;
+
+    static const int PATCH_SIZE = 64;
+    static GLuint patch_vao, patch_vbo, patch_ibo;
+    static GLsizei patch_index_count;
+
     QVector<GLuint> textures;
     QVector<double> geot;
+    QString projection;             // WKT, read with the geotransform
 
     glm::mat4 model;
 
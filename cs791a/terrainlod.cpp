@@ -0,0 +1,372 @@
+#include "terrainlod.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Sample positions from begin to end at the given stride. end is always
+// included so chunks that are not a multiple of the stride stay closed.
+static QVector<int> samplePositions(int begin, int end, int stride)
+{
+    QVector<int> positions;
+
+    for(int p = begin; p < end; p += stride)
+        positions << p;
+
+    positions << end;
+
+    return positions;
+}
+
+// True when all eight corners of the box lie outside one clip plane.
+bool outsideFrustum(const glm::mat4& mvp, const glm::vec3& lo, const glm::vec3& hi)
+{
+    int out[6] = {0, 0, 0, 0, 0, 0};
+
+    for(int i = 0; i < 8; i++) {
+        glm::vec4 c = mvp * glm::vec4((i & 1) ? hi.x : lo.x,
+                                      (i & 2) ? hi.y : lo.y,
+                                      (i & 4) ? hi.z : lo.z, 1.0f);
+
+        out[0] += (c.x < -c.w);
+        out[1] += (c.x > c.w);
+        out[2] += (c.y < -c.w);
+        out[3] += (c.y > c.w);
+        out[4] += (c.z < -c.w);
+        out[5] += (c.z > c.w);
+    }
+
+    for(int plane = 0; plane < 6; plane++)
+        if(out[plane] == 8)
+            return true;
+
+    return false;
+}
+
+TerrainLod::TerrainLod(float pixel_tolerance, int triangle_budget, int chunk_size, int max_levels)
+    : chunk_size(chunk_size), base_tolerance(pixel_tolerance), tolerance(pixel_tolerance),
+      triangle_budget(triangle_budget), selected_triangles(0), root(-1)
+{
+    // a level's stride must still fit inside a chunk
+    levels = 1;
+    while(levels < std::min(max_levels, (int) MAX_LEVELS) && (1 << levels) <= chunk_size)
+        levels++;
+}
+
+void TerrainLod::build(QVector<Vertex>& geometry, int w, int h)
+{
+    width = w;
+    height = h;
+
+    chunks_x = std::max(1, (width + chunk_size - 2) / chunk_size);
+    chunks_z = std::max(1, (height + chunk_size - 2) / chunk_size);
+
+    // chunk boundaries are the multiples of chunk_size plus the last row or
+    // column; each one gets a line of skirt vertices
+    hline_of_z.fill(-1, height);
+    vline_of_x.fill(-1, width);
+
+    int hlines = 0, vlines = 0;
+
+    for(int c = 0; c < chunks_z; c++)
+        hline_of_z[c * chunk_size] = hlines++;
+    hline_of_z[height - 1] = hlines++;
+    hline_count = hlines;
+
+    for(int c = 0; c < chunks_x; c++)
+        vline_of_x[c * chunk_size] = vlines++;
+    vline_of_x[width - 1] = vlines++;
+
+    chunks.resize(chunks_x * chunks_z);
+    Chunk *chunk_data = chunks.data();
+    const QVector<Vertex>& grid = geometry;
+
+    parallelBands(chunks.size(), workerCount(), [&](int, int begin, int end) {
+        for(int i = begin; i < end; i++) {
+            int x0 = (i % chunks_x) * chunk_size;
+            int z0 = (i / chunks_x) * chunk_size;
+
+            buildChunk(chunk_data[i], grid, x0, z0,
+                       std::min(x0 + chunk_size, width - 1), std::min(z0 + chunk_size, height - 1));
+        }
+    });
+
+    // skirts hang as deep as the coarsest level can be off, so the gap
+    // between any two neighbouring levels is always covered
+    float skirt_depth = 0.01f;
+    for(const Chunk& chunk : chunks)
+        skirt_depth = std::max(skirt_depth, chunk.error[levels - 1]);
+
+    skirt_base = geometry.size();
+    geometry.resize(skirt_base + hlines * width + vlines * height);
+
+    Vertex *verts = geometry.data();
+
+    for(int z = 0; z < height; z++) {
+        if(hline_of_z[z] < 0)
+            continue;
+
+        for(int x = 0; x < width; x++) {
+            Vertex& skirt = verts[hlineSkirt(x, z)];
+            skirt = verts[z * width + x];
+            skirt.position[1] -= skirt_depth;
+        }
+    }
+
+    for(int x = 0; x < width; x++) {
+        if(vline_of_x[x] < 0)
+            continue;
+
+        for(int z = 0; z < height; z++) {
+            Vertex& skirt = verts[vlineSkirt(x, z)];
+            skirt = verts[z * width + x];
+            skirt.position[1] -= skirt_depth;
+        }
+    }
+
+    // every chunk and level gets its own contiguous range of indices
+    GLuint total = 0;
+
+    for(Chunk& chunk : chunks) {
+        chunk.min.y -= skirt_depth;
+
+        for(int l = 0; l < levels; l++) {
+            chunk.first[l] = total;
+            total += chunk.count[l];
+        }
+    }
+
+    indices.resize(total);
+    GLuint *out = indices.data();
+
+    parallelBands(chunks.size(), workerCount(), [&](int, int begin, int end) {
+        for(int i = begin; i < end; i++) {
+            const Chunk& chunk = chunk_data[i];
+
+            int x0 = (i % chunks_x) * chunk_size;
+            int z0 = (i / chunks_x) * chunk_size;
+            int x1 = std::min(x0 + chunk_size, width - 1);
+            int z1 = std::min(z0 + chunk_size, height - 1);
+
+            for(int l = 0; l < levels; l++) {
+                QVector<int> xs = samplePositions(x0, x1, 1 << l);
+                QVector<int> zs = samplePositions(z0, z1, 1 << l);
+
+                GLuint *o = out + chunk.first[l];
+
+                for(int j = 0; j + 1 < zs.size(); j++) {
+                    for(int k = 0; k + 1 < xs.size(); k++) {
+                        GLuint a = zs[j] * width + xs[k];
+                        GLuint b = zs[j] * width + xs[k + 1];
+                        GLuint c = zs[j + 1] * width + xs[k];
+                        GLuint d = zs[j + 1] * width + xs[k + 1];
+
+                        *o++ = a; *o++ = b; *o++ = c;
+                        *o++ = c; *o++ = d; *o++ = b;
+                    }
+                }
+
+                // skirts along the four chunk edges
+                for(int k = 0; k + 1 < xs.size(); k++) {
+                    for(int z : {z0, z1}) {
+                        GLuint a = z * width + xs[k];
+                        GLuint b = z * width + xs[k + 1];
+                        GLuint sa = hlineSkirt(xs[k], z);
+                        GLuint sb = hlineSkirt(xs[k + 1], z);
+
+                        *o++ = a; *o++ = b; *o++ = sa;
+                        *o++ = sa; *o++ = sb; *o++ = b;
+                    }
+                }
+
+                for(int j = 0; j + 1 < zs.size(); j++) {
+                    for(int x : {x0, x1}) {
+                        GLuint a = zs[j] * width + x;
+                        GLuint b = zs[j + 1] * width + x;
+                        GLuint sa = vlineSkirt(x, zs[j]);
+                        GLuint sb = vlineSkirt(x, zs[j + 1]);
+
+                        *o++ = a; *o++ = b; *o++ = sa;
+                        *o++ = sa; *o++ = sb; *o++ = b;
+                    }
+                }
+            }
+        }
+    });
+
+    int size = 1;
+    while(size < std::max(chunks_x, chunks_z))
+        size *= 2;
+
+    nodes.clear();
+    root = buildNode(0, 0, size);
+}
+
+void TerrainLod::buildChunk(Chunk& chunk, const QVector<Vertex>& geometry, int x0, int z0, int x1, int z1)
+{
+    const Vertex *grid = geometry.constData();
+
+    float lo = grid[z0 * width + x0].position[1], hi = lo;
+
+    for(int z = z0; z <= z1; z++) {
+        for(int x = x0; x <= x1; x++) {
+            float y = grid[z * width + x].position[1];
+            lo = std::min(lo, y);
+            hi = std::max(hi, y);
+        }
+    }
+
+    chunk.min = glm::vec3(grid[z0 * width + x0].position[0], lo, grid[z0 * width + x0].position[2]);
+    chunk.max = glm::vec3(grid[z1 * width + x1].position[0], hi, grid[z1 * width + x1].position[2]);
+
+    // a level's error is how far the full resolution samples are from the
+    // surface interpolated between that level's samples
+    for(int l = 0; l < levels; l++) {
+        QVector<int> xs = samplePositions(x0, x1, 1 << l);
+        QVector<int> zs = samplePositions(z0, z1, 1 << l);
+
+        float error = 0.0f;
+
+        for(int j = 0; l > 0 && j + 1 < zs.size(); j++) {
+            for(int k = 0; k + 1 < xs.size(); k++) {
+                float h00 = grid[zs[j] * width + xs[k]].position[1];
+                float h10 = grid[zs[j] * width + xs[k + 1]].position[1];
+                float h01 = grid[zs[j + 1] * width + xs[k]].position[1];
+                float h11 = grid[zs[j + 1] * width + xs[k + 1]].position[1];
+
+                float dx = xs[k + 1] - xs[k];
+                float dz = zs[j + 1] - zs[j];
+
+                for(int z = zs[j]; z <= zs[j + 1]; z++) {
+                    float v = (z - zs[j]) / dz;
+
+                    for(int x = xs[k]; x <= xs[k + 1]; x++) {
+                        float u = (x - xs[k]) / dx;
+                        float approx = (h00 * (1 - u) + h10 * u) * (1 - v) + (h01 * (1 - u) + h11 * u) * v;
+
+                        error = std::max(error, std::fabs(grid[z * width + x].position[1] - approx));
+                    }
+                }
+            }
+        }
+
+        // coarser levels never claim to be more accurate than finer ones
+        chunk.error[l] = (l > 0) ? std::max(error, chunk.error[l - 1]) : 0.0f;
+
+        int cells = (xs.size() - 1) * (zs.size() - 1);
+        int edges = 2 * (xs.size() - 1) + 2 * (zs.size() - 1);
+        chunk.count[l] = (cells + edges) * 6;
+    }
+}
+
+int TerrainLod::buildNode(int cx, int cz, int size)
+{
+    if(cx >= chunks_x || cz >= chunks_z)
+        return -1;
+
+    Node node;
+    node.child[0] = node.child[1] = node.child[2] = node.child[3] = -1;
+    node.chunk = -1;
+
+    if(size == 1) {
+        node.chunk = cz * chunks_x + cx;
+        node.min = chunks[node.chunk].min;
+        node.max = chunks[node.chunk].max;
+    }
+
+    else {
+        int half = size / 2;
+        bool first = true;
+
+        for(int q = 0; q < 4; q++) {
+            int child = buildNode(cx + (q & 1) * half, cz + (q >> 1) * half, half);
+            node.child[q] = child;
+
+            if(child < 0)
+                continue;
+
+            node.min = first ? nodes[child].min : glm::min(node.min, nodes[child].min);
+            node.max = first ? nodes[child].max : glm::max(node.max, nodes[child].max);
+            first = false;
+        }
+    }
+
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+int TerrainLod::select(const glm::mat4& model, const glm::mat4& view_projection, const glm::vec3& camera,
+                       float height_scalar, float pixel_scale)
+{
+    draw_counts.clear();
+    draw_offsets.clear();
+    selected_triangles = 0;
+
+    if(root >= 0)
+        selectNode(root, view_projection * model, model, camera, height_scalar, pixel_scale);
+
+    // nudge the tolerance for the next frame to stay near the budget
+    if(selected_triangles > triangle_budget)
+        tolerance *= 1.25f;
+    else if(selected_triangles < triangle_budget / 2 && tolerance > base_tolerance)
+        tolerance = std::max(base_tolerance, tolerance / 1.25f);
+
+    return selected_triangles;
+}
+
+void TerrainLod::selectNode(int index, const glm::mat4& mvp, const glm::mat4& model, const glm::vec3& camera,
+                            float height_scalar, float pixel_scale)
+{
+    const Node& node = nodes[index];
+
+    // heights are scaled in the vertex shader, so scale the box the same way
+    glm::vec3 lo = node.min, hi = node.max;
+    lo.y = std::min(node.min.y * height_scalar, node.max.y * height_scalar);
+    hi.y = std::max(node.min.y * height_scalar, node.max.y * height_scalar);
+
+    if(outsideFrustum(mvp, lo, hi))
+        return;
+
+    if(node.chunk < 0) {
+        for(int q = 0; q < 4; q++)
+            if(node.child[q] >= 0)
+                selectNode(node.child[q], mvp, model, camera, height_scalar, pixel_scale);
+        return;
+    }
+
+    const Chunk& chunk = chunks[node.chunk];
+
+    glm::vec4 a = model * glm::vec4(lo, 1.0f);
+    glm::vec4 b = model * glm::vec4(hi, 1.0f);
+
+    float d2 = 0.0f;
+    for(int i = 0; i < 3; i++) {
+        float d = std::max(std::max(std::min(a[i], b[i]) - camera[i], 0.0f), camera[i] - std::max(a[i], b[i]));
+        d2 += d * d;
+    }
+
+    float distance = std::max(std::sqrt(d2), 0.001f);
+    float error_scale = std::fabs(height_scalar) * pixel_scale / distance;
+
+    int level = 0;
+    for(int l = levels - 1; l > 0; l--) {
+        if(chunk.error[l] * error_scale <= tolerance) {
+            level = l;
+            break;
+        }
+    }
+
+    draw_counts << chunk.count[level];
+    draw_offsets << (const GLvoid*) (sizeof(GLuint) * chunk.first[level]);
+    selected_triangles += chunk.count[level] / 3;
+}
+
+int TerrainLod::hlineSkirt(int x, int z) const
+{
+    return skirt_base + hline_of_z[z] * width + x;
+}
+
+int TerrainLod::vlineSkirt(int x, int z) const
+{
+    return skirt_base + hline_count * width + vline_of_x[x] * height + z;
+}
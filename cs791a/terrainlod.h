@@ -0,0 +1,83 @@
+#ifndef TERRAINLOD_H
+#define TERRAINLOD_H
+
+#include <QVector>
+
+#include "gl.h"
+#include "vertex.h"
+
+#include <glm/glm.hpp>
+
+// True when the box (in the space mvp takes in) lies wholly outside one of
+// the view frustum's clip planes.
+bool outsideFrustum(const glm::mat4& mvp, const glm::vec3& lo, const glm::vec3& hi);
+
+// Chunked level of detail for a full terrain grid. The grid is cut into
+// square chunks, each with index ranges at several strides (geomipmapping)
+// inside one shared index buffer. Every chunk edge gets a skirt hanging
+// below the surface so neighbours at different levels never show cracks.
+// A quadtree over the chunks culls against the view frustum, and a chunk's
+// level is the coarsest one whose projected height error stays under the
+// pixel tolerance. The tolerance adapts between frames to keep the selected
+// triangle count under a budget.
+class TerrainLod {
+public:
+    TerrainLod(float pixel_tolerance, int triangle_budget, int chunk_size = 64, int max_levels = 5);
+
+    // Appends skirt vertices to geometry, which must hold the width x height
+    // grid, and builds the per chunk index ranges.
+    void build(QVector<Vertex>& geometry, int width, int height);
+
+    const QVector<GLuint>& getIndices() const {return indices;}
+
+    // Picks a level for every visible chunk. The draw lists are then ready
+    // for glMultiDrawElements. Returns the number of triangles selected.
+    int select(const glm::mat4& model, const glm::mat4& view_projection, const glm::vec3& camera,
+               float height_scalar, float pixel_scale);
+
+    const QVector<GLsizei>& getDrawCounts() const {return draw_counts;}
+    const QVector<const GLvoid*>& getDrawOffsets() const {return draw_offsets;}
+
+private:
+    static const int MAX_LEVELS = 8;
+
+    struct Chunk {
+        glm::vec3 min, max;
+        GLuint first[MAX_LEVELS];
+        GLsizei count[MAX_LEVELS];
+        float error[MAX_LEVELS];    // max height error in normalized units
+    };
+
+    struct Node {
+        glm::vec3 min, max;
+        int child[4];               // -1 where a quadrant holds no chunks
+        int chunk;                  // leaf chunk, -1 for inner nodes
+    };
+
+    void buildChunk(Chunk& chunk, const QVector<Vertex>& geometry, int x0, int z0, int x1, int z1);
+    int buildNode(int cx, int cz, int size);
+    void selectNode(int node, const glm::mat4& mvp, const glm::mat4& model, const glm::vec3& camera,
+                    float height_scalar, float pixel_scale);
+
+    int hlineSkirt(int x, int z) const;
+    int vlineSkirt(int x, int z) const;
+
+    int chunk_size, levels;
+    float base_tolerance, tolerance;
+    int triangle_budget, selected_triangles;
+
+    int width, height;
+    int chunks_x, chunks_z;
+    int skirt_base, hline_count;
+    QVector<int> hline_of_z, vline_of_x;
+
+    QVector<Chunk> chunks;
+    QVector<Node> nodes;
+    int root;
+
+    QVector<GLuint> indices;
+    QVector<GLsizei> draw_counts;
+    QVector<const GLvoid*> draw_offsets;
+};
+
+#endif // TERRAINLOD_H
@@ -0,0 +1,466 @@
+#include "tilestreamer.h"
+#include "datasetregistry.h"
+#include "terrainlod.h"
+
+#include <gdal_priv.h>
+
+#include <QDebug>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+// reads of a tile that fail this often are not queued again
+static const int MAX_TILE_RETRIES = 3;
+
+TileStreamer::TileStreamer(const QString& file, const SampleRange& range, float grid_scale,
+                           int tile_size, size_t budget_bytes, int loader_threads)
+    : file(file), range(range), grid_scale(grid_scale), tile_size(std::max(tile_size, 2)),
+      budget_bytes(budget_bytes), vao(0), ibo(0), index_count(0), resident_bytes(0), frame_bytes(0), frame(0),
+      quit(false)
+{
+    int side = this->tile_size + 1;
+    tile_bytes = sizeof(CompactVertex) * (side * side + 4 * side);
+
+    DatasetHandle dataset(file);
+
+    if(!dataset) {
+        qDebug() << "Unable to get GDAL Dataset for streamed file: " << file;
+        width = height = 0;
+        top_level = -1;
+        return;
+    }
+
+    width = dataset->GetRasterXSize();
+    height = dataset->GetRasterYSize();
+
+    top_level = 0;
+    while(((long long) this->tile_size << top_level) < std::max(width, height) - 1)
+        top_level++;
+
+    // the top tile is always resident, so there is something to draw (and
+    // fall back to) from the first frame on
+    LoadedTile top;
+    if(!loadTile(dataset.get(), makeKey(top_level, 0, 0), top)) {
+        qDebug() << "Unable to read the top tile of streamed file: " << file;
+        width = height = 0;
+        top_level = -1;
+        return;
+    }
+
+    done.push_back(top);
+    in_flight.insert(top.key);
+
+    for(int i = 0; i < std::max(loader_threads, 1); i++)
+        loaders.emplace_back(&TileStreamer::loaderMain, this);
+}
+
+TileStreamer::~TileStreamer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+
+    wake.notify_all();
+
+    for(std::thread& t : loaders)
+        t.join();
+
+    for(const Tile& tile : tiles)
+        glDeleteBuffers(1, &tile.vbo);
+
+    if(vao) {
+        glDeleteBuffers(1, &ibo);
+        glDeleteVertexArrays(1, &vao);
+    }
+}
+
+quint64 TileStreamer::makeKey(int level, int tx, int tz)
+{
+    return ((quint64) level << 56) | ((quint64) tx << 28) | (quint64) tz;
+}
+
+void TileStreamer::splitKey(quint64 key, int& level, int& tx, int& tz)
+{
+    level = key >> 56;
+    tx = (key >> 28) & 0xfffffff;
+    tz = key & 0xfffffff;
+}
+
+bool TileStreamer::exists(int level, int tx, int tz) const
+{
+    long long span = (long long) tile_size << level;
+
+    return tx * span < std::max(width - 1, 1) && tz * span < std::max(height - 1, 1);
+}
+
+// Reads one tile and turns it into packed vertices. Runs on a loader thread
+// (or the constructor for the top tile), so it only touches the dataset
+// handed in and members that never change. Returns false if the read failed.
+bool TileStreamer::loadTile(GDALDataset *dataset, quint64 key, LoadedTile& out) const
+{
+    int level, tx, tz;
+    splitKey(key, level, tx, tz);
+
+    int step = 1 << level;
+
+    // a level samples the DEM in blocks of step x step pixels (fewer along a
+    // side shorter than that), one sample per block. The window is aligned
+    // to the blocks so GDAL decimates by exactly the block size: it takes
+    // each sample from the pixel in the middle of its block, or from an
+    // overview averaging the block, and the vertex goes on that pixel.
+    // Neighbours read the same blocks along their shared edge, so their edge
+    // heights match. A partial block at the far edge of a coarse level is
+    // left out.
+    int block_x = std::min(step, width), block_z = std::min(step, height);
+    int blocks_x = width / block_x, blocks_z = height / block_z;
+
+    int bx0 = std::min(tx * tile_size, blocks_x - 1);
+    int bz0 = std::min(tz * tile_size, blocks_z - 1);
+    int nx = std::min(tile_size + 1, blocks_x - bx0);
+    int nz = std::min(tile_size + 1, blocks_z - bz0);
+
+    QVector<float> samples(nx * nz);
+    GDALRasterBand *band = dataset->GetRasterBand(1);
+
+    CPLErr err = band->RasterIO(GF_Read, bx0 * block_x, bz0 * block_z, nx * block_x, nz * block_z,
+                                samples.data(), nx, nz, GDT_Float32, 0, 0);
+
+    if(err != CE_None) {
+        qDebug() << "RasterIO failed reading tile" << level << tx << tz;
+        return false;
+    }
+
+    int has_nodata = 0;
+    SampleFormat format;
+    format.type = GDT_Float32;
+    format.nodata = band->GetNoDataValue(&has_nodata);
+    format.has_nodata = has_nodata;
+
+    SampleRange seen;
+    float scale = (range.max > range.min) ? 1.0f / (range.max - range.min) : 0.0f;
+    decodeSamples(samples.constData(), format, samples.size(), range.min, scale, 0.0f, samples.data(), seen);
+
+    // the vertex grid is always (tile_size+1)^2 so every tile shares one
+    // index buffer; columns and rows past the last block repeat it
+    int side = tile_size + 1;
+    QVector<Vertex> verts(side * side + 4 * side);
+    Vertex *v = verts.data();
+
+    float lo = 1.0f, hi = 0.0f;
+
+    for(int j = 0; j < side; j++) {
+        int sz = std::min(j, nz - 1);
+        int z = (bz0 + sz) * block_z + block_z / 2;
+
+        for(int i = 0; i < side; i++) {
+            int sx = std::min(i, nx - 1);
+            int x = (bx0 + sx) * block_x + block_x / 2;
+
+            Vertex& vert = v[j * side + i];
+            vert.position[0] = (x - width / 2) * grid_scale;
+            vert.position[1] = samples[sz * nx + sx];
+            vert.position[2] = (z - height / 2) * grid_scale;
+
+            lo = std::min(lo, vert.position[1]);
+            hi = std::max(hi, vert.position[1]);
+        }
+    }
+
+    // a neighbour at another level can be off by at most the tile's relief
+    float skirt_depth = std::max(0.005f, 0.5f * (hi - lo));
+    Vertex *skirt = v + side * side;
+
+    for(int i = 0; i < side; i++) {
+        skirt[i] = v[i];
+        skirt[side + i] = v[(side - 1) * side + i];
+        skirt[2 * side + i] = v[i * side];
+        skirt[3 * side + i] = v[i * side + side - 1];
+    }
+
+    for(int i = 0; i < 4 * side; i++)
+        skirt[i].position[1] -= skirt_depth;
+
+    out.key = key;
+
+    return packVertices(v, verts.size(), glm::vec3(grid_scale * step, 0.0f, grid_scale * step), out.vertices,
+                        out.packing, 1);
+}
+
+void TileStreamer::loaderMain()
+{
+    // held for the life of the thread
+    DatasetHandle dataset(file);
+
+    if(!dataset) {
+        qDebug() << "Tile loader unable to open: " << file;
+        return;
+    }
+
+    for(;;) {
+        quint64 key;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] {return quit || !pending.empty();});
+
+            if(quit)
+                break;
+
+            key = pending.front();
+            pending.pop_front();
+        }
+
+        LoadedTile loaded;
+        bool read = loadTile(dataset.get(), key, loaded);
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // a failed tile is dropped, so its parent keeps covering the gap;
+        // update asks for it again until it runs out of retries
+        if(!read) {
+            in_flight.remove(key);
+            failures[key]++;
+            continue;
+        }
+
+        done.push_back(loaded);
+    }
+}
+
+void TileStreamer::upload(LoadedTile& loaded)
+{
+    Tile tile;
+    tile.packing = loaded.packing;
+    tile.bytes = sizeof(CompactVertex) * loaded.vertices.size();
+    tile.last_frame = -1;
+
+    glGenBuffers(1, &tile.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, tile.vbo);
+    glBufferData(GL_ARRAY_BUFFER, tile.bytes, loaded.vertices.constData(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    lru.push_front(loaded.key);
+    tile.lru = lru.begin();
+
+    tiles.insert(loaded.key, tile);
+    resident_bytes += tile.bytes;
+}
+
+// Drops least recently drawn tiles until the cache is under budget. Tiles
+// visited this frame and the top tile always stay; select only refines
+// while the tiles it visits fit the budget, so those cannot outgrow it.
+void TileStreamer::evict()
+{
+    auto it = lru.end();
+
+    while(resident_bytes > budget_bytes && it != lru.begin()) {
+        --it;
+
+        int level, tx, tz;
+        splitKey(*it, level, tx, tz);
+
+        Tile& tile = tiles[*it];
+
+        if(tile.last_frame == frame || level == top_level)
+            continue;
+
+        glDeleteBuffers(1, &tile.vbo);
+        resident_bytes -= tile.bytes;
+
+        tiles.remove(*it);
+        it = lru.erase(it);
+    }
+}
+
+void TileStreamer::bounds(int level, int tx, int tz, float height_scalar, glm::vec3& lo, glm::vec3& hi) const
+{
+    long long span = (long long) tile_size << level;
+
+    // vertices sit up to a block past the tile's corner, and skirts hang
+    // down by at most half the relief
+    lo = glm::vec3((tx * span - width / 2) * grid_scale,
+                   std::min(-0.5f * height_scalar, height_scalar),
+                   (tz * span - height / 2) * grid_scale);
+    hi = glm::vec3(((tx + 1) * span + (1 << level) - width / 2) * grid_scale,
+                   std::max(-0.5f * height_scalar, height_scalar),
+                   ((tz + 1) * span + (1 << level) - height / 2) * grid_scale);
+}
+
+bool TileStreamer::visible(int level, int tx, int tz, const glm::mat4& mvp, float height_scalar) const
+{
+    if(!exists(level, tx, tz))
+        return false;
+
+    glm::vec3 lo, hi;
+    bounds(level, tx, tz, height_scalar, lo, hi);
+
+    return !outsideFrustum(mvp, lo, hi);
+}
+
+void TileStreamer::select(int level, int tx, int tz, const glm::mat4& mvp, const glm::vec3& camera,
+                          float height_scalar, float pixel_scale, float cell_pixels)
+{
+    quint64 key = makeKey(level, tx, tz);
+
+    Tile& tile = tiles[key];
+    tile.last_frame = frame;
+    lru.splice(lru.begin(), lru, tile.lru);
+    frame_bytes += tile.bytes;
+
+    if(level > 0) {
+        glm::vec3 lo, hi;
+        bounds(level, tx, tz, height_scalar, lo, hi);
+
+        glm::vec3 d(std::max(std::max(lo.x - camera.x, camera.x - hi.x), 0.0f),
+                    std::max(std::max(lo.y - camera.y, camera.y - hi.y), 0.0f),
+                    std::max(std::max(lo.z - camera.z, camera.z - hi.z), 0.0f));
+
+        float distance = std::max(std::sqrt(d.x * d.x + d.y * d.y + d.z * d.z), 0.001f);
+        float cell = grid_scale * (1 << level) * pixel_scale / distance;
+
+        // the children visited or queued this frame must fit the budget
+        // next to everything visited so far
+        bool room = frame_bytes + (wanted.size() + 4) * tile_bytes <= budget_bytes;
+
+        if(cell > cell_pixels && room) {
+            bool ready = true;
+
+            for(int c = 0; c < 4; c++) {
+                int cx = 2 * tx + (c & 1), cz = 2 * tz + (c >> 1);
+
+                if(visible(level - 1, cx, cz, mvp, height_scalar) && !tiles.contains(makeKey(level - 1, cx, cz))) {
+                    wanted.push_back(makeKey(level - 1, cx, cz));
+                    ready = false;
+                }
+            }
+
+            // only split once all four children can be drawn, otherwise the
+            // parent would overlap the ones that are there. Children outside
+            // the frustum are neither loaded nor drawn.
+            if(ready) {
+                for(int c = 0; c < 4; c++) {
+                    int cx = 2 * tx + (c & 1), cz = 2 * tz + (c >> 1);
+
+                    if(visible(level - 1, cx, cz, mvp, height_scalar))
+                        select(level - 1, cx, cz, mvp, camera, height_scalar, pixel_scale, cell_pixels);
+                }
+
+                return;
+            }
+        }
+    }
+
+    draw_list.push_back(key);
+}
+
+void TileStreamer::update(const glm::mat4& mvp, const glm::vec3& camera, float height_scalar, float pixel_scale,
+                          float cell_pixels)
+{
+    if(!vao) {
+        // (tile_size+1)^2 grid vertices followed by four lines of skirt
+        // vertices: top, bottom, left and right edge
+        int side = tile_size + 1;
+        int skirt = side * side;
+
+        QVector<GLuint> indices;
+        indices.reserve(6 * tile_size * tile_size + 24 * tile_size);
+
+        auto quad = [&](GLuint a, GLuint b, GLuint c, GLuint d) {
+            indices << a << b << c << c << b << d;
+        };
+
+        for(int z = 0; z < tile_size; z++)
+            for(int x = 0; x < tile_size; x++)
+                quad(z * side + x, z * side + x + 1, (z + 1) * side + x, (z + 1) * side + x + 1);
+
+        for(int i = 0; i < tile_size; i++) {
+            quad(i, i + 1, skirt + i, skirt + i + 1);
+            quad((side - 1) * side + i, (side - 1) * side + i + 1, skirt + side + i, skirt + side + i + 1);
+            quad(i * side, (i + 1) * side, skirt + 2 * side + i, skirt + 2 * side + i + 1);
+            quad(i * side + side - 1, (i + 1) * side + side - 1, skirt + 3 * side + i, skirt + 3 * side + i + 1);
+        }
+
+        index_count = indices.size();
+
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &ibo);
+
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), indices.constData(), GL_STATIC_DRAW);
+        glBindVertexArray(0);
+    }
+
+    frame++;
+
+    std::vector<LoadedTile> arrived;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        arrived.swap(done);
+
+        for(const LoadedTile& loaded : arrived)
+            in_flight.remove(loaded.key);
+    }
+
+    for(LoadedTile& loaded : arrived)
+        upload(loaded);
+
+    draw_list.clear();
+    wanted.clear();
+    frame_bytes = 0;
+
+    if(tiles.contains(makeKey(top_level, 0, 0)) && visible(top_level, 0, 0, mvp, height_scalar))
+        select(top_level, 0, 0, mvp, camera, height_scalar, pixel_scale, cell_pixels);
+
+    evict();
+
+    {
+        // what this frame wants replaces whatever was still queued; tiles
+        // near the top of the tree come first since they unblock the rest
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for(quint64 key : pending)
+            in_flight.remove(key);
+        pending.clear();
+
+        for(quint64 key : wanted) {
+            if(!in_flight.contains(key) && failures.value(key) < MAX_TILE_RETRIES) {
+                pending.push_back(key);
+                in_flight.insert(key);
+            }
+        }
+    }
+
+    wake.notify_all();
+}
+
+void TileStreamer::render(GLint loc_position, GLint loc_positionScale, GLint loc_positionOffset)
+{
+    glBindVertexArray(vao);
+    glEnableVertexAttribArray(loc_position);
+
+    for(quint64 key : draw_list) {
+        const Tile& tile = tiles[key];
+
+        glBindBuffer(GL_ARRAY_BUFFER, tile.vbo);
+        glVertexAttribPointer(loc_position,
+                              3,
+                              GL_UNSIGNED_SHORT,
+                              GL_FALSE,
+                              sizeof(CompactVertex),
+                              (void*)offsetof(CompactVertex,position));
+
+        glUniform3fv(loc_positionScale, 1, glm::value_ptr(tile.packing.scale));
+        glUniform3fv(loc_positionOffset, 1, glm::value_ptr(tile.packing.offset));
+
+        glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, 0);
+    }
+
+    glDisableVertexAttribArray(loc_position);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
@@ -0,0 +1,125 @@
+#ifndef TILESTREAMER_H
+#define TILESTREAMER_H
+
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gl.h"
+#include "vertexpack.h"
+#include "samplekernel.h"
+
+#include <glm/glm.hpp>
+
+class GDALDataset;
+
+// Streams a DEM too large for memory as a quadtree of square tiles. Level 0
+// tiles hold tile_size x tile_size cells at full resolution, every level up
+// doubles the sample spacing, and the top level covers the whole DEM in one
+// tile. Tiles are read from GDAL on background threads (each holding its own
+// pooled dataset handle) and kept on the GPU in an LRU cache under a byte budget.
+// While a tile is missing its nearest loaded ancestor is drawn instead, so
+// detail fills in as tiles arrive. Every tile has skirts hanging below its
+// edges to hide cracks between neighbours at different levels.
+class TileStreamer {
+public:
+    // range is the raw height range heights are normalized over, grid_scale
+    // the world size of a cell. The top level tile is read before returning;
+    // isLoaded() is false when the file could not be opened.
+    TileStreamer(const QString& file, const SampleRange& range, float grid_scale,
+                 int tile_size, size_t budget_bytes, int loader_threads);
+
+    // Stops the loaders and frees the resident tiles. GL thread.
+    ~TileStreamer();
+
+    bool isLoaded() const {return top_level >= 0;}
+
+    // Must run on the GL thread. Uploads tiles that finished loading, picks
+    // the tiles to draw from the camera position (in the terrain's local
+    // space) and queues the ones that are missing. Tiles outside the view
+    // frustum of mvp are skipped, and a tile is refined until its cells
+    // project to at most cell_pixels pixels or the budget is used up.
+    void update(const glm::mat4& mvp, const glm::vec3& camera, float height_scalar, float pixel_scale,
+                float cell_pixels);
+
+    // Draws the tiles picked by the last update with the program bound by
+    // the caller, which takes positions through the decode uniforms.
+    void render(GLint loc_position, GLint loc_positionScale, GLint loc_positionOffset);
+
+    int residentTiles() const {return tiles.size();}
+    size_t residentBytes() const {return resident_bytes;}
+
+private:
+    // a decoded tile on its way from a loader thread to the GPU
+    struct LoadedTile {
+        quint64 key;
+        QVector<CompactVertex> vertices;
+        VertexPacking packing;
+    };
+
+    struct Tile {
+        GLuint vbo;
+        VertexPacking packing;
+        size_t bytes;
+        int last_frame;
+        std::list<quint64>::iterator lru;
+    };
+
+    static quint64 makeKey(int level, int tx, int tz);
+    static void splitKey(quint64 key, int& level, int& tx, int& tz);
+
+    bool exists(int level, int tx, int tz) const;
+    void bounds(int level, int tx, int tz, float height_scalar, glm::vec3& lo, glm::vec3& hi) const;
+    bool visible(int level, int tx, int tz, const glm::mat4& mvp, float height_scalar) const;
+    bool loadTile(GDALDataset *dataset, quint64 key, LoadedTile& out) const;
+    void upload(LoadedTile& loaded);
+    void evict();
+    void select(int level, int tx, int tz, const glm::mat4& mvp, const glm::vec3& camera,
+                float height_scalar, float pixel_scale, float cell_pixels);
+    void loaderMain();
+
+    QString file;
+    SampleRange range;
+    float grid_scale;
+    int tile_size;
+    size_t budget_bytes;
+    size_t tile_bytes;
+
+    int width, height;
+    int top_level;
+
+    // shared by every tile, the vertex layout only depends on tile_size
+    GLuint vao, ibo;
+    GLsizei index_count;
+
+    QHash<quint64, Tile> tiles;
+    std::list<quint64> lru;            // most recently drawn first
+    size_t resident_bytes;
+    size_t frame_bytes;                // visited by this frame's select
+    int frame;
+
+    QVector<quint64> draw_list;
+    QVector<quint64> wanted;
+
+    // shared with the loader threads
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<quint64> pending;
+    QSet<quint64> in_flight;           // queued, loading or waiting for upload
+    QHash<quint64, int> failures;      // failed reads per tile
+    std::vector<LoadedTile> done;
+    bool quit;
+
+    std::vector<std::thread> loaders;
+};
+
+#endif // TILESTREAMER_H
@@ -0,0 +1,114 @@
+#include "timeseries.h"
+#include "seriescontainer.h"
+#include "seriesstats.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QMap>
+
+#include <algorithm>
+#include <cmath>
+
+static const float MIN_RATE = 0.125f;
+static const float MAX_RATE = 120.0f;
+
+TimeSeries::TimeSeries(const QString& directory, const QString& variable, float rate)
+    : variable(variable), container(nullptr), frame(0), playing(true), rate(1.0f), elapsed(0.0f)
+{
+    setRate(rate);
+
+    findSteps(directory, variable, files, step_numbers);
+
+    QString container_path = QDir(directory).filePath(variable + ".tsc");
+    container = new SeriesContainer;
+
+    if(container->open(container_path)) {
+        // the step files may have been edited, added or removed since the
+        // import; with none left the container is all there is
+        if(files.isEmpty() || container->sourceKey() == seriesFilesKey(files)) {
+            files.clear();
+            step_numbers.clear();
+
+            for(int i = 0; i < container->steps(); i++)
+                step_numbers.push_back(container->stepNumber(i));
+
+            return;
+        }
+
+        qDebug() << "Series container" << container_path << "is out of date with the"
+                 << variable << "step files, reading those instead";
+    }
+
+    delete container;
+    container = nullptr;
+
+    if(files.isEmpty())
+        qDebug() << "No" << variable << "time steps in" << directory;
+}
+
+TimeSeries::~TimeSeries()
+{
+    delete container;
+}
+
+void TimeSeries::findSteps(const QString& directory, const QString& variable,
+                           QStringList& files, QVector<int>& step_numbers)
+{
+    QDir dir(directory);
+    QStringList names = dir.entryList(QStringList() << variable + ".*.tif", QDir::Files);
+
+    // sorted by step number, not by name, so em.999 comes before em.1000
+    QMap<int, QString> steps;
+
+    for(const QString& name : names) {
+        QString step = name.mid(variable.size() + 1, name.size() - variable.size() - 5);
+
+        bool ok;
+        int n = step.toInt(&ok);
+
+        if(ok)
+            steps.insert(n, dir.filePath(name));
+    }
+
+    files.clear();
+    step_numbers.clear();
+
+    for(auto it = steps.begin(); it != steps.end(); ++it) {
+        step_numbers.push_back(it.key());
+        files.push_back(it.value());
+    }
+}
+
+QString TimeSeries::stepName(int step) const
+{
+    return QString("%1.%2").arg(variable).arg(step_numbers[step]);
+}
+
+void TimeSeries::step(int delta)
+{
+    if(isEmpty())
+        return;
+
+    frame = ((frame + delta) % size() + size()) % size();
+    elapsed = 0.0f;
+}
+
+void TimeSeries::setRate(float steps_per_second)
+{
+    rate = std::max(MIN_RATE, std::min(steps_per_second, MAX_RATE));
+}
+
+void TimeSeries::update(float dt)
+{
+    if(!playing || size() < 2)
+        return;
+
+    elapsed += dt * rate;
+
+    int steps = (int) std::floor(elapsed);
+
+    if(steps > 0) {
+        elapsed -= steps;
+        frame = (frame + steps) % size();
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef TIMESERIES_H
+#define TIMESERIES_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+class SeriesContainer;
+
+// Playback over the isnobal outputs of one variable in step order. The steps
+// come from the <variable>.<step>.tif files of the directory (em.1000.tif,
+// em.1001.tif, ...), or from <variable>.tsc when those were imported into a
+// series container that is still up to date with them. Only keeps time; the
+// caller loads the current step when it changes. Which steps there are never
+// changes, so loader threads may read them while the GUI thread plays.
+class TimeSeries {
+public:
+    TimeSeries(const QString& directory, const QString& variable, float rate);
+    ~TimeSeries();
+
+    // The <variable>.<step>.tif files of directory and their step numbers,
+    // sorted by step.
+    static void findSteps(const QString& directory, const QString& variable,
+                          QStringList& files, QVector<int>& step_numbers);
+
+    bool isEmpty() const {return step_numbers.isEmpty();}
+    int size() const {return step_numbers.size();}
+
+    // Set when the steps come from a series container; the files are only
+    // there without one.
+    const SeriesContainer* getContainer() const {return container;}
+    const QString& file(int step) const {return files[step];}
+    const QStringList& getFiles() const {return files;}
+
+    // e.g. em.1003, for messages
+    QString stepName(int step) const;
+
+    int stepNumber(int step) const {return step_numbers[step];}
+
+    // Index of the step numbered number, -1 when there is none.
+    int findStep(int number) const {return step_numbers.indexOf(number);}
+
+    int current() const {return frame;}
+
+    // Playback position in steps including the fraction played of the
+    // current one.
+    float time() const {return frame + elapsed;}
+
+    void setPlaying(bool play) {playing = play;}
+    bool isPlaying() const {return playing;}
+
+    // Moves delta steps to the start of a step, wrapping around at either
+    // end.
+    void step(int delta);
+
+    // Steps per second while playing.
+    void setRate(float steps_per_second);
+    float getRate() const {return rate;}
+
+    // Advances playback by dt seconds.
+    void update(float dt);
+
+private:
+    TimeSeries(const TimeSeries&);
+    TimeSeries& operator=(const TimeSeries&);
+
+    QString variable;
+    QStringList files;
+    QVector<int> step_numbers;
+    SeriesContainer *container;
+
+    int frame;
+    bool playing;
+    float rate;
+    float elapsed;
+};
+
+#endif // TIMESERIES_H
@@ -0,0 +1,49 @@
+#include "trianglemask.h"
+#include "parallel.h"
+
+TriangleMask::TriangleMask(int width, int height, const QVector<float>& samples)
+    : width(width), height(height), thresh(0.0f), samples(samples)
+{
+    size_t triangles = (size_t) std::max(width - 1, 0) * std::max(height - 1, 0) * 2;
+    bits.resize((triangles + 31) / 32);
+}
+
+void TriangleMask::setThreshold(float threshold)
+{
+    thresh = threshold;
+
+    const float *s = samples.constData();
+    quint32 *out = bits.data();
+    int cells_x = width - 1;
+    size_t triangles = (size_t) cells_x * std::max(height - 1, 0) * 2;
+
+    // split by whole words so no two threads write the same one
+    parallelBands(bits.size(), workerCount(), [&](int, int begin, int end) {
+        size_t bit = (size_t) begin * 32;
+        size_t cell = bit / 2;
+        int x = cell % cells_x, z = cell / cells_x;
+
+        for(int w = begin; w < end; w++) {
+            quint32 word = 0;
+
+            for(int b = 0; b < 32 && bit < triangles; b += 2, bit += 2) {
+                const float *m = s + (size_t) z * width + x;
+
+                bool m00 = m[0] >= threshold, m10 = m[1] >= threshold;
+                bool m01 = m[width] >= threshold, m11 = m[width + 1] >= threshold;
+
+                if(m00 && m10 && m01)
+                    word |= 1u << b;
+                if(m01 && m11 && m10)
+                    word |= 1u << (b + 1);
+
+                if(++x == cells_x) {
+                    x = 0;
+                    z++;
+                }
+            }
+
+            out[w] = word;
+        }
+    });
+}
@@ -0,0 +1,37 @@
+#ifndef TRIANGLEMASK_H
+#define TRIANGLEMASK_H
+
+#include <QVector>
+
+#include <cstddef>
+
+// Which triangles of a width x height grid mesh lie inside a mask, packed
+// one bit per triangle (upper then lower triangle of each cell, cells row
+// major). A triangle is inside when all three of its corners have a mask
+// sample at or above the threshold. The per vertex samples are kept, so
+// moving the threshold only redoes the bits.
+class TriangleMask {
+public:
+    // samples are normalized to [0,1], one per grid vertex, row major.
+    TriangleMask(int width, int height, const QVector<float>& samples);
+
+    void setThreshold(float threshold);
+    float threshold() const {return thresh;}
+
+    bool contains(int x, int z, bool upper) const
+    {
+        size_t bit = ((size_t) z * (width - 1) + x) * 2 + (upper ? 0 : 1);
+        return (bits[bit >> 5] >> (bit & 31)) & 1;
+    }
+
+    bool vertexInside(int i) const {return samples[i] >= thresh;}
+
+private:
+    int width, height;
+    float thresh;
+
+    QVector<float> samples;
+    QVector<quint32> bits;
+};
+
+#endif // TRIANGLEMASK_H
@@ -3,9 +3,17 @@
 
 #include "gl.h"
 
+// Only the geometry lives here. Per vertex data values change every time
+// step, so terrains keep them in a buffer of their own (see Terrain).
 struct Vertex {
     GLfloat position[3];
-    GLfloat dataPoint;
+};
+
+// Compact Vertex. Positions are 16 bit quantized and decoded in the vertex
+// shader (see vertexpack.h), padded to keep vertices 4 byte aligned.
+struct CompactVertex {
+    GLushort position[3];
+    GLushort padding;
 };
 
 #endif // VERTEX_H
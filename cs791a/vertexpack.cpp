@@ -0,0 +1,65 @@
+#include "vertexpack.h"
+#include "parallel.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+
+static const float QUANT_MAX = 65535.0f;
+
+static GLushort quantize(float v)
+{
+    // also sends NaN to 0
+    if(!(v > 0.0f))
+        return 0;
+
+    return (GLushort) std::min(v + 0.5f, QUANT_MAX);
+}
+
+bool packVertices(const Vertex *verts, int count, const glm::vec3& step, QVector<CompactVertex>& out,
+                  VertexPacking& packing, int bands)
+{
+    packing = VertexPacking();
+    out.clear();
+
+    if(count == 0)
+        return true;
+
+    glm::vec3 lo(verts[0].position[0], verts[0].position[1], verts[0].position[2]), hi = lo;
+
+    for(int i = 1; i < count; i++) {
+        for(int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], verts[i].position[a]);
+            hi[a] = std::max(hi[a], verts[i].position[a]);
+        }
+    }
+
+    glm::vec3 inv;
+
+    for(int a = 0; a < 3; a++) {
+        packing.scale[a] = (step[a] > 0.0f) ? step[a] : (hi[a] - lo[a]) / QUANT_MAX;
+        packing.offset[a] = lo[a];
+        inv[a] = (packing.scale[a] > 0.0f) ? 1.0f / packing.scale[a] : 0.0f;
+
+        if(!std::isfinite(hi[a] - lo[a]) || (hi[a] - lo[a]) * inv[a] > QUANT_MAX + 0.5f) {
+            qDebug() << "packVertices: axis" << a << "does not fit in 16 bits";
+            packing = VertexPacking();
+            return false;
+        }
+    }
+
+    out.resize(count);
+    CompactVertex *dst = out.data();
+
+    parallelBands(count, bands ? bands : workerCount(), [&](int, int begin, int end) {
+        for(int i = begin; i < end; i++) {
+            for(int a = 0; a < 3; a++)
+                dst[i].position[a] = quantize((verts[i].position[a] - lo[a]) * inv[a]);
+
+            dst[i].padding = 0;
+        }
+    });
+
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef VERTEXPACK_H
+#define VERTEXPACK_H
+
+#include <QVector>
+
+#include "vertex.h"
+
+#include <glm/glm.hpp>
+
+// How the vertex shaders get a position back out of a vertex buffer:
+// position = v_position * scale + offset. Float vertices use scale 1 and
+// offset 0, so every program can take either layout.
+struct VertexPacking {
+    glm::vec3 scale;
+    glm::vec3 offset;
+
+    VertexPacking() : scale(1.0f), offset(0.0f) {}
+};
+
+// Packs count vertices into out. Each position axis is quantized to 16 bits
+// in steps of step starting at the smallest value on that axis; an axis with
+// step 0 is instead fit to the extent of the vertices. Grids pass their cell
+// size for x and z so those come out as exact column and row indices.
+// The work is split across bands threads, 0 for one per core.
+// Returns false, leaving out empty, if an axis does not fit in 16 bits; the
+// caller then has to keep the float layout.
+bool packVertices(const Vertex *verts, int count, const glm::vec3& step, QVector<CompactVertex>& out,
+                  VertexPacking& packing, int bands = 0);
+
+#endif // VERTEXPACK_H
@@ -6,6 +6,9 @@ in float colorPos;
 out vec4 glColor;
 
 void main(void) {
+    if(maskedOut())
+        discard;
+
     vec4 color = texture(tex, colorPos);
 
     glColor = color;
@@ -8,17 +8,27 @@ uniform mat4 mvpMatrix;
 
 //uniform sampler2D tex;
 uniform float heightScalar;
+
+// heightmap mode: the data values, one per DEM sample
+uniform sampler2D dataMap;
+
 out float colorPos;
 
 in float dataPoint;
 
 void main(void) {
     // get vertex position
-    vec3 newPos = v_position;
+    ivec2 cell;
+    vec3 position = terrainPosition(v_position, cell);
+
+    vec3 newPos = position;
     newPos.y = newPos.y * heightScalar;
     vec4 pos = (mvpMatrix * vec4(newPos,1.0));
 
-    colorPos = dataPoint - 0.35;//v_position.y - 0.35;
+    if(heightmap)
+        colorPos = texelFetch(dataMap, cell, 0).r - 0.35;
+    else
+        colorPos = dataPoint - 0.35;//v_position.y - 0.35;
     // set vertex position
     gl_Position = pos;//vec4(pos, 1.0f);//mvpMatrix * vec4(v_position, 1.0);
 }
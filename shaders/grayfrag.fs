@@ -6,6 +6,9 @@ in float colorPos;
 out vec4 glColor;
 
 void main(void) {
+    if(maskedOut())
+        discard;
+
     vec4 color = vec4(colorPos, colorPos, colorPos, 1);//texture1D(tex, colorPos);
 
     glColor = color;
@@ -12,11 +12,14 @@ out float colorPos;
 
 void main(void) {
     // get vertex position
-    vec3 newPos = v_position;
+    ivec2 cell;
+    vec3 position = terrainPosition(v_position, cell);
+
+    vec3 newPos = position;
     newPos.y = newPos.y * heightScalar;
     vec4 pos = (mvpMatrix * vec4(newPos,1.0));
 
-    colorPos = v_position.y;
+    colorPos = position.y;
     // set vertex position
     gl_Position = pos;//vec4(pos, 1.0f);//mvpMatrix * vec4(v_position, 1.0);
 }
@@ -0,0 +1,45 @@
+#version 410
+in vec3 v_position;
+
+uniform mat4 mvpMatrix;
+
+uniform float heightScalar;
+
+// decodes compact vertices, identity for float ones
+uniform vec3 positionScale;
+uniform vec3 positionOffset;
+
+// the resident time steps of the data layer, one layer per step and one
+// texel per grid vertex
+uniform sampler2DArray series;
+uniform int gridWidth;
+uniform float seriesLayer;
+
+out float colorPos;
+out vec2 gridPos;             // series terrains are never heightmaps
+
+void main(void) {
+    // get vertex position
+    vec3 position = v_position * positionScale + positionOffset;
+    vec3 newPos = position;
+    newPos.y = newPos.y * heightScalar;
+
+    // vertices are one per DEM sample, row major. Terrains with LOD skirts
+    // after the grid never get a resident series.
+    ivec3 size = textureSize(series, 0);
+    ivec2 cell = ivec2(gl_VertexID % gridWidth, gl_VertexID / gridWidth);
+
+    // linear between the two layers around the current time
+    float layer = clamp(seriesLayer, 0.0, float(size.z - 1));
+    int l0 = int(layer);
+    int l1 = min(l0 + 1, size.z - 1);
+
+    float a = texelFetch(series, ivec3(cell, l0), 0).r;
+    float b = texelFetch(series, ivec3(cell, l1), 0).r;
+
+    colorPos = mix(a, b, layer - float(l0)) - 0.35;
+    gridPos = vec2(0.0);
+
+    // set vertex position
+    gl_Position = mvpMatrix * vec4(newPos, 1.0);
+}
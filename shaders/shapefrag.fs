@@ -1,6 +1,6 @@
 #version 410
 
-uniform vec4 lineColor;
+in vec4 lineColor;
 out vec4 glColor;
 
 void main(void) {
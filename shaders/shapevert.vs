@@ -1,11 +1,20 @@
 #version 410
 in vec3 v_position;
+in vec4 v_color;
 
 uniform mat4 mvpMatrix;
 uniform float heightScalar;
 
+// decodes compact vertices, identity for float ones
+uniform vec3 positionScale;
+uniform vec3 positionOffset;
+
+out vec4 lineColor;
+
 void main(void) {
-    vec3 newPos = v_position;
-    newPos.y = v_position.y * heightScalar;
+    vec3 position = v_position * positionScale + positionOffset;
+    vec3 newPos = position;
+    newPos.y = position.y * heightScalar;
     gl_Position = (mvpMatrix * vec4(newPos,1.0));
+    lineColor = v_color;
 }
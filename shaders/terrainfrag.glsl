@@ -0,0 +1,29 @@
+// Shared by the terrain fragment shaders; Graphics::loadShader puts it right
+// after their #version line.
+
+// heightmap mode: 1 draws only outside the mask, 2 only inside it. Meshes
+// split the mask in their index lists and draw with 0.
+uniform int maskMode;
+uniform usampler2D maskMap;     // 1 for DEM samples in the mask
+uniform ivec2 gridSize;
+in vec2 gridPos;
+
+// Whether the fragment is on the side of the mask maskMode leaves out. Like
+// TriangleMask, whole triangles are in the mask when all three corners are:
+// cells split along the diagonal from (x+1, z) to (x, z+1), the upper
+// triangle holding (x, z) and the lower one (x+1, z+1).
+bool maskedOut()
+{
+    if(maskMode == 0)
+        return false;
+
+    ivec2 cell = clamp(ivec2(floor(gridPos)), ivec2(0), max(gridSize - 2, ivec2(0)));
+    vec2 f = gridPos - vec2(cell);
+    ivec2 corner = (f.x + f.y <= 1.0) ? cell : cell + ivec2(1);
+
+    bool inside = texelFetch(maskMap, cell + ivec2(1, 0), 0).r != 0u
+               && texelFetch(maskMap, cell + ivec2(0, 1), 0).r != 0u
+               && texelFetch(maskMap, corner, 0).r != 0u;
+
+    return (maskMode == 1) == inside;
+}
@@ -0,0 +1,39 @@
+// Shared by the terrain vertex shaders; Graphics::loadShader puts it right
+// after their #version line.
+
+// decodes compact vertices, identity for float ones
+uniform vec3 positionScale;
+uniform vec3 positionOffset;
+
+// heightmap mode: the vertices are one patch of a shared grid mesh drawn
+// instanced, displaced by heightMap
+uniform bool heightmap;
+in vec2 v_grid;
+
+uniform sampler2D heightMap;
+uniform ivec2 gridSize;
+uniform float gridScale;
+uniform int patchesX;
+uniform int patchSize;
+
+// grid coordinates, for the fragment shader to find its mask triangle
+out vec2 gridPos;
+
+// Model space position of the vertex at v_position. In heightmap mode cell
+// is the DEM sample the vertex sits on.
+vec3 terrainPosition(vec3 vertex, out ivec2 cell)
+{
+    cell = ivec2(0);
+    gridPos = vec2(0.0);
+
+    if(!heightmap)
+        return vertex * positionScale + positionOffset;
+
+    // cells past the DEM edge clamp onto it and their triangles collapse
+    ivec2 origin = ivec2(gl_InstanceID % patchesX, gl_InstanceID / patchesX) * patchSize;
+    cell = min(origin + ivec2(v_grid), gridSize - 1);
+    gridPos = vec2(cell);
+
+    vec2 xz = vec2(cell - gridSize / 2) * gridScale;
+    return vec3(xz.x, texelFetch(heightMap, cell, 0).r, xz.y);
+}